@@ -1,25 +1,34 @@
 #include <esp_console.h>
 #include <esp_event.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#ifndef CONFIG_IDF_TARGET_LINUX
 #include <soc/soc.h>
 #include <soc/rtc_cntl_reg.h>
-#include <unistd.h>
+#endif
 
 #include "commands.h"
+#include "latency.h"
 #include "hardware/led.h"
+#include "hardware/power.h"
 #include "hardware/spi.h"
 #include "hardware/storage.h"
 #include "hardware/wifi.h"
 
+#include "tasks/link_manager.h"
 #include "tasks/network_manager.h"
 #include "tasks/socket_manager.h"
 #include "tasks/status_indicator.h"
 
 #define CONFIG_CONSOLE_MAX_COMMAND_LINE_LENGTH 1024
 
+// Time-critical tasks get a core to themselves where there is more than one
+#define LINK_CORE (portNUM_PROCESSORS - 1)
+
 void init_console()
 {
     esp_console_repl_t* repl = NULL;
-    esp_console_dev_uart_config_t uart_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
 
     esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
     repl_config.max_cmdline_length = CONFIG_CONSOLE_MAX_COMMAND_LINE_LENGTH;
@@ -30,7 +39,12 @@ void init_console()
 
     cmds_register();
 
+#ifdef CONFIG_IDF_TARGET_LINUX
+    ESP_ERROR_CHECK(esp_console_new_repl_stdio(&repl_config, &repl));
+#else
+    esp_console_dev_uart_config_t uart_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_console_new_repl_uart(&uart_config, &repl_config, &repl));
+#endif
     ESP_ERROR_CHECK(esp_console_start_repl(repl));
 }
 
@@ -39,12 +53,15 @@ void start_tasks()
     task_network_manager_start(0 /* core */, 2 /* priority */);
     task_status_indicator_start(0 /* core */, 1 /* priority */);
 
-    task_socket_manager_start(1 /* core */, 1 /* priority */);
+    task_link_manager_start(LINK_CORE, 10 /* priority */);
+    task_socket_manager_start(LINK_CORE, 1 /* priority */);
 }
 
 void app_main()
 {
+#ifndef CONFIG_IDF_TARGET_LINUX
     WRITE_PERI_REG(RTC_CNTL_BROWN_OUT_REG, 0);  // Disable brownout detector
+#endif
 
     esp_event_loop_create_default();
 
@@ -53,6 +70,9 @@ void app_main()
     spi_initialize();
     storage_initialize();
     wifi_initialize();
+    power_initialize();
+
+    latency_initialize();
 
     // Initialize REPL
     init_console();
@@ -60,10 +80,9 @@ void app_main()
     // Let's-a-go
     start_tasks();
 
-    while (true)
-    {
-        sleep(1);
-    }
+    // The tasks do the rest. Waiting here without a timeout lets the CPU
+    // sleep whenever they are idle.
+    vTaskSuspend(NULL);
 
     wifi_deinitialize();
     storage_deinitialize();
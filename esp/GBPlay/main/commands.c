@@ -1,14 +1,30 @@
 #include <argtable3/argtable3.h>
 #include <esp_console.h>
 #include <esp_log.h>
+#include <esp_system.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+#include <esp_heap_caps.h>
+#endif
 
 #include "http.h"
+#include "latency.h"
+#include "ota.h"
 #include "hardware/spi.h"
 #include "hardware/storage.h"
 #include "hardware/wifi.h"
 
 #define DEFAULT_SCAN_LIST_SIZE 10
 
+// More than the number of tasks the firmware and ESP-IDF start
+#define MAX_REPORTED_TASKS 32
+
 static struct {
     struct arg_lit* save;
     struct arg_str* ssid;
@@ -21,6 +37,12 @@ static struct {
     struct arg_end* end;
 } http_get_args;
 
+static struct {
+    struct arg_str* url;
+    struct arg_str* sha256;
+    struct arg_end* end;
+} ota_args;
+
 static struct {
     struct arg_int* index;
     struct arg_end* end;
@@ -36,6 +58,11 @@ static struct {
     struct arg_end* end;
 } spi_exchange_args;
 
+static struct {
+    struct arg_lit* reset;
+    struct arg_end* end;
+} latency_args;
+
 static struct {
     struct arg_str* key;
     struct arg_str* value;
@@ -151,12 +178,80 @@ static int _http_get(int argc, char** argv)
     return (data_read < 0) ? 1 : 0;
 }
 
-static void _list_saved_networks(wifi_network_credentials* saved_networks, int count)
+static bool _parse_sha256(const char* hex, uint8_t* out_hash)
+{
+    if (strlen(hex) != OTA_SHA256_LENGTH * 2)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < OTA_SHA256_LENGTH; ++i)
+    {
+        unsigned int byte = 0;
+        if (sscanf(hex + (i * 2), "%2x", &byte) != 1)
+        {
+            return false;
+        }
+        out_hash[i] = byte;
+    }
+
+    return true;
+}
+
+static int _ota_update(int argc, char** argv)
+{
+    if (!wifi_is_connected())
+    {
+        ESP_LOGI(__func__, "Please first establish a connection");
+        return 1;
+    }
+
+    int nerrors = arg_parse(argc, argv, (void**)&ota_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, ota_args.end, argv[0]);
+        return 1;
+    }
+
+    uint8_t sha256[OTA_SHA256_LENGTH] = {0};
+    if (!_parse_sha256(ota_args.sha256->sval[0], sha256))
+    {
+        ESP_LOGE(__func__, "Expected a SHA-256 of %d hex digits", OTA_SHA256_LENGTH * 2);
+        return 1;
+    }
+
+    if (!ota_update(ota_args.url->sval[0], sha256))
+    {
+        ESP_LOGE(__func__, "Firmware update failed");
+        return 1;
+    }
+
+    ESP_LOGI(__func__, "Restarting into the new firmware");
+    storage_flush();
+    esp_restart();
+
+    return 0;
+}
+
+static void _list_saved_networks()
 {
+    int count = wifi_get_saved_network_count();
     ESP_LOGI(__func__, "Total saved networks = %d", count);
+
     for (int i = 0; i < count; ++i)
     {
-        ESP_LOGI(__func__, "%d: %s", i, saved_networks[i].ssid);
+        wifi_network_credentials network = {0};
+        if (wifi_get_saved_network_at(i, &network))
+        {
+            ESP_LOGI(
+                __func__,
+                "%d: %s (%d connections, %d recent failures)",
+                i,
+                network.ssid,
+                network.connect_count,
+                network.failure_count
+            );
+        }
     }
 }
 
@@ -169,25 +264,22 @@ static int _load_connection(int argc, char** argv)
         return 1;
     }
 
-    wifi_network_credentials saved_networks[WIFI_MAX_SAVED_NETWORKS] = {0};
-    int saved_network_count = wifi_get_all_saved_networks(saved_networks);
-
     if (load_connection_args.index->count == 0)
     {
-        _list_saved_networks(saved_networks, saved_network_count);
+        _list_saved_networks();
         return 0;
     }
     else
     {
         int index = load_connection_args.index->ival[0];
-        if (index < 0 || index >= saved_network_count)
+        wifi_network_credentials ap = {0};
+        if (!wifi_get_saved_network_at(index, &ap))
         {
             ESP_LOGE(__func__, "No saved network with index %d", index);
             return 1;
         }
 
-        wifi_network_credentials* ap = &saved_networks[index];
-        return wifi_connect(ap->ssid, ap->pass, true /* force */) ? 0 : 1;
+        return wifi_connect(ap.ssid, ap.pass, true /* force */) ? 0 : 1;
     }
 }
 
@@ -200,24 +292,22 @@ static int _forget_connection(int argc, char** argv)
         return 1;
     }
 
-    wifi_network_credentials saved_networks[WIFI_MAX_SAVED_NETWORKS] = {0};
-    int saved_network_count = wifi_get_all_saved_networks(saved_networks);
-
     if (forget_connection_args.index->count == 0)
     {
-        _list_saved_networks(saved_networks, saved_network_count);
+        _list_saved_networks();
         return 0;
     }
     else
     {
         int index = forget_connection_args.index->ival[0];
-        if (index < 0 || index >= saved_network_count)
+        wifi_network_credentials ap = {0};
+        if (!wifi_get_saved_network_at(index, &ap))
         {
             ESP_LOGE(__func__, "No saved network with index %d", index);
             return 1;
         }
 
-        wifi_forget_network(saved_networks[index].ssid);
+        wifi_forget_network(ap.ssid);
         return 0;
     }
 }
@@ -238,6 +328,124 @@ static int _spi_exchange(int argc, char** argv)
     return 0;
 }
 
+static int _link_mode(int argc, char** argv)
+{
+    static const char* speed_names[SPI_CLOCK_SPEED_COUNT] = {
+        [SPI_CLOCK_SPEED_NORMAL]      = "normal",
+        [SPI_CLOCK_SPEED_DOUBLE]      = "double speed",
+        [SPI_CLOCK_SPEED_FAST]        = "high speed",
+        [SPI_CLOCK_SPEED_FAST_DOUBLE] = "high speed, double speed"
+    };
+
+    if (spi_get_role() == SPI_ROLE_SLAVE)
+    {
+        ESP_LOGI(__func__, "Clock driven by the Game Boy");
+    }
+    else
+    {
+        spi_clock_speed speed = spi_get_clock_speed();
+        ESP_LOGI(
+            __func__,
+            "Clock driven by us at %" PRIu32 " Hz (%s)",
+            spi_get_clock_speed_hz(speed),
+            speed_names[speed]
+        );
+    }
+
+    return 0;
+}
+
+static int _memory_status(int argc, char** argv)
+{
+#ifndef CONFIG_IDF_TARGET_LINUX
+    multi_heap_info_t heap = {0};
+    heap_caps_get_info(&heap, MALLOC_CAP_8BIT);
+
+    // Share of free memory that can't be used for the largest allocation
+    int fragmentation = (heap.total_free_bytes > 0)
+        ? 100 - (int)((uint64_t)heap.largest_free_block * 100 / heap.total_free_bytes)
+        : 0;
+
+    ESP_LOGI(
+        __func__,
+        "Heap: %u bytes free (lowest %u), %u bytes allocated in %u blocks",
+        (unsigned)heap.total_free_bytes,
+        (unsigned)heap.minimum_free_bytes,
+        (unsigned)heap.total_allocated_bytes,
+        (unsigned)heap.allocated_blocks
+    );
+    ESP_LOGI(
+        __func__,
+        "Largest free block: %u bytes (%d%% fragmented)",
+        (unsigned)heap.largest_free_block,
+        fragmentation
+    );
+#endif
+
+#if configUSE_TRACE_FACILITY
+    // Too big for the console task's stack
+    static TaskStatus_t s_tasks[MAX_REPORTED_TASKS];
+
+    UBaseType_t task_count = uxTaskGetSystemState(s_tasks, MAX_REPORTED_TASKS, NULL);
+    if (task_count == 0)
+    {
+        ESP_LOGE(__func__, "More than %d tasks are running", MAX_REPORTED_TASKS);
+        return 1;
+    }
+
+    // Stack that has never been used, since the task started
+    ESP_LOGI(__func__, "Unused stack per task:");
+    for (int i = 0; i < task_count; ++i)
+    {
+        ESP_LOGI(
+            __func__,
+            "%-16s %6u bytes (priority %u)",
+            s_tasks[i].pcTaskName,
+            (unsigned)s_tasks[i].usStackHighWaterMark,
+            (unsigned)s_tasks[i].uxCurrentPriority
+        );
+    }
+#else
+    ESP_LOGW(__func__, "Task stacks can't be reported without CONFIG_FREERTOS_USE_TRACE_FACILITY");
+#endif
+
+    return 0;
+}
+
+static int _latency(int argc, char** argv)
+{
+    int nerrors = arg_parse(argc, argv, (void**)&latency_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, latency_args.end, argv[0]);
+        return 1;
+    }
+
+    for (int i = 0; i < LATENCY_STAGE_COUNT; ++i)
+    {
+        latency_stats stats = {0};
+        latency_get_stats(i, &stats);
+
+        ESP_LOGI(
+            __func__,
+            "%-14s n=%-8" PRIu32 " p50=%-8" PRIu32 " p95=%-8" PRIu32 " p99=%-8" PRIu32 " max=%" PRIu32 " (us)",
+            latency_stage_name(i),
+            stats.count,
+            stats.p50_us,
+            stats.p95_us,
+            stats.p99_us,
+            stats.max_us
+        );
+    }
+
+    if (latency_args.reset->count > 0)
+    {
+        latency_reset();
+    }
+
+    return 0;
+}
+
 static int _set_value(int argc, char** argv)
 {
     int nerrors = arg_parse(argc, argv, (void**)&set_value_args);
@@ -251,6 +459,9 @@ static int _set_value(int argc, char** argv)
     const char* value = set_value_args.value->sval[0];
 
     storage_set_string(key, value);
+
+    // Settings are often changed right before a restart
+    storage_flush();
     return 0;
 }
 
@@ -289,6 +500,7 @@ static int _delete_value(int argc, char** argv)
 
     const char* key = delete_value_args.key->sval[0];
     storage_delete(key);
+    storage_flush();
 
     return 0;
 }
@@ -363,6 +575,23 @@ static void _register_http_get()
     ESP_ERROR_CHECK(esp_console_cmd_register(&get_def));
 }
 
+static void _register_ota()
+{
+    ota_args.url = arg_str1(NULL, NULL, "url", "URL of the firmware image (.bin)");
+    ota_args.sha256 = arg_str1(NULL, NULL, "sha256", "SHA-256 of the firmware image, in hex");
+    ota_args.end = arg_end(10 /* max error count */);
+
+    const esp_console_cmd_t ota_def = {
+        .command = "ota",
+        .help = "Download and install new firmware, then restart",
+        .hint = NULL,
+        .func = &_ota_update,
+        .argtable = &ota_args
+    };
+
+    ESP_ERROR_CHECK(esp_console_cmd_register(&ota_def));
+}
+
 void _register_load_connection()
 {
     load_connection_args.index = arg_int0(
@@ -423,6 +652,46 @@ void _register_spi_exchange()
     ESP_ERROR_CHECK(esp_console_cmd_register(&spi_def));
 }
 
+void _register_link_mode()
+{
+    const esp_console_cmd_t link_mode_def = {
+        .command = "link-mode",
+        .help = "Report which side drives the link clock and at what speed",
+        .hint = NULL,
+        .func = &_link_mode
+    };
+
+    ESP_ERROR_CHECK(esp_console_cmd_register(&link_mode_def));
+}
+
+void _register_latency()
+{
+    latency_args.reset = arg_lit0("r", "reset", "Clear the statistics after reporting them");
+    latency_args.end = arg_end(10 /* max error count */);
+
+    const esp_console_cmd_t latency_def = {
+        .command = "latency",
+        .help = "Report how long each stage of handling link requests takes",
+        .hint = NULL,
+        .func = &_latency,
+        .argtable = &latency_args
+    };
+
+    ESP_ERROR_CHECK(esp_console_cmd_register(&latency_def));
+}
+
+void _register_memory_status()
+{
+    const esp_console_cmd_t memory_def = {
+        .command = "mem",
+        .help = "Report heap low-water mark and fragmentation, and unused stack per task",
+        .hint = NULL,
+        .func = &_memory_status
+    };
+
+    ESP_ERROR_CHECK(esp_console_cmd_register(&memory_def));
+}
+
 void _register_set_value()
 {
     set_value_args.key = arg_str1(NULL, NULL, "key", "The ID of the value to store");
@@ -480,11 +749,15 @@ void cmds_register()
     _register_wifi_status();
 
     _register_http_get();
+    _register_ota();
 
     _register_load_connection();
     _register_forget_connection();
 
     _register_spi_exchange();
+    _register_link_mode();
+    _register_latency();
+    _register_memory_status();
 
     _register_set_value();
     _register_get_value();
@@ -0,0 +1,442 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "datagram_stream.h"
+#include "socket.h"
+
+#define DATAGRAM_FLAG_SYN (1 << 0)  // Opening the stream
+#define DATAGRAM_FLAG_FIN (1 << 1)  // Closing the stream
+
+// Keeps datagrams under the usual MTU
+#define MAX_DATAGRAM_DATA 1024
+
+#define TX_BUFFER_SIZE 2048
+#define RX_BUFFER_SIZE 2048
+
+// Unacknowledged data is sent again after this long without an
+// acknowledgement
+#define RETRANSMIT_INTERVAL_US (20 * 1000)
+
+// How often to repeat the request to open the stream
+#define SYN_INTERVAL_MS 200
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef struct __attribute__((packed)) {
+    uint32_t stream_id;
+    uint8_t flags;
+    uint32_t ack;  // Number of bytes received from the peer
+    uint32_t seq;  // Stream position of the first data byte
+} datagram_header;
+
+static int s_sock = -1;
+static uint32_t s_stream_id = 0;
+static bool s_peer_responded = false;
+static bool s_peer_closed = false;
+
+// Sent data which hasn't been acknowledged. The first byte is at stream
+// position s_tx_acked.
+static uint8_t s_tx_buf[TX_BUFFER_SIZE];
+static size_t s_tx_len = 0;
+static uint32_t s_tx_acked = 0;
+static int64_t s_last_tx_time = 0;
+
+// Received data which hasn't been read
+static uint8_t s_rx_buf[RX_BUFFER_SIZE];
+static size_t s_rx_start = 0;
+static size_t s_rx_len = 0;
+static uint32_t s_rx_total = 0;
+
+static uint8_t s_datagram[sizeof(datagram_header) + MAX_DATAGRAM_DATA];
+
+// Stream positions wrap around, so compare them by their distance
+static int32_t _distance(uint32_t from, uint32_t to)
+{
+    return (int32_t)(to - from);
+}
+
+static void _send(uint8_t flags, uint32_t seq, size_t data_len)
+{
+    datagram_header header = {
+        .stream_id = s_stream_id,
+        .flags = flags,
+        .ack = s_rx_total,
+        .seq = seq
+    };
+
+    memcpy(s_datagram, &header, sizeof(header));
+    memcpy(s_datagram + sizeof(header), s_tx_buf + _distance(s_tx_acked, seq), data_len);
+
+    // A datagram that can't be sent is no different from one that gets lost
+    if (send(s_sock, s_datagram, sizeof(header) + data_len, MSG_DONTWAIT) < 0)
+    {
+        ESP_LOGD(__func__, "Unable to send datagram: errno %d", errno);
+    }
+}
+
+// Sends unacknowledged data, ending with the newest
+static void _send_newest()
+{
+    size_t data_len = MIN(s_tx_len, MAX_DATAGRAM_DATA);
+    _send(0, s_tx_acked + (s_tx_len - data_len), data_len);
+    s_last_tx_time = esp_timer_get_time();
+}
+
+// Sends unacknowledged data, starting with the oldest
+static void _send_oldest()
+{
+    _send(0, s_tx_acked, MIN(s_tx_len, MAX_DATAGRAM_DATA));
+    s_last_tx_time = esp_timer_get_time();
+}
+
+static void _handle_ack(uint32_t ack)
+{
+    int32_t acked_len = _distance(s_tx_acked, ack);
+    if (acked_len <= 0 || acked_len > s_tx_len)
+    {
+        // Old or bogus
+        return;
+    }
+
+    memmove(s_tx_buf, s_tx_buf + acked_len, s_tx_len - acked_len);
+    s_tx_len -= acked_len;
+    s_tx_acked = ack;
+}
+
+static void _handle_data(uint32_t seq, const uint8_t* data, size_t data_len)
+{
+    // Only bytes continuing from what was already received are kept. Anything
+    // past a gap will be sent again along with the missing bytes.
+    int32_t offset = _distance(seq, s_rx_total);
+    if (offset < 0 || offset >= data_len)
+    {
+        return;
+    }
+
+    if (s_rx_start > 0)
+    {
+        memmove(s_rx_buf, s_rx_buf + s_rx_start, s_rx_len);
+        s_rx_start = 0;
+    }
+
+    size_t new_len = MIN(data_len - offset, sizeof(s_rx_buf) - s_rx_len);
+    memcpy(s_rx_buf + s_rx_len, data + offset, new_len);
+    s_rx_len += new_len;
+    s_rx_total += new_len;
+}
+
+static bool _receive_datagrams()
+{
+    bool should_ack = false;
+
+    while (true)
+    {
+        ssize_t len = recv(s_sock, s_datagram, sizeof(s_datagram), MSG_DONTWAIT);
+        if (len < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                break;
+            }
+
+            ESP_LOGE(__func__, "Error receiving datagram: errno %d", errno);
+            return false;
+        }
+
+        datagram_header header = {0};
+        if (len < sizeof(header))
+        {
+            continue;
+        }
+
+        memcpy(&header, s_datagram, sizeof(header));
+        if (header.stream_id != s_stream_id)
+        {
+            continue;
+        }
+
+        s_peer_responded = true;
+        if (header.flags & DATAGRAM_FLAG_FIN)
+        {
+            s_peer_closed = true;
+        }
+
+        _handle_ack(header.ack);
+
+        size_t data_len = len - sizeof(header);
+        if (data_len > 0)
+        {
+            _handle_data(header.seq, s_datagram + sizeof(header), data_len);
+            should_ack = true;
+        }
+    }
+
+    // Acknowledge right away so the server doesn't resend
+    if (should_ack)
+    {
+        _send(0, s_tx_acked, 0);
+    }
+
+    return true;
+}
+
+static bool _service()
+{
+    if (!_receive_datagrams())
+    {
+        return false;
+    }
+
+    if (s_tx_len > 0 && esp_timer_get_time() - s_last_tx_time >= RETRANSMIT_INTERVAL_US)
+    {
+        _send_oldest();
+    }
+
+    return true;
+}
+
+// Waits until a datagram arrives, a retransmission is due, the other file
+// descriptor is readable, or the deadline passes
+static bool _wait(int64_t deadline, int other_fd, bool* out_other_ready)
+{
+    int64_t now = esp_timer_get_time();
+    if (deadline >= 0 && now >= deadline)
+    {
+        errno = ETIMEDOUT;
+        return false;
+    }
+
+    int64_t wake_time = deadline;
+    if (s_tx_len > 0)
+    {
+        int64_t retransmit_time = s_last_tx_time + RETRANSMIT_INTERVAL_US;
+        wake_time = (wake_time < 0) ? retransmit_time : MIN(wake_time, retransmit_time);
+    }
+
+    int timeout_ms = (wake_time < 0) ? -1 : MAX(0, (wake_time - now + 999) / 1000);
+
+    struct pollfd fds[] = {
+        { .fd = s_sock, .events = POLLIN },
+        { .fd = other_fd, .events = POLLIN }
+    };
+
+    int rc = poll(fds, (other_fd >= 0) ? 2 : 1, timeout_ms);
+    if (rc < 0 && errno != EINTR)
+    {
+        ESP_LOGE(__func__, "Failed waiting for datagram: errno %d", errno);
+        return false;
+    }
+
+    if (out_other_ready != NULL)
+    {
+        *out_other_ready = (rc > 0 && other_fd >= 0 && (fds[1].revents & POLLIN));
+    }
+
+    return true;
+}
+
+int datagram_stream_connect(const struct sockaddr_in* address, int timeout_ms)
+{
+    if (s_sock >= 0)
+    {
+        ESP_LOGE(__func__, "Only one datagram stream can be open at a time");
+        return -1;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        ESP_LOGE(__func__, "Unable to create socket: errno %d", errno);
+        return -1;
+    }
+
+    // Only accept datagrams from the server
+    if (connect(sock, (const struct sockaddr*)address, sizeof(*address)) < 0)
+    {
+        ESP_LOGE(__func__, "Socket unable to connect: errno %d", errno);
+        close(sock);
+        return -1;
+    }
+
+    s_sock = sock;
+    s_stream_id = (uint32_t)esp_timer_get_time();
+    s_peer_responded = false;
+    s_peer_closed = false;
+    s_tx_len = 0;
+    s_tx_acked = 0;
+    s_rx_start = 0;
+    s_rx_len = 0;
+    s_rx_total = 0;
+
+    int64_t deadline = esp_timer_get_time() + ((int64_t)timeout_ms * 1000);
+    while (!s_peer_responded)
+    {
+        int64_t now = esp_timer_get_time();
+        if (now >= deadline)
+        {
+            ESP_LOGE(__func__, "Timed out waiting for server to open stream after %d ms", timeout_ms);
+            break;
+        }
+
+        _send(DATAGRAM_FLAG_SYN, 0, 0);
+
+        struct pollfd fds[] = {{
+            .fd = sock,
+            .events = POLLIN
+        }};
+        poll(fds, 1, MIN(SYN_INTERVAL_MS, (deadline - now + 999) / 1000));
+
+        if (!_receive_datagrams())
+        {
+            break;
+        }
+    }
+
+    if (!s_peer_responded || s_peer_closed)
+    {
+        close(sock);
+        s_sock = -1;
+        return -1;
+    }
+
+    return sock;
+}
+
+bool datagram_stream_owns(int sock)
+{
+    return sock >= 0 && sock == s_sock;
+}
+
+bool datagram_stream_read(int sock, uint8_t* out_buf, size_t buf_len, int64_t deadline)
+{
+    size_t bytes_read = 0;
+
+    while (true)
+    {
+        if (!_service())
+        {
+            return false;
+        }
+
+        size_t len = MIN(s_rx_len, buf_len - bytes_read);
+        memcpy(out_buf + bytes_read, s_rx_buf + s_rx_start, len);
+        s_rx_start += len;
+        s_rx_len -= len;
+        bytes_read += len;
+
+        if (bytes_read == buf_len)
+        {
+            return true;
+        }
+
+        if (s_peer_closed)
+        {
+            ESP_LOGE(__func__, "Stream closed when reading");
+            return false;
+        }
+
+        if (!_wait(deadline, -1, NULL))
+        {
+            ESP_LOGE(__func__, "Timed out reading stream data");
+            return false;
+        }
+    }
+}
+
+bool datagram_stream_write(int sock, const uint8_t* buf, size_t buf_len, int64_t deadline)
+{
+    size_t bytes_written = 0;
+
+    while (true)
+    {
+        if (!_service())
+        {
+            return false;
+        }
+
+        if (s_peer_closed)
+        {
+            ESP_LOGE(__func__, "Stream closed when writing");
+            return false;
+        }
+
+        size_t len = MIN(MIN(buf_len - bytes_written, sizeof(s_tx_buf) - s_tx_len), MAX_DATAGRAM_DATA);
+        if (len > 0)
+        {
+            memcpy(s_tx_buf + s_tx_len, buf + bytes_written, len);
+            s_tx_len += len;
+            bytes_written += len;
+
+            // Older unacknowledged bytes ride along with the new ones
+            _send_newest();
+        }
+
+        if (bytes_written == buf_len)
+        {
+            return true;
+        }
+
+        // Wait for acknowledgements to make room
+        if (!_wait(deadline, -1, NULL))
+        {
+            ESP_LOGE(__func__, "Timed out writing stream data");
+            return false;
+        }
+    }
+}
+
+int datagram_stream_poll(int sock, int other_fd, int timeout_ms)
+{
+    int64_t deadline = (timeout_ms < 0) ? -1 : esp_timer_get_time() + ((int64_t)timeout_ms * 1000);
+
+    while (true)
+    {
+        if (!_service())
+        {
+            return -1;
+        }
+
+        int ready = (s_rx_len > 0 || s_peer_closed) ? SOCKET_POLL_READABLE : 0;
+        bool other_ready = false;
+
+        if (ready)
+        {
+            // Don't hold up the other file descriptor behind a busy stream
+            struct pollfd fds[] = {{
+                .fd = other_fd,
+                .events = POLLIN
+            }};
+            other_ready = other_fd >= 0 && poll(fds, 1, 0) > 0 && (fds[0].revents & POLLIN);
+        }
+        else if (!_wait(deadline, other_fd, &other_ready))
+        {
+            return (errno == ETIMEDOUT) ? 0 : -1;
+        }
+
+        if (other_ready)
+        {
+            ready |= SOCKET_POLL_OTHER;
+        }
+
+        if (ready)
+        {
+            return ready;
+        }
+    }
+}
+
+void datagram_stream_close(int sock)
+{
+    // Best effort. The server times out streams that go quiet anyway.
+    _send(DATAGRAM_FLAG_FIN, s_tx_acked, 0);
+
+    close(sock);
+    s_sock = -1;
+}
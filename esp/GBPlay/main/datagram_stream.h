@@ -0,0 +1,82 @@
+#ifndef _DATAGRAM_STREAM_H
+#define _DATAGRAM_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+/*
+    Reliable, ordered byte stream carried over UDP.
+
+    Every datagram starts with the stream ID, flags, the number of bytes
+    received from the peer so far (the acknowledgement), and the stream
+    position of the data it carries. Data datagrams repeat every byte the
+    peer has not acknowledged yet, up to the datagram size, so a lost
+    datagram is normally made up for by the next one instead of stalling the
+    stream until a retransmission.
+
+    Only one stream can be open at a time. These are used through the
+    functions in socket.h, which pass datagram stream sockets here.
+*/
+
+/*
+    Opens a stream to a server and waits for the server to acknowledge it.
+
+    @param address    Address to connect to
+    @param timeout_ms Number of milliseconds to wait before timing out
+
+    @returns The socket file descriptor, or -1 on error.
+*/
+int datagram_stream_connect(const struct sockaddr_in* address, int timeout_ms);
+
+/*
+    Checks whether a socket belongs to the open datagram stream.
+
+    @param sock Socket file descriptor
+*/
+bool datagram_stream_owns(int sock);
+
+/*
+    Reads data from the stream, retransmitting unacknowledged data while
+    waiting.
+
+    @param sock     Socket file descriptor of the stream
+    @param out_buf  [output] Buffer to store received data in
+    @param buf_len  Number of bytes to read
+    @param deadline Time (from esp_timer_get_time()) to give up at, or a
+                    negative number to wait forever
+
+    @returns Whether or not all of the data could be read.
+*/
+bool datagram_stream_read(int sock, uint8_t* out_buf, size_t buf_len, int64_t deadline);
+
+/*
+    Writes data to the stream. Returns once all of the data has been sent at
+    least once, which may not mean it has been acknowledged.
+
+    @param sock     Socket file descriptor of the stream
+    @param buf      Data to write
+    @param buf_len  Length of buf
+    @param deadline Time (from esp_timer_get_time()) to give up at, or a
+                    negative number to wait forever
+
+    @returns Whether or not all of the data could be written.
+*/
+bool datagram_stream_write(int sock, const uint8_t* buf, size_t buf_len, int64_t deadline);
+
+/*
+    Waits for stream data or for another file descriptor to become readable.
+    See socket_poll().
+*/
+int datagram_stream_poll(int sock, int other_fd, int timeout_ms);
+
+/*
+    Tells the server the stream is finished and closes its socket.
+
+    @param sock Socket file descriptor of the stream
+*/
+void datagram_stream_close(int sock);
+
+#endif
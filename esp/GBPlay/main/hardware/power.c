@@ -0,0 +1,54 @@
+#include <esp_log.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_wifi.h>
+
+#include "power.h"
+
+// Idle tasks don't need more, and the APB clock stays at 80 MHz down to here
+#define MIN_CPU_FREQ_MHZ 80
+
+static esp_pm_lock_handle_t s_session_lock;
+static bool s_is_session_active = false;
+
+void power_initialize()
+{
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = MIN_CPU_FREQ_MHZ,
+        .light_sleep_enable = true
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+
+    // Holding this keeps the CPU at full speed, which also rules out sleep
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "session", &s_session_lock));
+
+    // Pins are chosen by spi_arm_link_wakeup()
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+}
+
+void power_set_session_active(bool is_active)
+{
+    if (is_active == s_is_session_active)
+    {
+        return;
+    }
+
+    if (is_active)
+    {
+        ESP_ERROR_CHECK(esp_pm_lock_acquire(s_session_lock));
+
+        // Modem sleep delays incoming packets until the next beacon
+        ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
+    }
+    else
+    {
+        ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+        ESP_ERROR_CHECK(esp_pm_lock_release(s_session_lock));
+    }
+
+    s_is_session_active = is_active;
+    ESP_LOGI(__func__, "Session %s. Sleep is %s.", is_active ? "started" : "ended", is_active ? "off" : "on");
+}
@@ -0,0 +1,27 @@
+#ifndef _POWER_H
+#define _POWER_H
+
+#include <stdbool.h>
+
+/*
+    Enables automatic light sleep and Wi-Fi modem sleep. Must be called after
+    wifi_initialize(). The device starts out with no active session, so it
+    sleeps whenever it is idle.
+*/
+void power_initialize();
+
+/*
+    Keeps the device fully awake while a session needs low latency.
+
+    Without an active session, the CPU enters light sleep whenever no task
+    has work to do, and the Wi-Fi radio only wakes for the access point's
+    DTIM beacons (WIFI_PS_MIN_MODEM). Packets from the server then take up
+    to one DTIM period to arrive, which the access point decides and is
+    typically 100-300 ms. The Game Boy's link clock takes about 1 ms to wake
+    the device (see spi_arm_link_wakeup()).
+
+    @param is_active Whether a session is active
+*/
+void power_set_session_active(bool is_active);
+
+#endif
@@ -1,19 +1,179 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include <driver/gpio.h>
 #include <driver/spi_master.h>
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_private/cache_utils.h>
+#include <esp_rom_sys.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <hal/gpio_ll.h>
 #include <soc/spi_pins.h>
 
+#include "../ring_buffer.h"
 #include "spi.h"
 
 #define GB_SPI_MODE 3
-#define GB_SPI_CLOCK_SPEED_HZ 8000
 
 #define GB_SPI_HOST SPI2_HOST
 #define GB_PIN_MOSI SPI2_IOMUX_PIN_NUM_MOSI  // Pin 13
 #define GB_PIN_MISO SPI2_IOMUX_PIN_NUM_MISO  // Pin 12
 #define GB_PIN_SCLK SPI2_IOMUX_PIN_NUM_CLK   // Pin 14
 
+// Contiguous transfers are split into chunks of this size. While one chunk is
+// on the wire, the next is already queued so the bus doesn't go idle.
+#define SPI_DMA_CHUNK_SIZE 512
+#define SPI_QUEUE_SIZE     2
+
+// Gaps shorter than this are busy-waited, since blocking costs about as much
+#define GAP_SPIN_THRESHOLD_US 100
+
+// Bytes queued in each direction while the Game Boy drives the clock.
+// Must be powers of two.
+#define SLAVE_TX_BUFFER_SIZE 1024
+#define SLAVE_RX_BUFFER_SIZE 1024
+
+// A longer pause than this between clock edges means a new byte is starting.
+// Protects against getting out of sync if we start listening mid-transfer.
+#define SLAVE_BIT_TIMEOUT_US 1000
+
+// The clock is followed one edge at a time in an interrupt handler, which
+// takes a few microseconds to start. That keeps up with edges 30 us apart, but
+// not with the GBC's high-speed modes.
+#define SLAVE_MAX_CLOCK_SPEED SPI_CLOCK_SPEED_DOUBLE
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 static spi_device_handle_t _spi_slave_handle = NULL;
+static SemaphoreHandle_t s_spi_lock;
+static spi_role s_role = SPI_ROLE_MASTER;
+static spi_clock_speed s_clock_speed = SPI_CLOCK_SPEED_NORMAL;
+static int64_t s_last_exchange_end_time = 0;
 
-void spi_initialize()
+static const uint32_t s_clock_speeds_hz[SPI_CLOCK_SPEED_COUNT] = {
+    [SPI_CLOCK_SPEED_NORMAL]      = 8192,
+    [SPI_CLOCK_SPEED_DOUBLE]      = 16384,
+    [SPI_CLOCK_SPEED_FAST]        = 262144,
+    [SPI_CLOCK_SPEED_FAST_DOUBLE] = 524288
+};
+
+static esp_timer_handle_t s_gap_timer;
+static SemaphoreHandle_t s_gap_elapsed;
+
+// DMA can only access internal memory, so stage transfers here
+static DMA_ATTR uint8_t s_tx_dma_buf[SPI_QUEUE_SIZE][SPI_DMA_CHUNK_SIZE];
+static DMA_ATTR uint8_t s_rx_dma_buf[SPI_QUEUE_SIZE][SPI_DMA_CHUNK_SIZE];
+
+// Slave state. The shift registers are only touched by the clock ISR.
+static uint8_t s_slave_tx_storage[SLAVE_TX_BUFFER_SIZE];
+static uint8_t s_slave_rx_storage[SLAVE_RX_BUFFER_SIZE];
+static ring_buffer s_slave_tx_queue;
+static ring_buffer s_slave_rx_queue;
+static volatile uint8_t s_slave_idle_byte = 0xFF;
+static uint8_t s_slave_tx_shift;
+static uint8_t s_slave_rx_shift;
+static int s_slave_bit_count;
+static int64_t s_slave_last_edge_time;
+static spi_rx_callback s_slave_rx_callback = NULL;
+static void* s_slave_rx_callback_arg = NULL;
+static bool s_is_rx_callback_pending = false;
+
+// Shared with the clock ISR, which may run on the other core
+static portMUX_TYPE s_wakeup_lock = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool s_is_wakeup_armed = false;
+
+static void _on_gap_elapsed(void* arg)
+{
+    xSemaphoreGive(s_gap_elapsed);
+}
+
+static void IRAM_ATTR _load_next_slave_byte()
+{
+    // Have the next byte ready before the Game Boy starts clocking it
+    if (ring_buffer_read(&s_slave_tx_queue, &s_slave_tx_shift, 1) == 0)
+    {
+        s_slave_tx_shift = s_slave_idle_byte;
+    }
+    s_slave_rx_shift = 0;
+    s_slave_bit_count = 0;
+}
+
+// Goes back to following every clock edge. Must be called with
+// s_wakeup_lock held. Uses the GPIO registers directly, since the driver's
+// functions aren't in IRAM.
+static void IRAM_ATTR _disarm_wakeup()
+{
+    if (s_is_wakeup_armed)
+    {
+        s_is_wakeup_armed = false;
+        gpio_ll_wakeup_disable(&GPIO, GB_PIN_SCLK);
+        gpio_ll_set_intr_type(&GPIO, GB_PIN_SCLK, GPIO_INTR_ANYEDGE);
+    }
+}
+
+// Runs from IRAM, so it keeps following the clock while flash is being
+// written (storage commits and OTA updates disable the flash cache)
+static void IRAM_ATTR _on_slave_clock_edge(void* arg)
+{
+    if (s_is_wakeup_armed)
+    {
+        // The Game Boy just woke us up
+        portENTER_CRITICAL_ISR(&s_wakeup_lock);
+        _disarm_wakeup();
+        portEXIT_CRITICAL_ISR(&s_wakeup_lock);
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (s_slave_bit_count > 0 && (now - s_slave_last_edge_time) > SLAVE_BIT_TIMEOUT_US)
+    {
+        // Partial byte. Start over, but don't lose the byte we were sending.
+        s_slave_rx_shift = 0;
+        s_slave_bit_count = 0;
+    }
+    s_slave_last_edge_time = now;
+
+    // Mode 3: shift out on the falling edge, sample on the rising edge
+    if (gpio_ll_get_level(&GPIO, GB_PIN_SCLK) == 0)
+    {
+        gpio_ll_set_level(&GPIO, GB_PIN_MOSI, (s_slave_tx_shift >> (7 - s_slave_bit_count)) & 1);
+    }
+    else
+    {
+        s_slave_rx_shift = (s_slave_rx_shift << 1) | gpio_ll_get_level(&GPIO, GB_PIN_MISO);
+        if (++s_slave_bit_count == 8)
+        {
+            ring_buffer_write(&s_slave_rx_queue, &s_slave_rx_shift, 1);
+            _load_next_slave_byte();
+            s_is_rx_callback_pending = true;
+        }
+    }
+
+    // The callback may be in flash, so while the cache is off it waits for
+    // the next edge
+    if (s_is_rx_callback_pending && spi_flash_cache_enabled())
+    {
+        s_is_rx_callback_pending = false;
+        if (s_slave_rx_callback)
+        {
+            s_slave_rx_callback(s_slave_rx_callback_arg);
+        }
+    }
+}
+
+static void _add_master_device()
+{
+    spi_device_interface_config_t dev_config = {0};
+    dev_config.mode = GB_SPI_MODE;
+    dev_config.clock_speed_hz = s_clock_speeds_hz[s_clock_speed];
+    dev_config.spics_io_num = -1;
+    dev_config.queue_size = SPI_QUEUE_SIZE;
+    ESP_ERROR_CHECK(spi_bus_add_device(GB_SPI_HOST, &dev_config, &_spi_slave_handle));
+}
+
+static void _start_master()
 {
     spi_bus_config_t bus_config = {
         .mosi_io_num = GB_PIN_MOSI,
@@ -21,35 +181,315 @@ void spi_initialize()
         .sclk_io_num = GB_PIN_SCLK,
         .quadwp_io_num = -1,
         .quadhd_io_num = -1,
-        .max_transfer_sz = 1,
+        .max_transfer_sz = SPI_DMA_CHUNK_SIZE,
         .flags = SPICOMMON_BUSFLAG_MASTER,
         .intr_flags = 0
     };
-    ESP_ERROR_CHECK(spi_bus_initialize(GB_SPI_HOST, &bus_config, SPI_DMA_DISABLED));
+    ESP_ERROR_CHECK(spi_bus_initialize(GB_SPI_HOST, &bus_config, SPI_DMA_CH_AUTO));
 
-    spi_device_interface_config_t dev_config = {0};
-    dev_config.mode = GB_SPI_MODE;
-    dev_config.clock_speed_hz = GB_SPI_CLOCK_SPEED_HZ;
-    dev_config.spics_io_num = -1;
-    dev_config.queue_size = 1;
-    ESP_ERROR_CHECK(spi_bus_add_device(GB_SPI_HOST, &dev_config, &_spi_slave_handle));
+    _add_master_device();
 }
 
-void spi_deinitialize()
+static void _stop_master()
 {
     spi_bus_remove_device(_spi_slave_handle);
     spi_bus_free(GB_SPI_HOST);
 }
 
+static void _start_slave()
+{
+    // The ring buffers are reset here, while nothing else is using them
+    ring_buffer_init(&s_slave_tx_queue, s_slave_tx_storage, sizeof(s_slave_tx_storage));
+    ring_buffer_init(&s_slave_rx_queue, s_slave_rx_storage, sizeof(s_slave_rx_storage));
+    _load_next_slave_byte();
+    s_is_rx_callback_pending = false;
+
+    // The SPI peripheral can't act as a slave without a chip select line,
+    // which the link cable doesn't have. Follow the clock in software instead.
+    gpio_reset_pin(GB_PIN_MOSI);
+    gpio_set_direction(GB_PIN_MOSI, GPIO_MODE_OUTPUT);
+    gpio_set_level(GB_PIN_MOSI, 1);
+
+    gpio_reset_pin(GB_PIN_MISO);
+    gpio_set_direction(GB_PIN_MISO, GPIO_MODE_INPUT);
+
+    gpio_reset_pin(GB_PIN_SCLK);
+    gpio_set_direction(GB_PIN_SCLK, GPIO_MODE_INPUT);
+    gpio_set_intr_type(GB_PIN_SCLK, GPIO_INTR_ANYEDGE);
+    ESP_ERROR_CHECK(gpio_isr_handler_add(GB_PIN_SCLK, &_on_slave_clock_edge, NULL));
+}
+
+static void _stop_slave()
+{
+    portENTER_CRITICAL(&s_wakeup_lock);
+    _disarm_wakeup();
+    portEXIT_CRITICAL(&s_wakeup_lock);
+
+    gpio_isr_handler_remove(GB_PIN_SCLK);
+
+    gpio_reset_pin(GB_PIN_MOSI);
+    gpio_reset_pin(GB_PIN_MISO);
+    gpio_reset_pin(GB_PIN_SCLK);
+}
+
+void spi_initialize()
+{
+    s_spi_lock = xSemaphoreCreateMutex();
+    s_gap_elapsed = xSemaphoreCreateBinary();
+
+    esp_timer_create_args_t timer_args = {
+        .callback = &_on_gap_elapsed,
+        .name = "spi-gap"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_gap_timer));
+
+    // The slave clock handler must keep running while the flash cache is off
+    ESP_ERROR_CHECK(gpio_install_isr_service(ESP_INTR_FLAG_IRAM));
+
+    s_role = SPI_ROLE_MASTER;
+    _start_master();
+}
+
+void spi_deinitialize()
+{
+    if (s_role == SPI_ROLE_MASTER)
+    {
+        _stop_master();
+    }
+    else
+    {
+        _stop_slave();
+    }
+
+    esp_timer_delete(s_gap_timer);
+    vSemaphoreDelete(s_gap_elapsed);
+    vSemaphoreDelete(s_spi_lock);
+}
+
+static void _wait_until(int64_t deadline_us)
+{
+    int64_t remaining_us = deadline_us - esp_timer_get_time();
+
+    if (remaining_us > GAP_SPIN_THRESHOLD_US)
+    {
+        // Block on a hardware timer so other tasks can run in the meantime.
+        // Wake up a little early to absorb scheduling latency.
+        ESP_ERROR_CHECK(esp_timer_start_once(s_gap_timer, remaining_us - GAP_SPIN_THRESHOLD_US));
+        xSemaphoreTake(s_gap_elapsed, portMAX_DELAY);
+
+        remaining_us = deadline_us - esp_timer_get_time();
+    }
+
+    if (remaining_us > 0)
+    {
+        esp_rom_delay_us(remaining_us);
+    }
+}
+
+static void _exchange_contiguous(const uint8_t* tx, uint8_t* out_rx, size_t len)
+{
+    spi_transaction_t txns[SPI_QUEUE_SIZE] = {0};
+    size_t bytes_queued = 0;
+    size_t bytes_received = 0;
+    int in_flight = 0;
+    int next_slot = 0;
+
+    while (bytes_received < len)
+    {
+        // Keep the queue full so the next chunk starts as soon as possible
+        while (in_flight < SPI_QUEUE_SIZE && bytes_queued < len)
+        {
+            size_t chunk_len = MIN(len - bytes_queued, SPI_DMA_CHUNK_SIZE);
+            memcpy(s_tx_dma_buf[next_slot], tx + bytes_queued, chunk_len);
+
+            spi_transaction_t* txn = &txns[next_slot];
+            txn->length = chunk_len * 8;  // In bits
+            txn->tx_buffer = s_tx_dma_buf[next_slot];
+            txn->rx_buffer = s_rx_dma_buf[next_slot];
+            txn->user = (void*)bytes_queued;  // Offset into output buffer
+
+            ESP_ERROR_CHECK(spi_device_queue_trans(_spi_slave_handle, txn, portMAX_DELAY));
+
+            bytes_queued += chunk_len;
+            next_slot = (next_slot + 1) % SPI_QUEUE_SIZE;
+            ++in_flight;
+        }
+
+        // Transactions complete in the order they were queued
+        spi_transaction_t* done = NULL;
+        ESP_ERROR_CHECK(spi_device_get_trans_result(_spi_slave_handle, &done, portMAX_DELAY));
+
+        size_t chunk_len = done->length / 8;
+        memcpy(out_rx + (size_t)done->user, done->rx_buffer, chunk_len);
+
+        bytes_received += chunk_len;
+        --in_flight;
+    }
+
+    s_last_exchange_end_time = esp_timer_get_time();
+}
+
+static void _exchange_spaced(const uint8_t* tx, uint8_t* out_rx, size_t len, uint32_t gap_us)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        _wait_until(s_last_exchange_end_time + gap_us);
+
+        // Single bytes fit in the transaction itself. No DMA needed.
+        spi_transaction_t txn = {0};
+        txn.flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
+        txn.length = 8;  // In bits
+        txn.tx_data[0] = tx[i];
+        txn.rx_data[0] = 0xFF;
+
+        spi_transaction_t* done = NULL;
+        ESP_ERROR_CHECK(spi_device_queue_trans(_spi_slave_handle, &txn, portMAX_DELAY));
+        ESP_ERROR_CHECK(spi_device_get_trans_result(_spi_slave_handle, &done, portMAX_DELAY));
+
+        out_rx[i] = txn.rx_data[0];
+        s_last_exchange_end_time = esp_timer_get_time();
+    }
+}
+
 uint8_t spi_exchange_byte(uint8_t tx)
 {
     uint8_t rx = 0xFF;
+    spi_exchange_buffer(&tx, &rx, sizeof(tx), 0 /* gap_us */);
+    return rx;
+}
 
-    spi_transaction_t txn = {0};
-    txn.length = 8;  // In bits
-    txn.tx_buffer = &tx;
-    txn.rx_buffer = &rx;
+void spi_exchange_buffer(const uint8_t* tx, uint8_t* out_rx, size_t len, uint32_t gap_us)
+{
+    assert(xSemaphoreTake(s_spi_lock, portMAX_DELAY) == pdTRUE);
 
-    ESP_ERROR_CHECK(spi_device_transmit(_spi_slave_handle, &txn));
-    return rx;
+    if (s_role != SPI_ROLE_MASTER)
+    {
+        ESP_LOGE(__func__, "Cannot drive the clock while the Game Boy is driving it");
+        memset(out_rx, 0xFF, len);
+    }
+    else if (gap_us == 0 && len > 1)
+    {
+        _exchange_contiguous(tx, out_rx, len);
+    }
+    else
+    {
+        _exchange_spaced(tx, out_rx, len, gap_us);
+    }
+
+    xSemaphoreGive(s_spi_lock);
+}
+
+bool spi_set_role(spi_role role)
+{
+    assert(xSemaphoreTake(s_spi_lock, portMAX_DELAY) == pdTRUE);
+
+    if (role == SPI_ROLE_SLAVE && s_clock_speed > SLAVE_MAX_CLOCK_SPEED)
+    {
+        ESP_LOGE(__func__, "Cannot follow a %" PRIu32 " Hz clock", s_clock_speeds_hz[s_clock_speed]);
+        xSemaphoreGive(s_spi_lock);
+        return false;
+    }
+
+    if (role != s_role)
+    {
+        if (role == SPI_ROLE_SLAVE)
+        {
+            _stop_master();
+            _start_slave();
+        }
+        else
+        {
+            _stop_slave();
+            _start_master();
+        }
+
+        s_role = role;
+    }
+
+    xSemaphoreGive(s_spi_lock);
+    return true;
+}
+
+spi_role spi_get_role()
+{
+    return s_role;
+}
+
+bool spi_set_clock_speed(spi_clock_speed speed)
+{
+    assert(speed < SPI_CLOCK_SPEED_COUNT);
+    assert(xSemaphoreTake(s_spi_lock, portMAX_DELAY) == pdTRUE);
+
+    if (s_role == SPI_ROLE_SLAVE && speed > SLAVE_MAX_CLOCK_SPEED)
+    {
+        ESP_LOGE(__func__, "Cannot follow a %" PRIu32 " Hz clock", s_clock_speeds_hz[speed]);
+        xSemaphoreGive(s_spi_lock);
+        return false;
+    }
+
+    if (speed != s_clock_speed)
+    {
+        s_clock_speed = speed;
+
+        // The clock is configured per device, so re-add it
+        if (s_role == SPI_ROLE_MASTER)
+        {
+            spi_bus_remove_device(_spi_slave_handle);
+            _add_master_device();
+        }
+    }
+
+    xSemaphoreGive(s_spi_lock);
+    return true;
+}
+
+spi_clock_speed spi_get_clock_speed()
+{
+    return s_clock_speed;
+}
+
+uint32_t spi_get_clock_speed_hz(spi_clock_speed speed)
+{
+    return s_clock_speeds_hz[speed];
+}
+
+void spi_slave_set_idle_byte(uint8_t idle_byte)
+{
+    s_slave_idle_byte = idle_byte;
+}
+
+void spi_slave_set_rx_callback(spi_rx_callback callback, void* arg)
+{
+    s_slave_rx_callback_arg = arg;
+    s_slave_rx_callback = callback;
+}
+
+size_t spi_slave_queue_tx(const uint8_t* tx, size_t len)
+{
+    return ring_buffer_write(&s_slave_tx_queue, tx, len);
+}
+
+size_t spi_slave_read_rx(uint8_t* out_rx, size_t max_len)
+{
+    return ring_buffer_read(&s_slave_rx_queue, out_rx, max_len);
+}
+
+void spi_arm_link_wakeup()
+{
+    assert(xSemaphoreTake(s_spi_lock, portMAX_DELAY) == pdTRUE);
+
+    if (s_role == SPI_ROLE_SLAVE)
+    {
+        portENTER_CRITICAL(&s_wakeup_lock);
+        if (!s_is_wakeup_armed)
+        {
+            // Only a level can wake the CPU. The clock idles high, so the
+            // first falling edge of a transfer does it.
+            gpio_wakeup_enable(GB_PIN_SCLK, GPIO_INTR_LOW_LEVEL);
+            s_is_wakeup_armed = true;
+        }
+        portEXIT_CRITICAL(&s_wakeup_lock);
+    }
+
+    xSemaphoreGive(s_spi_lock);
 }
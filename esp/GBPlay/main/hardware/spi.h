@@ -1,6 +1,28 @@
 #ifndef _SPI_H
 #define _SPI_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    SPI_ROLE_MASTER,  // We drive the clock (the Game Boy uses an external clock)
+    SPI_ROLE_SLAVE    // The Game Boy drives the clock (it uses its internal clock)
+} spi_role;
+
+// Link clock speeds supported by Game Boy models
+typedef enum {
+    SPI_CLOCK_SPEED_NORMAL,       // 8 KHz. The only speed the original Game Boy supports.
+    SPI_CLOCK_SPEED_DOUBLE,       // 16 KHz. GBC normal speed in double-speed mode.
+    SPI_CLOCK_SPEED_FAST,         // 256 KHz. GBC high-speed mode.
+    SPI_CLOCK_SPEED_FAST_DOUBLE,  // 512 KHz. GBC high-speed mode in double-speed mode.
+    SPI_CLOCK_SPEED_COUNT
+} spi_clock_speed;
+
+// Called from an interrupt handler whenever a byte is received as a slave.
+// Not called while the flash cache is disabled, so it needn't be in IRAM.
+typedef void (*spi_rx_callback)(void* arg);
+
 /* Configures the SPI interface for use. */
 void spi_initialize();
 
@@ -16,4 +38,115 @@ void spi_deinitialize();
 */
 uint8_t spi_exchange_byte(uint8_t tx);
 
+/*
+    Exchanges a buffer with the SPI slave device, one byte after another.
+
+    When gap_us is 0, the bytes are clocked out back-to-back using DMA.
+    Otherwise, each byte starts at least gap_us microseconds after the
+    previous one finished, including the last byte of the previous exchange.
+
+    @param tx     The bytes to send
+    @param out_rx [output] The received bytes (0xFF for each byte that had no
+                  response). Must be at least len bytes long and must not
+                  overlap tx.
+    @param len    Number of bytes to exchange
+    @param gap_us Number of microseconds to wait between bytes
+*/
+void spi_exchange_buffer(const uint8_t* tx, uint8_t* out_rx, size_t len, uint32_t gap_us);
+
+/*
+    Selects which side drives the link clock. The interface starts out as a
+    master. Any queued slave data is discarded when switching roles.
+
+    The clock is followed in software, so the Game Boy can only drive it at
+    up to SPI_CLOCK_SPEED_DOUBLE. Switching to the slave role fails while a
+    faster speed is set.
+
+    @param role Role to switch to
+
+    @returns Whether the role was switched
+*/
+bool spi_set_role(spi_role role);
+
+/*
+    Returns which side currently drives the link clock.
+*/
+spi_role spi_get_role();
+
+/*
+    Sets the clock speed used as a master. The interface starts out at
+    SPI_CLOCK_SPEED_NORMAL. When the Game Boy drives the clock, it also
+    chooses the speed, and this fails if the speed is too fast to follow.
+
+    @param speed Speed to switch to
+
+    @returns Whether the speed was set
+*/
+bool spi_set_clock_speed(spi_clock_speed speed);
+
+/*
+    Returns the clock speed used as a master.
+*/
+spi_clock_speed spi_get_clock_speed();
+
+/*
+    Returns the frequency of a clock speed.
+
+    @param speed The speed to look up
+
+    @returns The clock frequency in Hz
+*/
+uint32_t spi_get_clock_speed_hz(spi_clock_speed speed);
+
+/*
+    Sets the byte to send as a slave when nothing is queued.
+
+    @param idle_byte The byte to send
+*/
+void spi_slave_set_idle_byte(uint8_t idle_byte);
+
+/*
+    Registers a function to be called each time a byte is received as a
+    slave. It runs in interrupt context, so it must be quick.
+
+    @param callback Function to call, or NULL for none
+    @param arg      Argument to pass to callback
+*/
+void spi_slave_set_rx_callback(spi_rx_callback callback, void* arg);
+
+/*
+    Queues bytes to send the next times the Game Boy starts a transfer. Each
+    byte is loaded into the shift register as soon as the previous transfer
+    ends. Must only be called from one task.
+
+    @param tx  The bytes to send
+    @param len Number of bytes to queue
+
+    @returns The number of bytes actually queued (less than len if full)
+*/
+size_t spi_slave_queue_tx(const uint8_t* tx, size_t len);
+
+/*
+    Retrieves bytes the Game Boy sent as a master, in the order they were
+    received. Must only be called from one task.
+
+    @param out_rx  [output] Received bytes
+    @param max_len Size of out_rx
+
+    @returns The number of bytes retrieved
+*/
+size_t spi_slave_read_rx(uint8_t* out_rx, size_t max_len);
+
+/*
+    Lets the Game Boy wake the device from light sleep by starting a
+    transfer. Disarmed by the first clock edge, so call it again each time
+    the link goes idle. Has no effect while we drive the clock, since the
+    Game Boy can't start a transfer then.
+
+    The first byte after waking is usually lost, since waking takes about as
+    long as a byte at the normal clock speed. Games retry until they get an
+    answer.
+*/
+void spi_arm_link_wakeup();
+
 #endif
@@ -1,11 +1,310 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
 
 #include "storage.h"
 
 #define NVS_NAMESPACE "storage"
 
+// Same limit as NVS
+#define STORAGE_MAX_KEY_LENGTH 15
+
+// Changes are written to flash together once no more have been made for this
+// long, so a burst of changes only costs one commit
+#define STORAGE_COMMIT_DELAY_US (2 * 1000 * 1000)
+
+// Beyond this many cached keys, the least recently used one that has been
+// written to flash is dropped. Settings used all the time stay in RAM, while
+// keys read once in a while (such as saved network records) don't pile up.
+#define STORAGE_MAX_CACHED_ENTRIES 24
+
+// Must be a power of two
+#define STORAGE_BUCKET_COUNT 32
+
+// Values are read from flash once and then served from RAM. Keys that don't
+// exist are cached too (as NVS_TYPE_ANY), so repeatedly looking for optional
+// settings doesn't touch flash either.
+typedef struct storage_entry {
+    char key[STORAGE_MAX_KEY_LENGTH + 1];
+    nvs_type_t type;  // NVS_TYPE_STR, NVS_TYPE_BLOB, or NVS_TYPE_ANY if missing
+    void* value;
+    size_t length;    // Strings include their terminator
+    bool is_dirty;    // Changed in RAM but not written to flash yet
+
+    struct storage_entry* next_in_bucket;
+
+    // Most recently used first
+    struct storage_entry* newer;
+    struct storage_entry* older;
+} storage_entry;
+
 static nvs_handle s_storage_handle;
+static SemaphoreHandle_t s_storage_lock;
+static esp_timer_handle_t s_commit_timer;
+
+static storage_entry* s_buckets[STORAGE_BUCKET_COUNT];
+static storage_entry* s_newest = NULL;
+static storage_entry* s_oldest = NULL;
+static int s_entry_count = 0;
+
+static void _load_entry(storage_entry* entry)
+{
+    nvs_type_t type = NVS_TYPE_ANY;
+    if (nvs_find_key(s_storage_handle, entry->key, &type) != ESP_OK)
+    {
+        // Does not exist
+        return;
+    }
+
+    size_t size = 0;
+    if (type == NVS_TYPE_STR && nvs_get_str(s_storage_handle, entry->key, NULL, &size) == ESP_OK)
+    {
+        entry->value = malloc(size);
+        ESP_ERROR_CHECK(nvs_get_str(s_storage_handle, entry->key, entry->value, &size));
+    }
+    else if (type == NVS_TYPE_BLOB && nvs_get_blob(s_storage_handle, entry->key, NULL, &size) == ESP_OK)
+    {
+        entry->value = malloc(size);
+        ESP_ERROR_CHECK(nvs_get_blob(s_storage_handle, entry->key, entry->value, &size));
+    }
+    else
+    {
+        ESP_LOGW(__func__, "Ignoring '%s' in storage with unsupported type %d", entry->key, type);
+        return;
+    }
+
+    entry->type = type;
+    entry->length = size;
+}
+
+static storage_entry** _get_bucket(const char* key)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char* c = key; *c != '\0'; ++c)
+    {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+
+    return &s_buckets[hash & (STORAGE_BUCKET_COUNT - 1)];
+}
+
+static void _unlink_recency(storage_entry* entry)
+{
+    if (entry->newer != NULL)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        s_newest = entry->older;
+    }
+
+    if (entry->older != NULL)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        s_oldest = entry->newer;
+    }
+}
+
+static void _link_newest(storage_entry* entry)
+{
+    entry->newer = NULL;
+    entry->older = s_newest;
+    if (s_newest != NULL)
+    {
+        s_newest->newer = entry;
+    }
+    else
+    {
+        s_oldest = entry;
+    }
+    s_newest = entry;
+}
+
+// Drops the least recently used entry that doesn't need writing. Returns
+// false if every entry has unwritten changes.
+static bool _evict_one()
+{
+    storage_entry* entry = s_oldest;
+    while (entry != NULL && entry->is_dirty)
+    {
+        entry = entry->newer;
+    }
+
+    if (entry == NULL)
+    {
+        return false;
+    }
+
+    storage_entry** link = _get_bucket(entry->key);
+    while (*link != entry)
+    {
+        link = &(*link)->next_in_bucket;
+    }
+    *link = entry->next_in_bucket;
+
+    _unlink_recency(entry);
+    --s_entry_count;
+
+    free(entry->value);
+    free(entry);
+    return true;
+}
+
+// Finds the entry for a key, reading it from flash if it isn't cached. Must
+// be called with the lock held.
+static storage_entry* _get_entry(const char* key)
+{
+    assert(strlen(key) <= STORAGE_MAX_KEY_LENGTH);
+
+    storage_entry** bucket = _get_bucket(key);
+    storage_entry* entry = *bucket;
+    while (entry != NULL && strcmp(entry->key, key) != 0)
+    {
+        entry = entry->next_in_bucket;
+    }
+
+    if (entry != NULL)
+    {
+        _unlink_recency(entry);
+        _link_newest(entry);
+        return entry;
+    }
+
+    // Room is made before adding, so the new entry is never the one dropped.
+    // Unwritten changes can push the count over until the next commit.
+    while (s_entry_count >= STORAGE_MAX_CACHED_ENTRIES && _evict_one());
+
+    entry = calloc(1, sizeof(storage_entry));
+    strcpy(entry->key, key);
+    entry->type = NVS_TYPE_ANY;
+    _load_entry(entry);
+
+    entry->next_in_bucket = *bucket;
+    *bucket = entry;
+    _link_newest(entry);
+    ++s_entry_count;
+
+    return entry;
+}
+
+static void _flush_entry(storage_entry* entry)
+{
+    esp_err_t err = ESP_OK;
+    switch (entry->type)
+    {
+        case NVS_TYPE_STR:
+            err = nvs_set_str(s_storage_handle, entry->key, entry->value);
+            break;
+
+        case NVS_TYPE_BLOB:
+            err = nvs_set_blob(s_storage_handle, entry->key, entry->value, entry->length);
+            break;
+
+        default:
+            err = nvs_erase_key(s_storage_handle, entry->key);
+            if (err == ESP_ERR_NVS_NOT_FOUND)
+            {
+                err = ESP_OK;
+            }
+            break;
+    }
+
+    if (err != ESP_OK)
+    {
+        // Stays dirty so the next flush tries again
+        ESP_LOGE(__func__, "Failed to write '%s' to storage: %s", entry->key, esp_err_to_name(err));
+        return;
+    }
+
+    entry->is_dirty = false;
+}
+
+// Writes every changed value to flash with one commit. Must be called with
+// the lock held.
+static void _flush()
+{
+    int count = 0;
+    for (storage_entry* entry = s_newest; entry != NULL; entry = entry->older)
+    {
+        if (entry->is_dirty)
+        {
+            _flush_entry(entry);
+            ++count;
+        }
+    }
+
+    if (count > 0)
+    {
+        ESP_ERROR_CHECK(nvs_commit(s_storage_handle));
+        ESP_LOGI(__func__, "Committed %d change(s) to storage", count);
+    }
+}
+
+static void _on_commit_timer(void* arg)
+{
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+    _flush();
+    xSemaphoreGive(s_storage_lock);
+}
+
+static void _schedule_commit()
+{
+    // Restarting the timer batches a burst of changes into one commit
+    esp_timer_stop(s_commit_timer);
+    ESP_ERROR_CHECK(esp_timer_start_once(s_commit_timer, STORAGE_COMMIT_DELAY_US));
+}
+
+// Must be called with the lock held
+static void _set(const char* key, nvs_type_t type, const void* value, size_t length)
+{
+    storage_entry* entry = _get_entry(key);
+
+    if (entry->type == type && entry->length == length && memcmp(entry->value, value, length) == 0)
+    {
+        // Unchanged, so don't wear out the flash
+        return;
+    }
+
+    // Reuse the old buffer when the size hasn't changed
+    if (entry->value == NULL || entry->length != length)
+    {
+        free(entry->value);
+        entry->value = malloc(length);
+    }
+
+    memcpy(entry->value, value, length);
+    entry->type = type;
+    entry->length = length;
+    entry->is_dirty = true;
+
+    _schedule_commit();
+}
+
+// Copies a value of the given type. Must be called with the lock held.
+static void* _copy(const char* key, nvs_type_t type)
+{
+    storage_entry* entry = _get_entry(key);
+    if (entry->type != type)
+    {
+        return NULL;
+    }
+
+    void* copy = malloc(entry->length);
+    memcpy(copy, entry->value, entry->length);
+    return copy;
+}
 
 void storage_initialize()
 {
@@ -18,69 +317,134 @@ void storage_initialize()
     }
     ESP_ERROR_CHECK(err);
     ESP_ERROR_CHECK(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &s_storage_handle));
+
+    s_storage_lock = xSemaphoreCreateMutex();
+
+    // Runs in the esp_timer task, which has enough stack for NVS writes
+    esp_timer_create_args_t timer_args = {
+        .callback = &_on_commit_timer,
+        .name = "storage-commit"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_commit_timer));
 }
 
 void storage_deinitialize()
 {
+    esp_timer_stop(s_commit_timer);
+    esp_timer_delete(s_commit_timer);
+
+    storage_flush();
+
+    while (s_newest != NULL)
+    {
+        storage_entry* older = s_newest->older;
+        free(s_newest->value);
+        free(s_newest);
+        s_newest = older;
+    }
+
+    s_oldest = NULL;
+    s_entry_count = 0;
+    memset(s_buckets, 0, sizeof(s_buckets));
+
+    vSemaphoreDelete(s_storage_lock);
     nvs_close(s_storage_handle);
 }
 
+void storage_flush()
+{
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+    _flush();
+    xSemaphoreGive(s_storage_lock);
+}
+
 void* storage_get_blob(const char* key)
 {
-    size_t size = 0;
-    if (nvs_get_blob(s_storage_handle, key, NULL, &size) != ESP_OK)
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+    void* blob = _copy(key, NVS_TYPE_BLOB);
+    xSemaphoreGive(s_storage_lock);
+
+    return blob;
+}
+
+bool storage_read_blob(const char* key, void* out_value, size_t length)
+{
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    storage_entry* entry = _get_entry(key);
+    bool found = (entry->type == NVS_TYPE_BLOB && entry->length == length);
+    if (found)
     {
-        // Does not exist
-        return NULL;
+        memcpy(out_value, entry->value, length);
     }
 
-    void* blob = malloc(size);
-    ESP_ERROR_CHECK(nvs_get_blob(s_storage_handle, key, blob, &size));
-    return blob;
+    xSemaphoreGive(s_storage_lock);
+    return found;
 }
 
 void storage_set_blob(const char* key, const void* value, size_t length)
 {
-    ESP_ERROR_CHECK(nvs_set_blob(s_storage_handle, key, value, length));
-    ESP_ERROR_CHECK(nvs_commit(s_storage_handle));
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+    _set(key, NVS_TYPE_BLOB, value, length);
+    xSemaphoreGive(s_storage_lock);
 
     ESP_LOGI(__func__, "Wrote blob '%s' to storage", key);
 }
 
 char* storage_get_string(const char* key)
 {
-    size_t size = 0;
-    if (nvs_get_str(s_storage_handle, key, NULL, &size) != ESP_OK)
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+    char* str = _copy(key, NVS_TYPE_STR);
+    xSemaphoreGive(s_storage_lock);
+
+    return str;
+}
+
+bool storage_read_string(const char* key, char* out_value, size_t size)
+{
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    storage_entry* entry = _get_entry(key);
+    bool found = (entry->type == NVS_TYPE_STR && entry->length <= size);
+    if (found)
     {
-        // Does not exist
-        return NULL;
+        memcpy(out_value, entry->value, entry->length);
     }
 
-    char* str = malloc(size);
-    ESP_ERROR_CHECK(nvs_get_str(s_storage_handle, key, str, &size));
-    return str;
+    xSemaphoreGive(s_storage_lock);
+    return found;
 }
 
 void storage_set_string(const char* key, const char* value)
 {
-    ESP_ERROR_CHECK(nvs_set_str(s_storage_handle, key, value));
-    ESP_ERROR_CHECK(nvs_commit(s_storage_handle));
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+    _set(key, NVS_TYPE_STR, value, strlen(value) + 1);
+    xSemaphoreGive(s_storage_lock);
 
     ESP_LOGI(__func__, "Wrote string '%s' to storage", key);
 }
 
 void storage_delete(const char* key)
 {
-    esp_err_t err = nvs_erase_key(s_storage_handle, key);
-    if (err == ESP_ERR_NVS_NOT_FOUND)
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    storage_entry* entry = _get_entry(key);
+    if (entry->type == NVS_TYPE_ANY)
     {
         ESP_LOGI(__func__, "Key '%s' does not exist in storage. Nothing to do.", key);
     }
     else
     {
-        ESP_ERROR_CHECK(err);
+        free(entry->value);
+        entry->value = NULL;
+        entry->length = 0;
+        entry->type = NVS_TYPE_ANY;
+        entry->is_dirty = true;
+
+        _schedule_commit();
+
         ESP_LOGI(__func__, "Deleted '%s' from storage", key);
     }
 
-    ESP_ERROR_CHECK(nvs_commit(s_storage_handle));
+    xSemaphoreGive(s_storage_lock);
 }
@@ -1,12 +1,22 @@
 #ifndef _STORAGE_H
 #define _STORAGE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 /* Configures and opens non-volatile storage. */
 void storage_initialize();
 
-/* Closes non-volatile storage. */
+/* Writes pending changes and closes non-volatile storage. */
 void storage_deinitialize();
 
+/*
+    Writes pending changes to flash right away. Changes are otherwise kept in
+    RAM and written together shortly after the last one, so this only needs
+    to be called before restarting or powering off.
+*/
+void storage_flush();
+
 /*
     Retrieves a buffer from non-volatile storage.
 
@@ -17,6 +27,18 @@ void storage_deinitialize();
 */
 void* storage_get_blob(const char* key);
 
+/*
+    Copies a buffer from non-volatile storage without allocating. Values are
+    cached in RAM, so this is cheap enough for frequently used keys.
+
+    @param key       Identifier of data
+    @param out_value [output] Buffer to copy the data into
+    @param length    Size of out_value. The stored buffer must be the same size.
+
+    @returns Whether a buffer of that size was found for key.
+*/
+bool storage_read_blob(const char* key, void* out_value, size_t length);
+
 /*
     Stores a buffer in non-volatile storage.
 
@@ -36,6 +58,18 @@ void storage_set_blob(const char* key, const void* value, size_t length);
 */
 char* storage_get_string(const char* key);
 
+/*
+    Copies a string from non-volatile storage without allocating. Values are
+    cached in RAM, so this is cheap enough for frequently used keys.
+
+    @param key       Identifier of string
+    @param out_value [output] Buffer to copy the string into
+    @param size      Size of out_value, including room for the terminator
+
+    @returns Whether a string that fits was found for key.
+*/
+bool storage_read_string(const char* key, char* out_value, size_t size);
+
 /*
     Stores a string in non-volatile storage.
 
@@ -2,36 +2,50 @@
 #include <string.h>
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <freertos/event_groups.h>
 
-#include "storage.h"
 #include "wifi.h"
+#include "wifi_networks.h"
 
 #define MAX_CONNECTION_RETRY_COUNT 3
 #define CONNECTION_TIMEOUT_MS      15000
 
-#define WIFI_SAVED_NETWORKS_STORAGE_KEY "wifi_networks"
+// Connecting to a known access point skips the scan, so it's much quicker
+#define FAST_CONNECTION_TIMEOUT_MS 3000
+
+// Longest a blocking scan waits for results
+#define SCAN_TIMEOUT_MS            10000
+
+// Time spent listening on each channel during a quick scan. Normal scans
+// use the driver's default of up to 120 ms.
+#define QUICK_SCAN_MIN_DWELL_MS    10
+#define QUICK_SCAN_MAX_DWELL_MS    40
+
+#define SCAN_DONE_BIT (1 << 0)
 
 // Assumes dst is a statically allocated array
 #define TRUNCATED_STRING_COPY(dst, src) \
     strncpy(dst, src, sizeof(dst)); \
     dst[sizeof(dst) - 1] = '\0';
 
-typedef struct {
-    wifi_network_credentials networks[WIFI_MAX_SAVED_NETWORKS];
-    int count;
-} wifi_saved_network_info;
-
 ESP_EVENT_DEFINE_BASE(NETWORK_EVENT);
 
 static SemaphoreHandle_t s_wifi_lock;
-static SemaphoreHandle_t s_wifi_storage_lock;
 static EventGroupHandle_t s_wifi_event_group;  // For blocking on connect
-static wifi_saved_network_info s_saved_networks = {0};
 static esp_netif_t* s_wifi_iface = NULL;
 static volatile bool s_is_connected = false;
 
+// Results of the latest scan. Scans only hold s_wifi_lock while starting.
+static SemaphoreHandle_t s_scan_lock;
+static EventGroupHandle_t s_scan_event_group;  // For blocking on scans
+static volatile bool s_is_scanning = false;
+static wifi_ap_record_t s_scan_records[WIFI_MAX_SCAN_RESULTS];
+static wifi_ap_info s_scan_results[WIFI_MAX_SCAN_RESULTS];
+static uint16_t s_scan_result_count = 0;
+static int64_t s_scan_time = 0;
+
 static void _set_connection_status(bool connected)
 {
     s_is_connected = connected;
@@ -75,6 +89,14 @@ static void _on_connect(void* arg, esp_event_base_t event_base, int32_t event_id
         network_event_connected connect_event = {0};
         TRUNCATED_STRING_COPY(connect_event.ssid, (char*)ap_info.ssid);
 
+        wifi_networks_remember_ap(
+            connect_event.ssid,
+            ap_info.bssid,
+            ap_info.primary,
+            ap_info.authmode,
+            ap_info.rssi
+        );
+
         _set_connection_status(true);
         xEventGroupSetBits(s_wifi_event_group, NETWORK_EVENT_CONNECTED);
 
@@ -88,20 +110,62 @@ static void _on_connect(void* arg, esp_event_base_t event_base, int32_t event_id
     }
 }
 
-void wifi_initialize()
+static void _on_scan_done(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
-    s_wifi_lock = xSemaphoreCreateMutex();
-    s_wifi_storage_lock = xSemaphoreCreateMutex();
+    uint16_t record_count = WIFI_MAX_SCAN_RESULTS;
+    if (esp_wifi_scan_get_ap_records(&record_count, s_scan_records) != ESP_OK)
+    {
+        record_count = 0;
+    }
 
-    s_wifi_event_group = xEventGroupCreate();
+    assert(xSemaphoreTake(s_scan_lock, portMAX_DELAY) == pdTRUE);
 
-    // Load previously saved credentials
-    void* saved_networks = storage_get_blob(WIFI_SAVED_NETWORKS_STORAGE_KEY);
-    if (saved_networks)
+    // Convert result from internal format to public-facing one
+    s_scan_result_count = 0;
+    for (int i = 0; i < record_count; ++i)
     {
-        memcpy(&s_saved_networks, saved_networks, sizeof(s_saved_networks));
-        free(saved_networks);
+        wifi_ap_record_t* src = &s_scan_records[i];
+        wifi_ap_info* dst = &s_scan_results[s_scan_result_count];
+
+        if (src->rssi < WIFI_MINIMUM_RSSI)
+        {
+            continue;
+        }
+
+        TRUNCATED_STRING_COPY(dst->ssid, (char*)src->ssid);
+        memcpy(dst->bssid, src->bssid, sizeof(dst->bssid));
+
+        dst->rssi = src->rssi;
+        dst->channel = src->primary;
+        dst->requires_password = src->authmode != WIFI_AUTH_OPEN;
+        dst->auth_mode = src->authmode;
+
+        ++s_scan_result_count;
     }
+    s_scan_time = esp_timer_get_time();
+
+    xSemaphoreGive(s_scan_lock);
+
+    s_is_scanning = false;
+    xEventGroupSetBits(s_scan_event_group, SCAN_DONE_BIT);
+
+    ESP_ERROR_CHECK(esp_event_post(
+        NETWORK_EVENT,
+        NETWORK_EVENT_SCAN_DONE,
+        NULL,
+        0,
+        portMAX_DELAY
+    ));
+}
+
+void wifi_initialize()
+{
+    s_wifi_lock = xSemaphoreCreateMutex();
+    s_wifi_event_group = xEventGroupCreate();
+    s_scan_lock = xSemaphoreCreateMutex();
+    s_scan_event_group = xEventGroupCreate();
+
+    wifi_networks_initialize();
 
     _set_connection_status(false);
 
@@ -121,6 +185,9 @@ void wifi_initialize()
     ESP_ERROR_CHECK(esp_event_handler_instance_register(
         IP_EVENT, IP_EVENT_STA_GOT_IP, &_on_connect, NULL, NULL
     ));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(
+        WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &_on_scan_done, NULL, NULL
+    ));
 
     ESP_ERROR_CHECK(esp_wifi_start());
 }
@@ -136,52 +203,78 @@ void wifi_deinitialize()
     ESP_ERROR_CHECK(esp_netif_deinit());
 
     vEventGroupDelete(s_wifi_event_group);
+    vEventGroupDelete(s_scan_event_group);
+    vSemaphoreDelete(s_scan_lock);
 
-    vSemaphoreDelete(s_wifi_storage_lock);
+    wifi_networks_deinitialize();
     vSemaphoreDelete(s_wifi_lock);
 }
 
-void wifi_scan(wifi_ap_info* out_ap_list, uint16_t* ap_count)
+bool wifi_scan_start(bool quick)
 {
-    assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
+    wifi_scan_config_t quick_config = {
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+        .scan_time.active.min = QUICK_SCAN_MIN_DWELL_MS,
+        .scan_time.active.max = QUICK_SCAN_MAX_DWELL_MS
+    };
 
-    if (esp_wifi_scan_start(NULL, true) != ESP_OK)
-    {
-        // Could fail due to timeout or wifi still connecting
-        *ap_count = 0;
-        xSemaphoreGive(s_wifi_lock);
-        return;
-    }
+    bool started = true;
 
-    wifi_ap_record_t* temp_ap_list = calloc(*ap_count, sizeof(wifi_ap_record_t));
-
-    ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(ap_count, temp_ap_list));
+    assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
 
-    // Convert result from internal format to public-facing one
-    uint16_t total_aps_returned = 0;
-    for (int i = 0; i < *ap_count; ++i)
+    // Joining a scan in progress is just as good as starting another
+    if (!s_is_scanning)
     {
-        wifi_ap_record_t* src = &temp_ap_list[i];
-        wifi_ap_info* dst = &out_ap_list[i];
+        xEventGroupClearBits(s_scan_event_group, SCAN_DONE_BIT);
+        s_is_scanning = true;
 
-        if (src->rssi < WIFI_MINIMUM_RSSI)
+        if (esp_wifi_scan_start(quick ? &quick_config : NULL, false /* block */) != ESP_OK)
         {
-            continue;
+            // Could fail due to wifi still connecting
+            s_is_scanning = false;
+            started = false;
         }
+    }
 
-        TRUNCATED_STRING_COPY(dst->ssid, (char*)src->ssid);
+    xSemaphoreGive(s_wifi_lock);
+    return started;
+}
 
-        dst->rssi = src->rssi;
-        dst->channel = src->primary;
-        dst->requires_password = src->authmode != WIFI_AUTH_OPEN;
+void wifi_get_scan_results(wifi_ap_info* out_ap_list, uint16_t* ap_count, int64_t* out_scan_time)
+{
+    assert(xSemaphoreTake(s_scan_lock, portMAX_DELAY) == pdTRUE);
+
+    if (*ap_count > s_scan_result_count)
+    {
+        *ap_count = s_scan_result_count;
+    }
+    memcpy(out_ap_list, s_scan_results, *ap_count * sizeof(wifi_ap_info));
 
-        ++total_aps_returned;
+    if (out_scan_time != NULL)
+    {
+        *out_scan_time = s_scan_time;
     }
 
-    free(temp_ap_list);
-    *ap_count = total_aps_returned;
+    xSemaphoreGive(s_scan_lock);
+}
 
-    xSemaphoreGive(s_wifi_lock);
+void wifi_scan(wifi_ap_info* out_ap_list, uint16_t* ap_count)
+{
+    bool scanned = wifi_scan_start(false /* quick */) && (xEventGroupWaitBits(
+        s_scan_event_group,
+        SCAN_DONE_BIT,
+        pdFALSE,  // xClearOnExit
+        pdFALSE,  // xWaitForAllBits
+        SCAN_TIMEOUT_MS / portTICK_PERIOD_MS
+    ) & SCAN_DONE_BIT);
+
+    if (!scanned)
+    {
+        *ap_count = 0;
+        return;
+    }
+
+    wifi_get_scan_results(out_ap_list, ap_count, NULL);
 }
 
 static void _disconnect()
@@ -203,14 +296,12 @@ static void _disconnect()
     }
 }
 
-bool wifi_connect(const char* ssid, const char* password, bool force)
+static bool _build_config(const char* ssid, const char* password, wifi_config_t* out_cfg)
 {
-    wifi_config_t cfg = { 0 };
-
-    int max_ssid_len = sizeof(cfg.sta.ssid);
-    int max_pass_len = sizeof(cfg.sta.password);
-    int ssid_len = snprintf((char*)&cfg.sta.ssid, max_ssid_len, "%s", ssid);
-    int pass_len = snprintf((char*)&cfg.sta.password, max_pass_len, "%s", password);
+    int max_ssid_len = sizeof(out_cfg->sta.ssid);
+    int max_pass_len = sizeof(out_cfg->sta.password);
+    int ssid_len = snprintf((char*)&out_cfg->sta.ssid, max_ssid_len, "%s", ssid);
+    int pass_len = snprintf((char*)&out_cfg->sta.password, max_pass_len, "%s", password);
 
     if (ssid_len > max_ssid_len || pass_len > max_pass_len)
     {
@@ -224,206 +315,132 @@ bool wifi_connect(const char* ssid, const char* password, bool force)
         return false;
     }
 
-    {
-        assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
+    return true;
+}
 
-        bool did_connect = false;
+static bool _connect(wifi_config_t* cfg, bool force, int max_attempts, int timeout_ms)
+{
+    assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
+
+    bool did_connect = false;
+
+    if (!force && wifi_is_connected())
+    {
+        // Connected to something else. Give up.
+        // When the user chooses to connect, force = true.
+        // When the connection manager tries to connect, force = false.
+        ESP_LOGI(
+            __func__,
+            "Already connected to a network and new connection is not forced"
+        );
+    }
+    else
+    {
+        ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, cfg));
 
-        if (!force && wifi_is_connected())
+        for (int i = 0; !did_connect && i < max_attempts; ++i)
         {
-            // Connected to something else. Give up.
-            // When the user chooses to connect, force = true.
-            // When the connection manager tries to connect, force = false.
+            _disconnect();
+
             ESP_LOGI(
                 __func__,
-                "Already connected to a network and new connection is not forced"
+                "Trying to connect to network '%s' (attempt %d of %d)...",
+                (char*)cfg->sta.ssid, i + 1, max_attempts
             );
-        }
-        else
-        {
-            ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &cfg));
 
-            for (int i = 0; !did_connect && i < MAX_CONNECTION_RETRY_COUNT; ++i)
+            xEventGroupClearBits(s_wifi_event_group, 0xFF);
+
+            if (esp_wifi_connect() != ESP_OK)
             {
-                _disconnect();
-
-                ESP_LOGI(
-                    __func__,
-                    "Trying to connect to network '%s' (attempt %d of %d)...",
-                    ssid, i + 1, MAX_CONNECTION_RETRY_COUNT
-                );
-
-                xEventGroupClearBits(s_wifi_event_group, 0xFF);
-
-                if (esp_wifi_connect() != ESP_OK)
-                {
-                    ESP_LOGE(__func__, "Connection failed");
-                    break;
-                }
-
-                did_connect = (xEventGroupWaitBits(
-                    s_wifi_event_group,
-                    0xFF,     // Bits to wait for (any bits)
-                    pdTRUE,   // xClearOnExit
-                    pdFALSE,  // xWaitForAllBits
-                    CONNECTION_TIMEOUT_MS / portTICK_PERIOD_MS
-                ) & NETWORK_EVENT_CONNECTED) == NETWORK_EVENT_CONNECTED;
+                ESP_LOGE(__func__, "Connection failed");
+                break;
             }
-        }
 
-        xSemaphoreGive(s_wifi_lock);
-        return did_connect;
+            did_connect = (xEventGroupWaitBits(
+                s_wifi_event_group,
+                0xFF,     // Bits to wait for (any bits)
+                pdTRUE,   // xClearOnExit
+                pdFALSE,  // xWaitForAllBits
+                timeout_ms / portTICK_PERIOD_MS
+            ) & NETWORK_EVENT_CONNECTED) == NETWORK_EVENT_CONNECTED;
+        }
     }
-}
-
-void wifi_disconnect()
-{
-    assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
-
-    _disconnect();
 
     xSemaphoreGive(s_wifi_lock);
+    return did_connect;
 }
 
-bool wifi_is_connected()
-{
-    //wifi_ap_record_t ap_info = { 0 };
-    //return esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK;
-    return s_is_connected;
-}
-
-
-static void _wifi_flush_saved_networks()
-{
-    storage_set_blob(
-        WIFI_SAVED_NETWORKS_STORAGE_KEY,
-        &s_saved_networks,
-        sizeof(s_saved_networks)
-    );
-}
-
-static wifi_network_credentials* _get_saved_network(const char* ssid)
+bool wifi_connect(const char* ssid, const char* password, bool force)
 {
-    for (int i = 0; i < s_saved_networks.count; ++i)
+    wifi_config_t cfg = { 0 };
+    if (!_build_config(ssid, password, &cfg))
     {
-        wifi_network_credentials* ap = &s_saved_networks.networks[i];
-        if (strcmp(ap->ssid, ssid) == 0)
-        {
-            return ap;
-        }
+        return false;
     }
 
-    return NULL;
+    return _connect(&cfg, force, MAX_CONNECTION_RETRY_COUNT, CONNECTION_TIMEOUT_MS);
 }
 
-bool wifi_get_saved_network(const char* ssid, wifi_network_credentials* out_network)
+bool wifi_connect_to_ap(const wifi_network_credentials* network, bool force)
 {
-    bool found = false;
-
+    wifi_config_t cfg = { 0 };
+    if (network->channel == 0 || !_build_config(network->ssid, network->pass, &cfg))
     {
-        assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
+        return false;
+    }
 
-        wifi_network_credentials* existing = _get_saved_network(ssid);
-        if (existing != NULL)
-        {
-            *out_network = *existing;
-            found = true;
-        }
+    // Only probe the one channel, for the one access point
+    cfg.sta.scan_method = WIFI_FAST_SCAN;
+    cfg.sta.bssid_set = true;
+    memcpy(cfg.sta.bssid, network->bssid, sizeof(cfg.sta.bssid));
+    cfg.sta.channel = network->channel;
+    cfg.sta.threshold.authmode = network->auth_mode;
 
-        xSemaphoreGive(s_wifi_storage_lock);
+    bool connected = _connect(&cfg, force, 1 /* max_attempts */, FAST_CONNECTION_TIMEOUT_MS);
+    if (!connected && !wifi_is_connected())
+    {
+        wifi_networks_record_failure(network->ssid);
     }
 
-    return found;
+    return connected;
 }
 
-int wifi_get_all_saved_networks(wifi_network_credentials* out_networks)
+void wifi_disconnect()
 {
-    int count = 0;
-
-    {
-        assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
-
-        count = s_saved_networks.count;
-
-        for (int i = 0; i < count; ++i)
-        {
-            out_networks[i] = s_saved_networks.networks[i];
-        }
+    assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
 
-        xSemaphoreGive(s_wifi_storage_lock);
-    }
+    _disconnect();
 
-    return count;
+    xSemaphoreGive(s_wifi_lock);
 }
 
-bool wifi_save_network(const char* ssid, const char* password)
+bool wifi_get_connected_ap(wifi_ap_info* out_ap)
 {
-    bool saved = false;
-
+    wifi_ap_record_t ap_info = { 0 };
+    if (!wifi_is_connected() || esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
     {
-        assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
-
-        wifi_network_credentials* existing = _get_saved_network(ssid);
-        if (existing)
-        {
-            TRUNCATED_STRING_COPY(existing->pass, password);
-
-            _wifi_flush_saved_networks();
-
-            saved = true;
-        }
-        else if (s_saved_networks.count < WIFI_MAX_SAVED_NETWORKS)
-        {
-            wifi_network_credentials* ap = &s_saved_networks.networks[s_saved_networks.count];
-
-            TRUNCATED_STRING_COPY(ap->ssid, ssid);
-            TRUNCATED_STRING_COPY(ap->pass, password);
-
-            ++s_saved_networks.count;
-            _wifi_flush_saved_networks();
+        return false;
+    }
 
-            saved = true;
-        }
-        else
-        {
-            // No room. Should have checked and cleared a spot first.
-        }
+    TRUNCATED_STRING_COPY(out_ap->ssid, (char*)ap_info.ssid);
+    memcpy(out_ap->bssid, ap_info.bssid, sizeof(out_ap->bssid));
 
-        xSemaphoreGive(s_wifi_storage_lock);
-    }
+    out_ap->rssi = ap_info.rssi;
+    out_ap->channel = ap_info.primary;
+    out_ap->requires_password = ap_info.authmode != WIFI_AUTH_OPEN;
+    out_ap->auth_mode = ap_info.authmode;
 
-    return saved;
+    return true;
 }
 
-void wifi_forget_network(const char* ssid)
+void wifi_get_mac_address(uint8_t* out_mac)
 {
-    assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
-
-    bool found_existing = false;
-
-    for (int i = 0; i < s_saved_networks.count; ++i)
-    {
-        wifi_network_credentials* ap = &s_saved_networks.networks[i];
-
-        if (found_existing)
-        {
-            // Shift left
-            wifi_network_credentials* prev = &s_saved_networks.networks[i - 1];
-            memcpy(prev, ap, sizeof(*prev));
-            memset(ap, 0, sizeof(*ap));
-        }
-        else if (strcmp(ap->ssid, ssid) == 0)
-        {
-            found_existing = true;
-            memset(ap, 0, sizeof(*ap));
-        }
-    }
-
-    if (found_existing)
-    {
-        --s_saved_networks.count;
-        _wifi_flush_saved_networks();
-    }
+    ESP_ERROR_CHECK(esp_wifi_get_mac(WIFI_IF_STA, out_mac));
+}
 
-    xSemaphoreGive(s_wifi_storage_lock);
+bool wifi_is_connected()
+{
+    //wifi_ap_record_t ap_info = { 0 };
+    //return esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK;
+    return s_is_connected;
 }
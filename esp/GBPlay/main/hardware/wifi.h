@@ -7,20 +7,24 @@
 // Per 802.11 spec
 #define WIFI_MAX_SSID_LENGTH        32
 #define WIFI_MAX_PASS_LENGTH        64
+#define WIFI_BSSID_LENGTH           6
 
 #define WIFI_MINIMUM_RSSI          -80
 #define WIFI_WEAK_RSSI_THRESHOLD   -70
 #define WIFI_MED_RSSI_THRESHOLD    -60
 #define WIFI_STRONG_RSSI_THRESHOLD -50
 
-#define WIFI_MAX_SAVED_NETWORKS     5
+// Each saved network takes about 6 entries of the 24 KB NVS partition
+#define WIFI_MAX_SAVED_NETWORKS     100
+#define WIFI_MAX_SCAN_RESULTS       16
 
 ESP_EVENT_DECLARE_BASE(NETWORK_EVENT);
 
 typedef enum {
     NETWORK_EVENT_DROPPED   = 1,     // Network connection lost unexpectedly
     NETWORK_EVENT_LEFT      = 2,     // Network connection intentionally closed
-    NETWORK_EVENT_CONNECTED = 4      // Network connection established
+    NETWORK_EVENT_CONNECTED = 4,     // Network connection established
+    NETWORK_EVENT_SCAN_DONE = 8      // Scan started by wifi_scan_start() finished
 } network_event;
 
 typedef struct {
@@ -29,14 +33,28 @@ typedef struct {
 
 typedef struct {
     char ssid[WIFI_MAX_SSID_LENGTH + 1];
+    uint8_t bssid[WIFI_BSSID_LENGTH];
     int8_t channel;
     int8_t rssi;
     bool requires_password;
+    uint8_t auth_mode;  // Implementation-specific
 } wifi_ap_info;
 
 typedef struct {
     char ssid[WIFI_MAX_SSID_LENGTH + 1];
     char pass[WIFI_MAX_PASS_LENGTH + 1];
+
+    // Access point used the last time the connection succeeded, for
+    // reconnecting without scanning. The channel is 0 if unknown.
+    uint8_t bssid[WIFI_BSSID_LENGTH];
+    uint8_t channel;
+    uint8_t auth_mode;  // Implementation-specific
+
+    // Connection history, for deciding which networks to try first
+    uint32_t last_connected; // Higher for more recent connections. 0 if never.
+    uint16_t connect_count;  // Successful connections
+    uint8_t failure_count;   // Failed attempts since the last success
+    int8_t last_rssi;        // Signal strength at the last connection
 } wifi_network_credentials;
 
 /* Enables the Wi-Fi module and configures it for use. */
@@ -46,7 +64,7 @@ void wifi_initialize();
 void wifi_deinitialize();
 
 /*
-    Scans for available Wi-Fi networks.
+    Scans for available Wi-Fi networks and waits for the results.
 
     @param out_ap_list  [output] List of found Wi-Fi networks
     @param ap_count     As input, maximum number of networks to return.
@@ -54,6 +72,32 @@ void wifi_deinitialize();
 */
 void wifi_scan(wifi_ap_info* out_ap_list, uint16_t* ap_count);
 
+/*
+    Starts scanning for available Wi-Fi networks in the background.
+    NETWORK_EVENT_SCAN_DONE is posted once the results are available from
+    wifi_get_scan_results().
+
+    @param quick Whether to spend less time listening on each channel. Quick
+                 scans interrupt an existing connection less, but may miss
+                 distant access points.
+
+    @returns Whether a scan was started or was already in progress
+*/
+bool wifi_scan_start(bool quick);
+
+/*
+    Retrieves the results of the most recent scan, sorted by RSSI in
+    descending order.
+
+    @param out_ap_list   [output] List of found Wi-Fi networks
+    @param ap_count      As input, maximum number of networks to return.
+                         As output, number of networks actually returned.
+    @param out_scan_time [output] When the scan finished, from
+                         esp_timer_get_time(), or 0 if there has been no
+                         scan. May be NULL.
+*/
+void wifi_get_scan_results(wifi_ap_info* out_ap_list, uint16_t* ap_count, int64_t* out_scan_time);
+
 /*
     Attempts to connect to a Wi-Fi network.
 
@@ -65,9 +109,40 @@ void wifi_scan(wifi_ap_info* out_ap_list, uint16_t* ap_count);
 */
 bool wifi_connect(const char* ssid, const char* password, bool force);
 
+/*
+    Attempts to connect straight to the access point last used for a saved
+    network, skipping the scan. Only tries once, and gives up sooner than
+    wifi_connect() since the access point may have moved.
+
+    @param network Saved network to connect to. Fails immediately if no
+                   access point is known.
+    @param force   Whether to connect even if already connected to a network
+
+    @returns Whether or not the connection succeeded
+*/
+bool wifi_connect_to_ap(const wifi_network_credentials* network, bool force);
+
 /* If connected, disconnects from the current Wi-Fi network */
 void wifi_disconnect();
 
+/*
+    Retrieves details of the access point currently connected to,
+    including its latest RSSI.
+
+    @param out_ap [output] The connected access point
+
+    @returns Whether the device is connected to an access point
+*/
+bool wifi_get_connected_ap(wifi_ap_info* out_ap);
+
+/*
+    Retrieves the MAC address of the Wi-Fi station interface, which also
+    serves to identify the device.
+
+    @param out_mac [output] WIFI_BSSID_LENGTH bytes of MAC address
+*/
+void wifi_get_mac_address(uint8_t* out_mac);
+
 /*
     Checks whether connected to a network.
 
@@ -76,7 +151,7 @@ void wifi_disconnect();
 bool wifi_is_connected();
 
 /*
-    Retrieves the credentials of a saved Wi-Fi network from memory.
+    Retrieves the credentials of a saved Wi-Fi network.
 
     @param ssid        The SSID of the network to retrieve
     @param out_network [output] The saved network credentials, if found
@@ -86,14 +161,24 @@ bool wifi_is_connected();
 bool wifi_get_saved_network(const char* ssid, wifi_network_credentials* out_network);
 
 /*
-    Retrieves the credentials of all saved Wi-Fi networks.
+    Counts the saved Wi-Fi networks.
+
+    @returns The number of saved networks
+*/
+int wifi_get_saved_network_count();
 
-    @param out_networks [output] List of saved credentials. Must be large enough
-                                 to contain WIFI_MAX_SAVED_NETWORKS entries.
+/*
+    Retrieves the credentials of a saved Wi-Fi network by position, for
+    going through every saved network one at a time. Networks are in the
+    order they were first saved.
 
-    @returns The number of saved credentials returned
+    @param index       Position of the network, less than
+                       wifi_get_saved_network_count()
+    @param out_network [output] The saved network credentials, if found
+
+    @returns Whether or not saved credentials were found
 */
-int wifi_get_all_saved_networks(wifi_network_credentials* out_networks);
+bool wifi_get_saved_network_at(int index, wifi_network_credentials* out_network);
 
 /*
     Saves the credentials of a Wi-Fi network.
@@ -0,0 +1,421 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "storage.h"
+#include "wifi.h"
+#include "wifi_networks.h"
+
+// IDs of every saved network, in the order they were saved. Each network's
+// credentials are stored separately under a key made from its ID, so saving
+// or updating one network never rewrites the others.
+#define WIFI_NETWORK_INDEX_STORAGE_KEY "wifi_index"
+#define WIFI_NETWORK_STORAGE_KEY_FORMAT "wifi_%08" PRIx32
+
+// Saved before each network was stored separately
+#define WIFI_V2_NETWORKS_STORAGE_KEY "wifi_networks2"
+
+// Saved before access points were remembered
+#define WIFI_LEGACY_NETWORKS_STORAGE_KEY "wifi_networks"
+#define WIFI_LEGACY_MAX_SAVED_NETWORKS 5
+
+// A network's ID is the hash of its SSID. If another network already has
+// that ID, the next few IDs are tried.
+#define WIFI_MAX_ID_PROBES 4
+
+// Maps network IDs to their position in the index. Must be a power of 2, and
+// bigger than WIFI_MAX_SAVED_NETWORKS so lookups stay short.
+#define WIFI_NETWORK_TABLE_SIZE 256
+
+// Failures aren't counted past this, so a network that keeps failing doesn't
+// keep writing to storage
+#define WIFI_MAX_FAILURE_COUNT 16
+
+// Assumes dst is a statically allocated array
+#define TRUNCATED_STRING_COPY(dst, src) \
+    strncpy(dst, src, sizeof(dst)); \
+    dst[sizeof(dst) - 1] = '\0';
+
+typedef struct {
+    uint32_t ids[WIFI_MAX_SAVED_NETWORKS];
+    int count;
+
+    // There's no reliable clock, so connections are ordered by counting them.
+    // Kept here so the records don't all have to be read to find the latest.
+    uint32_t last_connection;
+} wifi_network_index;
+
+typedef struct {
+    char ssid[WIFI_MAX_SSID_LENGTH + 1];
+    char pass[WIFI_MAX_PASS_LENGTH + 1];
+    uint8_t bssid[WIFI_BSSID_LENGTH];
+    uint8_t channel;
+    uint8_t auth_mode;
+} wifi_v2_network_credentials;
+
+typedef struct {
+    wifi_v2_network_credentials networks[WIFI_LEGACY_MAX_SAVED_NETWORKS];
+    int count;
+} wifi_v2_saved_network_info;
+
+typedef struct {
+    char ssid[WIFI_MAX_SSID_LENGTH + 1];
+    char pass[WIFI_MAX_PASS_LENGTH + 1];
+} wifi_legacy_network_credentials;
+
+typedef struct {
+    wifi_legacy_network_credentials networks[WIFI_LEGACY_MAX_SAVED_NETWORKS];
+    int count;
+} wifi_legacy_saved_network_info;
+
+static SemaphoreHandle_t s_wifi_storage_lock;
+static wifi_network_index s_index = {0};
+
+// Open-addressed hash table of positions in s_index, plus 1. 0 is empty.
+static uint16_t s_table[WIFI_NETWORK_TABLE_SIZE] = {0};
+
+// FNV-1a
+static uint32_t _hash_ssid(const char* ssid)
+{
+    uint32_t hash = 2166136261u;
+    for (const char* c = ssid; *c != '\0'; ++c)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void _get_storage_key(uint32_t id, char* out_key, size_t key_size)
+{
+    snprintf(out_key, key_size, WIFI_NETWORK_STORAGE_KEY_FORMAT, id);
+}
+
+static void _rebuild_table()
+{
+    memset(s_table, 0, sizeof(s_table));
+
+    for (int i = 0; i < s_index.count; ++i)
+    {
+        uint32_t slot = s_index.ids[i] & (WIFI_NETWORK_TABLE_SIZE - 1);
+        while (s_table[slot] != 0)
+        {
+            slot = (slot + 1) & (WIFI_NETWORK_TABLE_SIZE - 1);
+        }
+        s_table[slot] = i + 1;
+    }
+}
+
+// @returns The position of the ID in the index, or -1 if not saved
+static int _find_id(uint32_t id)
+{
+    uint32_t slot = id & (WIFI_NETWORK_TABLE_SIZE - 1);
+    while (s_table[slot] != 0)
+    {
+        int position = s_table[slot] - 1;
+        if (s_index.ids[position] == id)
+        {
+            return position;
+        }
+        slot = (slot + 1) & (WIFI_NETWORK_TABLE_SIZE - 1);
+    }
+
+    return -1;
+}
+
+static bool _read_network(uint32_t id, wifi_network_credentials* out_network)
+{
+    char key[16] = {0};
+    _get_storage_key(id, key, sizeof(key));
+
+    // Storage serves this from RAM after the first read
+    return storage_read_blob(key, out_network, sizeof(*out_network));
+}
+
+static void _write_network(uint32_t id, const wifi_network_credentials* network)
+{
+    char key[16] = {0};
+    _get_storage_key(id, key, sizeof(key));
+    storage_set_blob(key, network, sizeof(*network));
+}
+
+static void _write_index()
+{
+    storage_set_blob(WIFI_NETWORK_INDEX_STORAGE_KEY, &s_index, sizeof(s_index));
+}
+
+/*
+    Finds a saved network by SSID. Must be called with the lock held.
+
+    @param ssid        SSID of the network
+    @param out_id      [output] ID of the network, if found
+    @param out_network [output] Saved network, if found
+
+    @returns Whether the network is saved
+*/
+static bool _find_network(const char* ssid, uint32_t* out_id, wifi_network_credentials* out_network)
+{
+    uint32_t hash = _hash_ssid(ssid);
+
+    // Networks with the same hash may have been forgotten in between, so
+    // every probe is checked
+    for (int probe = 0; probe < WIFI_MAX_ID_PROBES; ++probe)
+    {
+        uint32_t id = hash + probe;
+        if (_find_id(id) >= 0 && _read_network(id, out_network) && strcmp(out_network->ssid, ssid) == 0)
+        {
+            *out_id = id;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Must be called with the lock held
+static bool _find_free_id(const char* ssid, uint32_t* out_id)
+{
+    uint32_t hash = _hash_ssid(ssid);
+
+    for (int probe = 0; probe < WIFI_MAX_ID_PROBES; ++probe)
+    {
+        if (_find_id(hash + probe) < 0)
+        {
+            *out_id = hash + probe;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Must be called with the lock held
+static bool _save_network(const wifi_network_credentials* network)
+{
+    uint32_t id = 0;
+    wifi_network_credentials existing = {0};
+    if (_find_network(network->ssid, &id, &existing))
+    {
+        _write_network(id, network);
+        return true;
+    }
+
+    if (s_index.count >= WIFI_MAX_SAVED_NETWORKS || !_find_free_id(network->ssid, &id))
+    {
+        return false;
+    }
+
+    _write_network(id, network);
+
+    s_index.ids[s_index.count] = id;
+    ++s_index.count;
+    _rebuild_table();
+    _write_index();
+
+    return true;
+}
+
+static void _migrate_v2_networks()
+{
+    wifi_v2_saved_network_info* saved = storage_get_blob(WIFI_V2_NETWORKS_STORAGE_KEY);
+    if (saved == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < saved->count && i < WIFI_LEGACY_MAX_SAVED_NETWORKS; ++i)
+    {
+        wifi_v2_network_credentials* old = &saved->networks[i];
+
+        wifi_network_credentials network = {0};
+        memcpy(network.ssid, old->ssid, sizeof(network.ssid));
+        memcpy(network.pass, old->pass, sizeof(network.pass));
+        memcpy(network.bssid, old->bssid, sizeof(network.bssid));
+        network.channel = old->channel;
+        network.auth_mode = old->auth_mode;
+
+        _save_network(&network);
+    }
+
+    free(saved);
+    storage_delete(WIFI_V2_NETWORKS_STORAGE_KEY);
+}
+
+static void _migrate_legacy_networks()
+{
+    wifi_legacy_saved_network_info* legacy = storage_get_blob(WIFI_LEGACY_NETWORKS_STORAGE_KEY);
+    if (legacy == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < legacy->count && i < WIFI_LEGACY_MAX_SAVED_NETWORKS; ++i)
+    {
+        wifi_network_credentials network = {0};
+        memcpy(network.ssid, legacy->networks[i].ssid, sizeof(network.ssid));
+        memcpy(network.pass, legacy->networks[i].pass, sizeof(network.pass));
+
+        _save_network(&network);
+    }
+
+    free(legacy);
+    storage_delete(WIFI_LEGACY_NETWORKS_STORAGE_KEY);
+}
+
+void wifi_networks_initialize()
+{
+    s_wifi_storage_lock = xSemaphoreCreateMutex();
+
+    // Only the IDs are loaded. Each network is read when it's needed.
+    if (!storage_read_blob(WIFI_NETWORK_INDEX_STORAGE_KEY, &s_index, sizeof(s_index)))
+    {
+        memset(&s_index, 0, sizeof(s_index));
+    }
+    _rebuild_table();
+
+    _migrate_v2_networks();
+    _migrate_legacy_networks();
+}
+
+void wifi_networks_deinitialize()
+{
+    vSemaphoreDelete(s_wifi_storage_lock);
+}
+
+bool wifi_get_saved_network(const char* ssid, wifi_network_credentials* out_network)
+{
+    assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    uint32_t id = 0;
+    bool found = _find_network(ssid, &id, out_network);
+
+    xSemaphoreGive(s_wifi_storage_lock);
+    return found;
+}
+
+int wifi_get_saved_network_count()
+{
+    assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
+    int count = s_index.count;
+    xSemaphoreGive(s_wifi_storage_lock);
+
+    return count;
+}
+
+bool wifi_get_saved_network_at(int index, wifi_network_credentials* out_network)
+{
+    bool found = false;
+
+    assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    if (index >= 0 && index < s_index.count)
+    {
+        found = _read_network(s_index.ids[index], out_network);
+    }
+
+    xSemaphoreGive(s_wifi_storage_lock);
+    return found;
+}
+
+bool wifi_save_network(const char* ssid, const char* password)
+{
+    assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    // Keep the remembered access point and history of an existing network
+    wifi_network_credentials network = {0};
+    uint32_t id = 0;
+    if (!_find_network(ssid, &id, &network))
+    {
+        memset(&network, 0, sizeof(network));
+        TRUNCATED_STRING_COPY(network.ssid, ssid);
+    }
+    TRUNCATED_STRING_COPY(network.pass, password);
+
+    // Can fail if there's no room. Should have checked and cleared a spot first.
+    bool saved = _save_network(&network);
+
+    xSemaphoreGive(s_wifi_storage_lock);
+    return saved;
+}
+
+void wifi_forget_network(const char* ssid)
+{
+    assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    uint32_t id = 0;
+    wifi_network_credentials network = {0};
+    if (_find_network(ssid, &id, &network))
+    {
+        int position = _find_id(id);
+
+        // Shift left to keep the order networks were saved in
+        memmove(
+            &s_index.ids[position],
+            &s_index.ids[position + 1],
+            (s_index.count - position - 1) * sizeof(s_index.ids[0])
+        );
+        --s_index.count;
+        _rebuild_table();
+        _write_index();
+
+        char key[16] = {0};
+        _get_storage_key(id, key, sizeof(key));
+        storage_delete(key);
+    }
+
+    xSemaphoreGive(s_wifi_storage_lock);
+}
+
+void wifi_networks_remember_ap(
+    const char* ssid,
+    const uint8_t* bssid,
+    uint8_t channel,
+    uint8_t auth_mode,
+    int8_t rssi)
+{
+    assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    uint32_t id = 0;
+    wifi_network_credentials network = {0};
+    if (_find_network(ssid, &id, &network))
+    {
+        memcpy(network.bssid, bssid, sizeof(network.bssid));
+        network.channel = channel;
+        network.auth_mode = auth_mode;
+
+        network.last_connected = ++s_index.last_connection;
+        network.last_rssi = rssi;
+        network.failure_count = 0;
+        if (network.connect_count < UINT16_MAX)
+        {
+            ++network.connect_count;
+        }
+
+        // Only this network's record and the index are written, once per
+        // connection, and storage commits them together
+        _write_network(id, &network);
+        _write_index();
+    }
+
+    xSemaphoreGive(s_wifi_storage_lock);
+}
+
+void wifi_networks_record_failure(const char* ssid)
+{
+    assert(xSemaphoreTake(s_wifi_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    uint32_t id = 0;
+    wifi_network_credentials network = {0};
+    if (_find_network(ssid, &id, &network) && network.failure_count < WIFI_MAX_FAILURE_COUNT)
+    {
+        ++network.failure_count;
+        _write_network(id, &network);
+    }
+
+    xSemaphoreGive(s_wifi_storage_lock);
+}
@@ -0,0 +1,44 @@
+#ifndef _WIFI_NETWORKS_H
+#define _WIFI_NETWORKS_H
+
+#include <stdint.h>
+
+/*
+    Saved network credentials are shared by every Wi-Fi implementation.
+    These are called by wifi_initialize() and wifi_deinitialize().
+*/
+
+/* Loads saved network credentials from storage. */
+void wifi_networks_initialize();
+
+/* Releases resources used for saved network credentials. */
+void wifi_networks_deinitialize();
+
+/*
+    Records the access point a saved network was just reached through, so
+    the next connection can skip scanning, and counts the connection. Does
+    nothing if the network isn't saved.
+
+    @param ssid      SSID of the network
+    @param bssid     BSSID of the access point (WIFI_BSSID_LENGTH bytes)
+    @param channel   Primary channel of the access point
+    @param auth_mode Authentication mode of the access point
+    @param rssi      Signal strength of the access point
+*/
+void wifi_networks_remember_ap(
+    const char* ssid,
+    const uint8_t* bssid,
+    uint8_t channel,
+    uint8_t auth_mode,
+    int8_t rssi
+);
+
+/*
+    Counts a failed attempt to connect to a saved network. Does nothing if
+    the network isn't saved.
+
+    @param ssid SSID of the network
+*/
+void wifi_networks_record_failure(const char* ssid);
+
+#endif
@@ -0,0 +1,29 @@
+#include <esp_log.h>
+
+#include "../http.h"
+
+int http_get(const char* url, char* out, int out_len)
+{
+    ESP_LOGE(__func__, "HTTP is not available in the host build (GET %s)", url);
+    return -1;
+}
+
+http_connection* http_open(const char* url)
+{
+    ESP_LOGE(__func__, "HTTP is not available in the host build (GET %s)", url);
+    return NULL;
+}
+
+bool http_get_range(
+    http_connection* conn,
+    int64_t offset,
+    int64_t* out_total_length,
+    http_data_handler on_data,
+    void* context)
+{
+    return false;
+}
+
+void http_close(http_connection* conn)
+{
+}
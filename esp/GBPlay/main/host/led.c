@@ -0,0 +1,21 @@
+#include <stdbool.h>
+
+#include <esp_log.h>
+
+#include "../hardware/led.h"
+
+static bool s_is_on = false;
+
+void led_initialize()
+{
+    led_set_state(false);
+}
+
+void led_set_state(bool is_on)
+{
+    if (is_on != s_is_on)
+    {
+        ESP_LOGV(__func__, "LED %s", is_on ? "on" : "off");
+        s_is_on = is_on;
+    }
+}
@@ -0,0 +1,9 @@
+#include <esp_log.h>
+
+#include "../ota.h"
+
+bool ota_update(const char* url, const uint8_t* sha256)
+{
+    ESP_LOGE(__func__, "Firmware updates are not available in the host build (%s)", url);
+    return false;
+}
@@ -0,0 +1,19 @@
+#include <esp_log.h>
+
+#include "../hardware/power.h"
+
+// The host never sleeps, so this only keeps track for logging
+static bool s_is_session_active = false;
+
+void power_initialize()
+{
+}
+
+void power_set_session_active(bool is_active)
+{
+    if (is_active != s_is_session_active)
+    {
+        s_is_session_active = is_active;
+        ESP_LOGI(__func__, "Session %s", is_active ? "started" : "ended");
+    }
+}
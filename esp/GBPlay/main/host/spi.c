@@ -0,0 +1,375 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "../hardware/spi.h"
+#include "../ring_buffer.h"
+
+// Path of a Unix socket whose peer plays the part of the Game Boy.
+// Each exchanged byte is one byte in each direction. When the device drives
+// the clock it writes first, otherwise the peer does.
+#define LINK_SOCKET_ENV "GBPLAY_LINK_SOCKET"
+
+// How often to retry connecting to the simulated Game Boy
+#define LINK_CONNECT_RETRY_US (1000 * 1000)
+
+// How often the slave thread checks whether it should stop
+#define SLAVE_POLL_TIMEOUT_MS 100
+
+// Same limit as the hardware, so the host behaves the same
+#define SLAVE_MAX_CLOCK_SPEED SPI_CLOCK_SPEED_DOUBLE
+
+#define SLAVE_TX_BUFFER_SIZE 1024
+#define SLAVE_RX_BUFFER_SIZE 1024
+
+static SemaphoreHandle_t s_spi_lock;
+static spi_role s_role = SPI_ROLE_MASTER;
+static spi_clock_speed s_clock_speed = SPI_CLOCK_SPEED_NORMAL;
+
+static const uint32_t s_clock_speeds_hz[SPI_CLOCK_SPEED_COUNT] = {
+    [SPI_CLOCK_SPEED_NORMAL]      = 8192,
+    [SPI_CLOCK_SPEED_DOUBLE]      = 16384,
+    [SPI_CLOCK_SPEED_FAST]        = 262144,
+    [SPI_CLOCK_SPEED_FAST_DOUBLE] = 524288
+};
+
+// Start time of the next byte is measured from here
+static int64_t s_last_exchange_end_time = 0;
+
+// Simulated Game Boy. Without a socket, the Game Boy echoes back whatever
+// it received in the previous exchange.
+static const char* s_link_path = NULL;
+static int s_link_fd = -1;
+static int64_t s_next_connect_time = 0;
+static uint8_t s_echo_byte = 0xFF;
+
+// Clocked by the simulated Game Boy
+static pthread_t s_slave_thread;
+static atomic_bool s_slave_running = false;
+static atomic_uint_fast8_t s_slave_idle_byte = 0xFF;
+static spi_rx_callback s_slave_rx_callback = NULL;
+static void* s_slave_rx_callback_arg = NULL;
+
+static uint8_t s_slave_tx_storage[SLAVE_TX_BUFFER_SIZE];
+static uint8_t s_slave_rx_storage[SLAVE_RX_BUFFER_SIZE];
+static ring_buffer s_slave_tx;
+static ring_buffer s_slave_rx;
+
+// Like the real shift register, loaded as soon as the previous byte is done.
+// Only touched by the slave thread once it's running.
+static uint8_t s_slave_tx_shift;
+
+static void _wait_until(int64_t deadline)
+{
+    int64_t remaining = deadline - esp_timer_get_time();
+    if (remaining > 0)
+    {
+        usleep(remaining);
+    }
+}
+
+static void _disconnect_link()
+{
+    ESP_LOGW(__func__, "Lost connection to simulated Game Boy");
+    close(s_link_fd);
+    s_link_fd = -1;
+}
+
+static bool _connect_link()
+{
+    if (s_link_fd >= 0)
+    {
+        return true;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (now < s_next_connect_time)
+    {
+        return false;
+    }
+    s_next_connect_time = now + LINK_CONNECT_RETRY_US;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, s_link_path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        ESP_LOGD(__func__, "Unable to reach simulated Game Boy at %s: errno %d", s_link_path, errno);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    ESP_LOGI(__func__, "Connected to simulated Game Boy at %s", s_link_path);
+    s_link_fd = fd;
+    return true;
+}
+
+static bool _link_write(uint8_t b)
+{
+    if (write(s_link_fd, &b, 1) != 1)
+    {
+        _disconnect_link();
+        return false;
+    }
+    return true;
+}
+
+static bool _link_read(uint8_t* out_b)
+{
+    if (read(s_link_fd, out_b, 1) != 1)
+    {
+        _disconnect_link();
+        return false;
+    }
+    return true;
+}
+
+static uint8_t _exchange(uint8_t tx)
+{
+    uint8_t rx = 0xFF;  // What a Game Boy reads with nothing connected
+
+    if (s_link_path == NULL)
+    {
+        rx = s_echo_byte;
+        s_echo_byte = tx;
+    }
+    else if (_connect_link() && _link_write(tx) && !_link_read(&rx))
+    {
+        rx = 0xFF;
+    }
+
+    // Account for the time taken to shift the byte out
+    usleep((8 * 1000 * 1000) / s_clock_speeds_hz[s_clock_speed]);
+    return rx;
+}
+
+static void _load_next_slave_byte()
+{
+    if (ring_buffer_read(&s_slave_tx, &s_slave_tx_shift, 1) == 0)
+    {
+        s_slave_tx_shift = atomic_load(&s_slave_idle_byte);
+    }
+}
+
+static void* _slave_thread(void* arg)
+{
+    while (atomic_load(&s_slave_running))
+    {
+        if (s_link_path == NULL || !_connect_link())
+        {
+            // Nothing will ever drive the clock
+            usleep(SLAVE_POLL_TIMEOUT_MS * 1000);
+            continue;
+        }
+
+        struct pollfd fds[] = {{
+            .fd = s_link_fd,
+            .events = POLLIN
+        }};
+        if (poll(fds, 1, SLAVE_POLL_TIMEOUT_MS) <= 0)
+        {
+            continue;
+        }
+
+        uint8_t rx = 0xFF;
+        if (!_link_read(&rx))
+        {
+            continue;
+        }
+
+        if (_link_write(s_slave_tx_shift))
+        {
+            _load_next_slave_byte();
+            ring_buffer_write(&s_slave_rx, &rx, 1);
+            if (s_slave_rx_callback)
+            {
+                s_slave_rx_callback(s_slave_rx_callback_arg);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void _start_slave()
+{
+    // The ring buffers are reset here, while nothing else is using them
+    ring_buffer_init(&s_slave_tx, s_slave_tx_storage, sizeof(s_slave_tx_storage));
+    ring_buffer_init(&s_slave_rx, s_slave_rx_storage, sizeof(s_slave_rx_storage));
+    _load_next_slave_byte();
+
+    atomic_store(&s_slave_running, true);
+    assert(pthread_create(&s_slave_thread, NULL, &_slave_thread, NULL) == 0);
+}
+
+static void _stop_slave()
+{
+    atomic_store(&s_slave_running, false);
+    pthread_join(s_slave_thread, NULL);
+}
+
+void spi_initialize()
+{
+    s_spi_lock = xSemaphoreCreateMutex();
+
+    ring_buffer_init(&s_slave_tx, s_slave_tx_storage, sizeof(s_slave_tx_storage));
+    ring_buffer_init(&s_slave_rx, s_slave_rx_storage, sizeof(s_slave_rx_storage));
+
+    s_link_path = getenv(LINK_SOCKET_ENV);
+    if (s_link_path == NULL)
+    {
+        ESP_LOGI(__func__, "Simulated Game Boy echoes bytes (set %s to use an external one)", LINK_SOCKET_ENV);
+    }
+
+    s_role = SPI_ROLE_MASTER;
+}
+
+void spi_deinitialize()
+{
+    if (s_role == SPI_ROLE_SLAVE)
+    {
+        _stop_slave();
+    }
+
+    if (s_link_fd >= 0)
+    {
+        close(s_link_fd);
+        s_link_fd = -1;
+    }
+
+    vSemaphoreDelete(s_spi_lock);
+}
+
+uint8_t spi_exchange_byte(uint8_t tx)
+{
+    uint8_t rx = 0xFF;
+    spi_exchange_buffer(&tx, &rx, 1, 0 /* gap_us */);
+    return rx;
+}
+
+void spi_exchange_buffer(const uint8_t* tx, uint8_t* out_rx, size_t len, uint32_t gap_us)
+{
+    assert(xSemaphoreTake(s_spi_lock, portMAX_DELAY) == pdTRUE);
+
+    if (s_role != SPI_ROLE_MASTER)
+    {
+        ESP_LOGE(__func__, "Cannot exchange while the Game Boy drives the clock");
+        memset(out_rx, 0xFF, len);
+    }
+    else
+    {
+        for (size_t i = 0; i < len; ++i)
+        {
+            _wait_until(s_last_exchange_end_time + gap_us);
+            out_rx[i] = _exchange(tx[i]);
+            s_last_exchange_end_time = esp_timer_get_time();
+        }
+    }
+
+    xSemaphoreGive(s_spi_lock);
+}
+
+bool spi_set_role(spi_role role)
+{
+    assert(xSemaphoreTake(s_spi_lock, portMAX_DELAY) == pdTRUE);
+
+    if (role == SPI_ROLE_SLAVE && s_clock_speed > SLAVE_MAX_CLOCK_SPEED)
+    {
+        ESP_LOGE(__func__, "Cannot follow a %" PRIu32 " Hz clock", s_clock_speeds_hz[s_clock_speed]);
+        xSemaphoreGive(s_spi_lock);
+        return false;
+    }
+
+    if (role != s_role)
+    {
+        if (role == SPI_ROLE_SLAVE)
+        {
+            _start_slave();
+        }
+        else
+        {
+            _stop_slave();
+        }
+        s_role = role;
+    }
+
+    xSemaphoreGive(s_spi_lock);
+    return true;
+}
+
+spi_role spi_get_role()
+{
+    return s_role;
+}
+
+bool spi_set_clock_speed(spi_clock_speed speed)
+{
+    assert(speed < SPI_CLOCK_SPEED_COUNT);
+    assert(xSemaphoreTake(s_spi_lock, portMAX_DELAY) == pdTRUE);
+
+    if (s_role == SPI_ROLE_SLAVE && speed > SLAVE_MAX_CLOCK_SPEED)
+    {
+        ESP_LOGE(__func__, "Cannot follow a %" PRIu32 " Hz clock", s_clock_speeds_hz[speed]);
+        xSemaphoreGive(s_spi_lock);
+        return false;
+    }
+
+    s_clock_speed = speed;
+
+    xSemaphoreGive(s_spi_lock);
+    return true;
+}
+
+spi_clock_speed spi_get_clock_speed()
+{
+    return s_clock_speed;
+}
+
+uint32_t spi_get_clock_speed_hz(spi_clock_speed speed)
+{
+    return s_clock_speeds_hz[speed];
+}
+
+void spi_slave_set_idle_byte(uint8_t idle_byte)
+{
+    atomic_store(&s_slave_idle_byte, idle_byte);
+}
+
+void spi_slave_set_rx_callback(spi_rx_callback callback, void* arg)
+{
+    s_slave_rx_callback_arg = arg;
+    s_slave_rx_callback = callback;
+}
+
+size_t spi_slave_queue_tx(const uint8_t* data, size_t len)
+{
+    return ring_buffer_write(&s_slave_tx, data, len);
+}
+
+size_t spi_slave_read_rx(uint8_t* out_data, size_t len)
+{
+    return ring_buffer_read(&s_slave_rx, out_data, len);
+}
+
+void spi_arm_link_wakeup()
+{
+    // The host never sleeps
+}
@@ -0,0 +1,202 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <esp_log.h>
+
+#include "../hardware/storage.h"
+
+// Same limit as NVS
+#define STORAGE_MAX_KEY_LENGTH 15
+
+// Environment variables with this prefix are loaded as strings on startup.
+// E.g., GBPLAY_NVS_server_host=127.0.0.1
+#define STORAGE_ENV_PREFIX "GBPLAY_NVS_"
+
+typedef struct storage_entry {
+    char key[STORAGE_MAX_KEY_LENGTH + 1];
+    void* value;
+    size_t length;
+    struct storage_entry* next;
+} storage_entry;
+
+extern char** environ;
+
+static SemaphoreHandle_t s_storage_lock;
+static storage_entry* s_entries = NULL;
+
+static storage_entry** _find_entry(const char* key)
+{
+    storage_entry** entry = &s_entries;
+    while (*entry != NULL && strcmp((*entry)->key, key) != 0)
+    {
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+static void* _get(const char* key)
+{
+    void* copy = NULL;
+
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    storage_entry* entry = *_find_entry(key);
+    if (entry != NULL)
+    {
+        copy = malloc(entry->length);
+        memcpy(copy, entry->value, entry->length);
+    }
+
+    xSemaphoreGive(s_storage_lock);
+    return copy;
+}
+
+static bool _read(const char* key, void* out_value, size_t min_length, size_t max_length)
+{
+    bool found = false;
+
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    storage_entry* entry = *_find_entry(key);
+    if (entry != NULL && entry->length >= min_length && entry->length <= max_length)
+    {
+        memcpy(out_value, entry->value, entry->length);
+        found = true;
+    }
+
+    xSemaphoreGive(s_storage_lock);
+    return found;
+}
+
+static void _set(const char* key, const void* value, size_t length)
+{
+    assert(strlen(key) <= STORAGE_MAX_KEY_LENGTH);
+
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    storage_entry** slot = _find_entry(key);
+    storage_entry* entry = *slot;
+    if (entry == NULL)
+    {
+        entry = calloc(1, sizeof(storage_entry));
+        strcpy(entry->key, key);
+        *slot = entry;
+    }
+
+    free(entry->value);
+    entry->value = malloc(length);
+    entry->length = length;
+    memcpy(entry->value, value, length);
+
+    xSemaphoreGive(s_storage_lock);
+}
+
+static void _load_environment()
+{
+    size_t prefix_len = strlen(STORAGE_ENV_PREFIX);
+
+    for (char** var = environ; *var != NULL; ++var)
+    {
+        if (strncmp(*var, STORAGE_ENV_PREFIX, prefix_len) != 0)
+        {
+            continue;
+        }
+
+        const char* key = *var + prefix_len;
+        const char* value = strchr(key, '=');
+        size_t key_len = (value != NULL) ? (size_t)(value - key) : 0;
+
+        if (key_len == 0 || key_len > STORAGE_MAX_KEY_LENGTH)
+        {
+            ESP_LOGW(__func__, "Ignoring invalid storage variable '%s'", *var);
+            continue;
+        }
+
+        char key_str[STORAGE_MAX_KEY_LENGTH + 1] = {0};
+        memcpy(key_str, key, key_len);
+        storage_set_string(key_str, value + 1);
+    }
+}
+
+void storage_initialize()
+{
+    s_storage_lock = xSemaphoreCreateMutex();
+    _load_environment();
+}
+
+void storage_deinitialize()
+{
+    while (s_entries != NULL)
+    {
+        storage_entry* next = s_entries->next;
+        free(s_entries->value);
+        free(s_entries);
+        s_entries = next;
+    }
+
+    vSemaphoreDelete(s_storage_lock);
+}
+
+void storage_flush()
+{
+    // Nothing to write. Values only live in memory.
+}
+
+void* storage_get_blob(const char* key)
+{
+    return _get(key);
+}
+
+bool storage_read_blob(const char* key, void* out_value, size_t length)
+{
+    return _read(key, out_value, length, length);
+}
+
+void storage_set_blob(const char* key, const void* value, size_t length)
+{
+    _set(key, value, length);
+    ESP_LOGI(__func__, "Wrote blob '%s' to storage", key);
+}
+
+char* storage_get_string(const char* key)
+{
+    // Strings are stored with their terminator
+    return _get(key);
+}
+
+bool storage_read_string(const char* key, char* out_value, size_t size)
+{
+    return _read(key, out_value, 0, size);
+}
+
+void storage_set_string(const char* key, const char* value)
+{
+    _set(key, value, strlen(value) + 1);
+    ESP_LOGI(__func__, "Wrote string '%s' to storage", key);
+}
+
+void storage_delete(const char* key)
+{
+    assert(xSemaphoreTake(s_storage_lock, portMAX_DELAY) == pdTRUE);
+
+    storage_entry** slot = _find_entry(key);
+    storage_entry* entry = *slot;
+    if (entry == NULL)
+    {
+        ESP_LOGI(__func__, "Key '%s' does not exist in storage. Nothing to do.", key);
+    }
+    else
+    {
+        *slot = entry->next;
+        free(entry->value);
+        free(entry);
+        ESP_LOGI(__func__, "Deleted '%s' from storage", key);
+    }
+
+    xSemaphoreGive(s_storage_lock);
+}
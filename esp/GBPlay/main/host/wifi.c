@@ -0,0 +1,345 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "../hardware/wifi.h"
+#include "../hardware/wifi_networks.h"
+
+// Time taken to associate with a simulated network, with and without
+// scanning for it first
+#define CONNECTION_DELAY_MS      1500
+#define FAST_CONNECTION_DELAY_MS 100
+
+// Time taken by a scan, which visits every channel
+#define SCAN_DELAY_MS 1500
+
+#define SCAN_DONE_BIT (1 << 0)
+
+// Stand-in for the implementation-specific authentication modes
+#define AUTH_MODE_OPEN     0
+#define AUTH_MODE_PASSWORD 1
+
+// If set, the simulated connection drops every this many seconds
+#define DROP_INTERVAL_ENV "GBPLAY_WIFI_DROP_INTERVAL_S"
+
+typedef struct {
+    const char* ssid;
+    const char* pass;
+    uint8_t bssid[WIFI_BSSID_LENGTH];
+    int8_t channel;
+    int8_t rssi;
+} simulated_network;
+
+ESP_EVENT_DEFINE_BASE(NETWORK_EVENT);
+
+// Sorted by RSSI in descending order, like real scan results
+static const simulated_network s_networks[] = {
+    { "GBPlay Host",        "",        { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 }, 6,  -40 },
+    { "GBPlay Host Secure", "gameboy", { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 }, 11, -65 }
+};
+
+static SemaphoreHandle_t s_wifi_lock;
+static TimerHandle_t s_drop_timer = NULL;
+static const simulated_network* s_connected_network = NULL;
+
+static TimerHandle_t s_scan_timer;
+static EventGroupHandle_t s_scan_event_group;
+static volatile bool s_is_scanning = false;
+static int64_t s_scan_time = 0;
+
+static const simulated_network* _find_network(const char* ssid)
+{
+    for (int i = 0; i < sizeof(s_networks) / sizeof(s_networks[0]); ++i)
+    {
+        if (strcmp(s_networks[i].ssid, ssid) == 0)
+        {
+            return &s_networks[i];
+        }
+    }
+    return NULL;
+}
+
+static void _post_disconnect(network_event event_id)
+{
+    ESP_LOGI(__func__, "Disconnected from network %s", s_connected_network->ssid);
+    s_connected_network = NULL;
+
+    ESP_ERROR_CHECK(esp_event_post(NETWORK_EVENT, event_id, NULL, 0, portMAX_DELAY));
+}
+
+static void _on_drop_timer(TimerHandle_t timer)
+{
+    assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
+
+    if (s_connected_network != NULL)
+    {
+        ESP_LOGW(__func__, "Simulating connection drop");
+        _post_disconnect(NETWORK_EVENT_DROPPED);
+    }
+
+    xSemaphoreGive(s_wifi_lock);
+}
+
+static void _on_scan_timer(TimerHandle_t timer)
+{
+    s_scan_time = esp_timer_get_time();
+    s_is_scanning = false;
+    xEventGroupSetBits(s_scan_event_group, SCAN_DONE_BIT);
+
+    ESP_ERROR_CHECK(esp_event_post(NETWORK_EVENT, NETWORK_EVENT_SCAN_DONE, NULL, 0, portMAX_DELAY));
+}
+
+void wifi_initialize()
+{
+    s_wifi_lock = xSemaphoreCreateMutex();
+    s_scan_event_group = xEventGroupCreate();
+    s_scan_timer = xTimerCreate(
+        "wifi-scan",
+        pdMS_TO_TICKS(SCAN_DELAY_MS),
+        pdFALSE,  // uxAutoReload
+        NULL,     // pvTimerID
+        &_on_scan_timer
+    );
+
+    wifi_networks_initialize();
+
+    // Let the network manager connect without any setup
+    if (wifi_get_saved_network_count() == 0)
+    {
+        wifi_save_network(s_networks[0].ssid, s_networks[0].pass);
+    }
+
+    const char* drop_interval = getenv(DROP_INTERVAL_ENV);
+    if (drop_interval != NULL && atoi(drop_interval) > 0)
+    {
+        s_drop_timer = xTimerCreate(
+            "wifi-drop",
+            pdMS_TO_TICKS(atoi(drop_interval) * 1000),
+            pdTRUE,  // uxAutoReload
+            NULL,    // pvTimerID
+            &_on_drop_timer
+        );
+        xTimerStart(s_drop_timer, portMAX_DELAY);
+    }
+}
+
+void wifi_deinitialize()
+{
+    wifi_disconnect();
+
+    if (s_drop_timer != NULL)
+    {
+        xTimerDelete(s_drop_timer, portMAX_DELAY);
+    }
+
+    xTimerDelete(s_scan_timer, portMAX_DELAY);
+    vEventGroupDelete(s_scan_event_group);
+
+    wifi_networks_deinitialize();
+    vSemaphoreDelete(s_wifi_lock);
+}
+
+bool wifi_scan_start(bool quick)
+{
+    // Simulated scans always take the same time
+    if (!s_is_scanning)
+    {
+        s_is_scanning = true;
+        xEventGroupClearBits(s_scan_event_group, SCAN_DONE_BIT);
+        xTimerStart(s_scan_timer, portMAX_DELAY);
+    }
+
+    return true;
+}
+
+static uint8_t _get_auth_mode(const simulated_network* network)
+{
+    return (network->pass[0] != '\0') ? AUTH_MODE_PASSWORD : AUTH_MODE_OPEN;
+}
+
+void wifi_get_scan_results(wifi_ap_info* out_ap_list, uint16_t* ap_count, int64_t* out_scan_time)
+{
+    uint16_t total_aps_returned = 0;
+
+    // Simulated networks are always in range, so only the scan time changes
+    for (int i = 0; i < sizeof(s_networks) / sizeof(s_networks[0]) && total_aps_returned < *ap_count && s_scan_time != 0; ++i)
+    {
+        const simulated_network* src = &s_networks[i];
+        wifi_ap_info* dst = &out_ap_list[total_aps_returned];
+
+        strcpy(dst->ssid, src->ssid);
+        memcpy(dst->bssid, src->bssid, sizeof(dst->bssid));
+        dst->rssi = src->rssi;
+        dst->channel = src->channel;
+        dst->requires_password = src->pass[0] != '\0';
+        dst->auth_mode = _get_auth_mode(src);
+
+        ++total_aps_returned;
+    }
+
+    *ap_count = total_aps_returned;
+
+    if (out_scan_time != NULL)
+    {
+        *out_scan_time = s_scan_time;
+    }
+}
+
+void wifi_scan(wifi_ap_info* out_ap_list, uint16_t* ap_count)
+{
+    wifi_scan_start(false /* quick */);
+    xEventGroupWaitBits(
+        s_scan_event_group,
+        SCAN_DONE_BIT,
+        pdFALSE,  // xClearOnExit
+        pdFALSE,  // xWaitForAllBits
+        portMAX_DELAY
+    );
+
+    wifi_get_scan_results(out_ap_list, ap_count, NULL);
+}
+
+static bool _connect(const char* ssid, const char* password, const wifi_network_credentials* ap, bool force)
+{
+    bool did_connect = false;
+
+    assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
+
+    if (!force && wifi_is_connected())
+    {
+        ESP_LOGI(
+            __func__,
+            "Already connected to a network and new connection is not forced"
+        );
+    }
+    else
+    {
+        if (wifi_is_connected())
+        {
+            _post_disconnect(NETWORK_EVENT_LEFT);
+        }
+
+        ESP_LOGI(__func__, "Trying to connect to network '%s'...", ssid);
+        vTaskDelay(pdMS_TO_TICKS((ap != NULL) ? FAST_CONNECTION_DELAY_MS : CONNECTION_DELAY_MS));
+
+        const simulated_network* network = _find_network(ssid);
+        bool ap_matches = network != NULL && (ap == NULL || (
+            memcmp(ap->bssid, network->bssid, sizeof(ap->bssid)) == 0 &&
+            ap->channel == network->channel &&
+            ap->auth_mode == _get_auth_mode(network)
+        ));
+
+        if (ap_matches && strcmp(network->pass, password) == 0)
+        {
+            network_event_connected connect_event = {0};
+            strcpy(connect_event.ssid, network->ssid);
+
+            s_connected_network = network;
+            did_connect = true;
+
+            wifi_networks_remember_ap(
+                network->ssid,
+                network->bssid,
+                network->channel,
+                _get_auth_mode(network),
+                network->rssi
+            );
+
+            ESP_ERROR_CHECK(esp_event_post(
+                NETWORK_EVENT,
+                NETWORK_EVENT_CONNECTED,
+                &connect_event,
+                sizeof(connect_event),
+                portMAX_DELAY
+            ));
+        }
+        else
+        {
+            ESP_LOGE(__func__, "Connection failed");
+        }
+    }
+
+    xSemaphoreGive(s_wifi_lock);
+    return did_connect;
+}
+
+bool wifi_connect(const char* ssid, const char* password, bool force)
+{
+    return _connect(ssid, password, NULL, force);
+}
+
+bool wifi_connect_to_ap(const wifi_network_credentials* network, bool force)
+{
+    if (network->channel == 0)
+    {
+        return false;
+    }
+
+    bool connected = _connect(network->ssid, network->pass, network, force);
+    if (!connected && !wifi_is_connected())
+    {
+        wifi_networks_record_failure(network->ssid);
+    }
+
+    return connected;
+}
+
+void wifi_disconnect()
+{
+    assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
+
+    if (wifi_is_connected())
+    {
+        _post_disconnect(NETWORK_EVENT_LEFT);
+    }
+
+    xSemaphoreGive(s_wifi_lock);
+}
+
+bool wifi_get_connected_ap(wifi_ap_info* out_ap)
+{
+    bool connected = false;
+
+    assert(xSemaphoreTake(s_wifi_lock, portMAX_DELAY) == pdTRUE);
+
+    const simulated_network* network = s_connected_network;
+    if (network != NULL)
+    {
+        strcpy(out_ap->ssid, network->ssid);
+        memcpy(out_ap->bssid, network->bssid, sizeof(out_ap->bssid));
+        out_ap->rssi = network->rssi;
+        out_ap->channel = network->channel;
+        out_ap->requires_password = network->pass[0] != '\0';
+        out_ap->auth_mode = _get_auth_mode(network);
+        connected = true;
+    }
+
+    xSemaphoreGive(s_wifi_lock);
+    return connected;
+}
+
+void wifi_get_mac_address(uint8_t* out_mac)
+{
+    // Locally administered address, different for each simulated device
+    pid_t pid = getpid();
+    const uint8_t mac[WIFI_BSSID_LENGTH] = {
+        0x02, 0x00, (pid >> 24) & 0xFF, (pid >> 16) & 0xFF, (pid >> 8) & 0xFF, pid & 0xFF
+    };
+    memcpy(out_mac, mac, sizeof(mac));
+}
+
+bool wifi_is_connected()
+{
+    return s_connected_network != NULL;
+}
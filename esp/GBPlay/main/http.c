@@ -1,47 +1,198 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <esp_http_client.h>
 #include <esp_log.h>
 
 #include "http.h"
 
+// Size of the pieces bodies are read in
+#define HTTP_CHUNK_SIZE 1024
+
+#define HTTP_TIMEOUT_MS 10000
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+struct http_connection {
+    esp_http_client_handle_t client;
+    uint8_t buffer[HTTP_CHUNK_SIZE];
+};
+
+// Kept open by http_get(), so repeated requests don't create a new client
+// (and connection, if the server is the same) each time
+static http_connection* s_get_connection = NULL;
+
+typedef struct {
+    char* out;
+    int out_len;
+    int data_read;
+} http_get_context;
+
+static bool _store_body(const uint8_t* data, int length, void* context)
+{
+    http_get_context* ctx = context;
+
+    // Truncate to fit in buffer
+    int len = MIN(length, ctx->out_len - ctx->data_read);
+    memcpy(ctx->out + ctx->data_read, data, len);
+    ctx->data_read += len;
+
+    return ctx->data_read < ctx->out_len;
+}
+
 int http_get(const char* url, char* out, int out_len)
+{
+    if (s_get_connection == NULL)
+    {
+        s_get_connection = http_open(url);
+        if (s_get_connection == NULL)
+        {
+            return -1;
+        }
+    }
+    else if (esp_http_client_set_url(s_get_connection->client, url) != ESP_OK)
+    {
+        // Closes the old connection if the server is different
+        ESP_LOGE(__func__, "Invalid URL %s", url);
+        return -1;
+    }
+
+    http_get_context ctx = {
+        .out = out,
+        .out_len = out_len
+    };
+
+    int64_t content_len = -1;
+    bool success = http_get_range(s_get_connection, 0 /* offset */, &content_len, &_store_body, &ctx);
+
+    if (success)
+    {
+        ESP_LOGI(__func__, "HTTP GET %s content_length = %" PRId64, url, content_len);
+    }
+
+    return success ? ctx.data_read : -1;
+}
+
+http_connection* http_open(const char* url)
 {
     esp_http_client_config_t config = {
-        .url = url
+        .url = url,
+        .timeout_ms = HTTP_TIMEOUT_MS,
+        .keep_alive_enable = true
     };
 
     esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL)
+    {
+        ESP_LOGE(__func__, "Failed to create HTTP client for %s", url);
+        return NULL;
+    }
+
     esp_http_client_set_method(client, HTTP_METHOD_GET);
 
+    http_connection* conn = malloc(sizeof(http_connection));
+    conn->client = client;
+    return conn;
+}
+
+bool http_get_range(
+    http_connection* conn,
+    int64_t offset,
+    int64_t* out_total_length,
+    http_data_handler on_data,
+    void* context)
+{
+    esp_http_client_handle_t client = conn->client;
+    *out_total_length = -1;
+
+    if (offset > 0)
+    {
+        char range[32] = {0};
+        snprintf(range, sizeof(range), "bytes=%" PRId64 "-", offset);
+        esp_http_client_set_header(client, "Range", range);
+    }
+    else
+    {
+        esp_http_client_delete_header(client, "Range");
+    }
+
+    // Reuses the previous connection if it's still open
     esp_err_t err = esp_http_client_open(client, 0 /* write_len */);
     if (err != ESP_OK)
     {
         ESP_LOGE(__func__, "Failed to open HTTP connection: %s", esp_err_to_name(err));
-        return -1;
+        esp_http_client_close(client);
+        return false;
     }
 
-    int content_len = esp_http_client_fetch_headers(client);
+    int64_t content_len = esp_http_client_fetch_headers(client);
     if (content_len < 0)
     {
         ESP_LOGE(__func__, "Failed to fetch HTTP headers");
-        return -1;
+        esp_http_client_close(client);
+        return false;
     }
 
-    // Truncate to fit in buffer
-    int data_read = esp_http_client_read_response(client, out, out_len);
-    if (data_read < 0)
+    // Bytes before offset, when the server sends the whole body anyway
+    int64_t skip = 0;
+
+    int status = esp_http_client_get_status_code(client);
+    if (status == 206)
     {
-        ESP_LOGE(__func__, "Failed to read HTTP response");
-        return -1;
+        *out_total_length = (content_len > 0) ? offset + content_len : -1;
+    }
+    else if (status == 200)
+    {
+        *out_total_length = (content_len > 0) ? content_len : -1;
+        skip = offset;
+    }
+    else
+    {
+        ESP_LOGE(__func__, "HTTP request failed with status %d", status);
+        esp_http_client_close(client);
+        return false;
     }
 
-    // Success
-    ESP_LOGI(__func__, "HTTP GET %s Status = %d, content_length = %d",
-        url,
-        esp_http_client_get_status_code(client),
-        content_len
-    );
+    while (true)
+    {
+        int len = esp_http_client_read(client, (char*)conn->buffer, sizeof(conn->buffer));
+        if (len < 0)
+        {
+            ESP_LOGE(__func__, "Failed to read HTTP response");
+            esp_http_client_close(client);
+            return false;
+        }
+
+        if (len == 0)
+        {
+            if (!esp_http_client_is_complete_data_received(client))
+            {
+                ESP_LOGE(__func__, "HTTP response ended early");
+                esp_http_client_close(client);
+                return false;
+            }
 
-    ESP_ERROR_CHECK(esp_http_client_cleanup(client));
+            // Leave the connection open for the next request
+            return true;
+        }
 
-    return data_read;
+        int skipped = MIN(skip, len);
+        skip -= skipped;
+
+        if (len > skipped && !on_data(conn->buffer + skipped, len - skipped, context))
+        {
+            // The rest of the body would be read as the next response
+            esp_http_client_close(client);
+            return true;
+        }
+    }
+}
+
+void http_close(http_connection* conn)
+{
+    esp_http_client_close(conn->client);
+    esp_http_client_cleanup(conn->client);
+    free(conn);
 }
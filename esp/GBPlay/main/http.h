@@ -1,6 +1,76 @@
 #ifndef _HTTP_H
 #define _HTTP_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// Connection to an HTTP server, kept open between requests
+typedef struct http_connection http_connection;
+
+/*
+    Receives a piece of a response body as it arrives.
+
+    @param data    Next bytes of the body
+    @param length  Number of bytes in data
+    @param context Pointer passed to http_get_range()
+
+    @returns Whether to keep reading the body
+*/
+typedef bool (*http_data_handler)(const uint8_t* data, int length, void* context);
+
+/*
+    Retrieves a web page. The connection is kept for the next call, so this
+    must only be called from one task.
+
+    @param url     URL to GET
+    @param out     [output] Buffer for the response body
+    @param out_len Size of out. Longer bodies are truncated.
+
+    @returns The number of bytes stored in out, or -1 on error.
+*/
 int http_get(const char* url, char* out, int out_len);
 
+/*
+    Prepares to make requests to a server. Nothing is sent until the first
+    request.
+
+    @param url URL to request
+
+    @returns The connection, or NULL on error. Close with http_close().
+*/
+http_connection* http_open(const char* url);
+
+/*
+    Streams a response body, starting part of the way in. The body is passed
+    to on_data in pieces as it arrives instead of being buffered, so it can
+    be as large as necessary. The connection is reused for the next request
+    when the server allows it.
+
+    @param conn             Connection to make the request on
+    @param offset           Number of bytes at the start of the body to skip.
+                            Asked for with a Range header, and skipped here if
+                            the server ignores it.
+    @param out_total_length [output] Length of the whole body, or -1 if the
+                            server didn't say
+    @param on_data          Called with each piece of the body from offset on
+    @param context          Passed to on_data
+
+    @returns false if the request failed or the body ended early. Stopping
+             from on_data is not a failure.
+*/
+bool http_get_range(
+    http_connection* conn,
+    int64_t offset,
+    int64_t* out_total_length,
+    http_data_handler on_data,
+    void* context
+);
+
+/*
+    Closes a connection and releases its resources.
+
+    @param conn Connection to close
+*/
+void http_close(http_connection* conn);
+
 #endif
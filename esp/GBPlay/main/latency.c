@@ -0,0 +1,137 @@
+#include <assert.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "latency.h"
+
+// Each power of two is split into this many buckets, which bounds the error
+#define SUB_BUCKET_BITS  3
+#define SUB_BUCKET_COUNT (1 << SUB_BUCKET_BITS)
+
+// Longer samples are counted in the last bucket
+#define MAX_DURATION_BITS 27  // A little over 2 minutes
+#define MAX_DURATION_US   ((1 << MAX_DURATION_BITS) - 1)
+
+#define BUCKET_COUNT ((MAX_DURATION_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT)
+
+typedef struct {
+    uint32_t buckets[BUCKET_COUNT];
+    uint32_t count;
+    uint32_t max_us;
+} latency_histogram;
+
+static const char* s_stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_STAGE_RECEIVE]       = "receive",
+    [LATENCY_STAGE_LINK_WAIT]     = "link-wait",
+    [LATENCY_STAGE_LINK]          = "link",
+    [LATENCY_STAGE_LINK_PER_BYTE] = "link-per-byte",
+    [LATENCY_STAGE_SEND]          = "send",
+    [LATENCY_STAGE_SERVER]        = "server"
+};
+
+static SemaphoreHandle_t s_latency_lock;
+static latency_histogram s_histograms[LATENCY_STAGE_COUNT];
+
+// Values below SUB_BUCKET_COUNT get a bucket each. Above that, buckets are
+// indexed by the position of the highest set bit and the bits just below it.
+static int _get_bucket_index(uint32_t value)
+{
+    if (value < SUB_BUCKET_COUNT)
+    {
+        return value;
+    }
+
+    int msb = 31 - __builtin_clz(value);
+    int shift = msb - SUB_BUCKET_BITS;
+    int sub_bucket = (value >> shift) & (SUB_BUCKET_COUNT - 1);
+
+    return ((msb - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT) + sub_bucket;
+}
+
+// Largest value counted in a bucket
+static uint32_t _get_bucket_limit(int index)
+{
+    if (index < SUB_BUCKET_COUNT)
+    {
+        return index;
+    }
+
+    int shift = (index / SUB_BUCKET_COUNT) - 1;
+    uint32_t lower = (uint32_t)(SUB_BUCKET_COUNT + (index % SUB_BUCKET_COUNT)) << shift;
+
+    return lower + (1 << shift) - 1;
+}
+
+static uint32_t _get_percentile(const latency_histogram* histogram, uint32_t percent)
+{
+    // Rank of the sample at the percentile, rounded up
+    uint32_t rank = ((uint64_t)histogram->count * percent + 99) / 100;
+    uint32_t seen = 0;
+
+    for (int i = 0; i < BUCKET_COUNT; ++i)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0)
+        {
+            uint32_t limit = _get_bucket_limit(i);
+            return (limit < histogram->max_us) ? limit : histogram->max_us;
+        }
+    }
+
+    return 0;
+}
+
+void latency_initialize()
+{
+    s_latency_lock = xSemaphoreCreateMutex();
+}
+
+void latency_record(latency_stage stage, int64_t duration_us)
+{
+    uint32_t value = (duration_us < 0) ? 0 :
+                     (duration_us > MAX_DURATION_US) ? MAX_DURATION_US :
+                     (uint32_t)duration_us;
+
+    assert(xSemaphoreTake(s_latency_lock, portMAX_DELAY) == pdTRUE);
+
+    latency_histogram* histogram = &s_histograms[stage];
+    ++histogram->buckets[_get_bucket_index(value)];
+    ++histogram->count;
+
+    if (value > histogram->max_us)
+    {
+        histogram->max_us = value;
+    }
+
+    xSemaphoreGive(s_latency_lock);
+}
+
+void latency_get_stats(latency_stage stage, latency_stats* out_stats)
+{
+    assert(xSemaphoreTake(s_latency_lock, portMAX_DELAY) == pdTRUE);
+
+    const latency_histogram* histogram = &s_histograms[stage];
+    out_stats->count = histogram->count;
+    out_stats->p50_us = _get_percentile(histogram, 50);
+    out_stats->p95_us = _get_percentile(histogram, 95);
+    out_stats->p99_us = _get_percentile(histogram, 99);
+    out_stats->max_us = histogram->max_us;
+
+    xSemaphoreGive(s_latency_lock);
+}
+
+const char* latency_stage_name(latency_stage stage)
+{
+    return s_stage_names[stage];
+}
+
+void latency_reset()
+{
+    assert(xSemaphoreTake(s_latency_lock, portMAX_DELAY) == pdTRUE);
+
+    memset(s_histograms, 0, sizeof(s_histograms));
+
+    xSemaphoreGive(s_latency_lock);
+}
@@ -0,0 +1,57 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Stages of handling a link request, in the order they happen
+typedef enum {
+    LATENCY_STAGE_RECEIVE,        // Receiving a request from the server
+    LATENCY_STAGE_LINK_WAIT,      // From the start of a request until the first exchange
+    LATENCY_STAGE_LINK,           // Exchanging a whole request with the Game Boy
+    LATENCY_STAGE_LINK_PER_BYTE,  // Exchanging each byte with the Game Boy
+    LATENCY_STAGE_SEND,           // From the last exchange until the response is sent
+    LATENCY_STAGE_SERVER,         // From sending a response until the next request arrives
+    LATENCY_STAGE_COUNT
+} latency_stage;
+
+typedef struct {
+    uint32_t count;   // Number of samples
+    uint32_t p50_us;
+    uint32_t p95_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} latency_stats;
+
+/* Prepares latency tracking for use. */
+void latency_initialize();
+
+/*
+    Adds a sample to a stage's histogram. Histograms have a fixed size, so
+    this never allocates.
+
+    @param stage       The stage which took the time
+    @param duration_us How long the stage took
+*/
+void latency_record(latency_stage stage, int64_t duration_us);
+
+/*
+    Summarizes the samples recorded for a stage. Percentiles are accurate to
+    within 1/8 of their value and never underestimate.
+
+    @param stage     The stage to summarize
+    @param out_stats [output] Summary of the stage's samples
+*/
+void latency_get_stats(latency_stage stage, latency_stats* out_stats);
+
+/*
+    Returns a short human-readable name for a stage.
+
+    @param stage The stage to name
+*/
+const char* latency_stage_name(latency_stage stage);
+
+/* Discards all recorded samples. */
+void latency_reset();
+
+#endif
@@ -0,0 +1,155 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+
+#include "http.h"
+#include "ota.h"
+
+// Number of times to try the download, resuming where the last try stopped
+#define OTA_MAX_ATTEMPTS 5
+#define OTA_RETRY_DELAY_MS 1000
+
+// How often to log progress
+#define OTA_PROGRESS_INTERVAL (64 * 1024)
+
+typedef struct {
+    esp_ota_handle_t handle;
+    mbedtls_sha256_context sha256;
+    int64_t written;
+    bool write_failed;
+} ota_download;
+
+static bool _write_chunk(const uint8_t* data, int length, void* context)
+{
+    ota_download* download = context;
+
+    esp_err_t err = esp_ota_write(download->handle, data, length);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(__func__, "Failed to write firmware: %s", esp_err_to_name(err));
+        download->write_failed = true;
+        return false;
+    }
+
+    // Hashed as it goes, since the image is never all in memory
+    mbedtls_sha256_update(&download->sha256, data, length);
+
+    int64_t prev_written = download->written;
+    download->written += length;
+
+    if (prev_written / OTA_PROGRESS_INTERVAL != download->written / OTA_PROGRESS_INTERVAL)
+    {
+        ESP_LOGI(__func__, "Downloaded %" PRId64 " KB", download->written / 1024);
+    }
+
+    return true;
+}
+
+static bool _download(http_connection* conn, ota_download* download)
+{
+    for (int attempt = 0; attempt < OTA_MAX_ATTEMPTS; ++attempt)
+    {
+        if (attempt > 0)
+        {
+            ESP_LOGW(__func__, "Resuming download at %" PRId64 " bytes", download->written);
+            vTaskDelay(pdMS_TO_TICKS(OTA_RETRY_DELAY_MS));
+        }
+
+        int64_t total_length = -1;
+        bool success = http_get_range(conn, download->written, &total_length, &_write_chunk, download);
+
+        if (download->write_failed)
+        {
+            // Trying again won't help
+            return false;
+        }
+
+        if (success && (total_length < 0 || download->written == total_length))
+        {
+            return true;
+        }
+    }
+
+    ESP_LOGE(__func__, "Giving up after %d attempts", OTA_MAX_ATTEMPTS);
+    return false;
+}
+
+bool ota_update(const char* url, const uint8_t* sha256)
+{
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == NULL)
+    {
+        ESP_LOGE(__func__, "No OTA partition to update");
+        return false;
+    }
+
+    http_connection* conn = http_open(url);
+    if (conn == NULL)
+    {
+        return false;
+    }
+
+    ota_download download = {0};
+
+    // Erases as it writes, instead of erasing the whole partition up front
+    esp_err_t err = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &download.handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(__func__, "Failed to start OTA update: %s", esp_err_to_name(err));
+        http_close(conn);
+        return false;
+    }
+
+    ESP_LOGI(__func__, "Downloading %s to partition '%s'", url, partition->label);
+
+    mbedtls_sha256_init(&download.sha256);
+    mbedtls_sha256_starts(&download.sha256, 0 /* is224 */);
+
+    bool downloaded = _download(conn, &download);
+    http_close(conn);
+
+    uint8_t digest[OTA_SHA256_LENGTH] = {0};
+    mbedtls_sha256_finish(&download.sha256, digest);
+    mbedtls_sha256_free(&download.sha256);
+
+    if (!downloaded)
+    {
+        esp_ota_abort(download.handle);
+        return false;
+    }
+
+    if (memcmp(digest, sha256, sizeof(digest)) != 0)
+    {
+        ESP_LOGE(__func__, "Firmware hash doesn't match. Not installing it.");
+        esp_ota_abort(download.handle);
+        return false;
+    }
+
+    // Also checks the image is valid for this chip
+    err = esp_ota_end(download.handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(__func__, "Firmware image is invalid: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    err = esp_ota_set_boot_partition(partition);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(__func__, "Failed to switch to new firmware: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    ESP_LOGI(
+        __func__,
+        "Installed %" PRId64 " bytes of firmware. It will run after a restart.",
+        download.written
+    );
+    return true;
+}
@@ -0,0 +1,23 @@
+#ifndef _OTA_H
+#define _OTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OTA_SHA256_LENGTH 32
+
+/*
+    Downloads a firmware image straight into the next OTA partition and
+    makes it the one to boot from. The image is written as it arrives, so it
+    is never held in memory. Interrupted downloads resume where they left
+    off over the same connection.
+
+    @param url    URL of the firmware image (the .bin from the build)
+    @param sha256 Expected SHA-256 of the image (OTA_SHA256_LENGTH bytes)
+
+    @returns Whether the new image was verified and will be booted on the
+             next restart.
+*/
+bool ota_update(const char* url, const uint8_t* sha256);
+
+#endif
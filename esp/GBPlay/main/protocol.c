@@ -0,0 +1,36 @@
+#include <esp_log.h>
+
+#include "protocol.h"
+#include "socket.h"
+
+bool protocol_read_header(int sock, protocol_message* out_msg, int timeout_ms)
+{
+    if (!socket_read(sock, (uint8_t*)out_msg, PROTOCOL_HEADER_SIZE, timeout_ms))
+    {
+        return false;
+    }
+
+    if (out_msg->length > sizeof(out_msg->payload))
+    {
+        ESP_LOGE(
+            __func__,
+            "Message of type 0x%02X is too large (%d bytes)",
+            out_msg->type,
+            out_msg->length
+        );
+        return false;
+    }
+
+    return true;
+}
+
+bool protocol_read_payload(int sock, protocol_message* msg, int timeout_ms)
+{
+    return socket_read(sock, msg->payload, msg->length, timeout_ms);
+}
+
+bool protocol_write_message(int sock, const protocol_message* msg, int timeout_ms)
+{
+    // Header and payload are contiguous, so send them together
+    return socket_write(sock, (const uint8_t*)msg, PROTOCOL_HEADER_SIZE + msg->length, timeout_ms);
+}
@@ -0,0 +1,247 @@
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Messages exchanged with the backend server are framed as follows:
+
+      type    (1 byte)
+      length  (2 bytes, little-endian)
+      payload (length bytes)
+
+    The device sends a hello message as soon as it connects so that the server
+    knows which message types it understands. All multi-byte values are
+    little-endian.
+*/
+
+#define PROTOCOL_VERSION          1
+#define PROTOCOL_MAX_PAYLOAD_SIZE 1024
+#define PROTOCOL_HEADER_SIZE      offsetof(protocol_message, payload)
+
+// Longest game name sent in a hello message. Join codes are always this many
+// letters.
+#define PROTOCOL_MAX_GAME_LENGTH 16
+#define PROTOCOL_JOIN_CODE_LENGTH 4
+
+typedef enum {
+    // Device -> server: protocol version and capabilities (message_hello),
+    // optionally followed by the game to play and a join code, each as a
+    // length (1 byte) and that many characters
+    MESSAGE_TYPE_HELLO    = 0x01,
+
+    // Server -> device: bytes to send to the Game Boy (message_exchange)
+    // Device -> server: bytes received from the Game Boy
+    MESSAGE_TYPE_EXCHANGE = 0x02,
+
+    // Server -> device: which side drives the link clock (message_set_clock_source)
+    MESSAGE_TYPE_SET_CLOCK_SOURCE = 0x03,
+
+    // Server -> device: bytes to send the next times the Game Boy drives the clock
+    MESSAGE_TYPE_QUEUE_RESPONSES = 0x04,
+
+    // Device -> server: bytes received while the Game Boy drives the clock
+    MESSAGE_TYPE_RECEIVED = 0x05,
+
+    // Server -> device: exchange bytes locally until a condition is met (message_responder)
+    // Device -> server: what happened (message_responder_result)
+    MESSAGE_TYPE_RUN_RESPONDER = 0x06,
+
+    // Device -> server: the connection is idle. Payload is empty.
+    // Server -> device: reply to a heartbeat. Payload is empty.
+    MESSAGE_TYPE_HEARTBEAT = 0x07,
+
+    // Server -> device: clock speed to use when we drive the clock (message_set_clock_speed)
+    MESSAGE_TYPE_SET_CLOCK_SPEED = 0x08,
+
+    // Server -> device: request latency statistics (message_get_latency)
+    // Device -> server: latency statistics (message_latency)
+    MESSAGE_TYPE_GET_LATENCY = 0x09,
+
+    // Server -> device: how often to report telemetry (message_set_telemetry)
+    // Device -> server: telemetry report, sent unprompted (message_telemetry)
+    MESSAGE_TYPE_TELEMETRY = 0x0A
+} message_type;
+
+typedef enum {
+    DEVICE_CAPABILITY_TIMED_EXCHANGE = 1 << 0,
+    DEVICE_CAPABILITY_EXTERNAL_CLOCK = 1 << 1,
+    DEVICE_CAPABILITY_LOCAL_RESPONDER = 1 << 2,
+    DEVICE_CAPABILITY_CLOCK_SPEED = 1 << 3,
+    DEVICE_CAPABILITY_LATENCY_STATS = 1 << 4,
+    DEVICE_CAPABILITY_TELEMETRY = 1 << 5
+} device_capability;
+
+typedef enum {
+    CLOCK_SOURCE_DEVICE   = 0,  // Game Boy must use an external clock
+    CLOCK_SOURCE_GAME_BOY = 1   // Game Boy uses its internal clock
+} clock_source;
+
+// Values match spi_clock_speed
+typedef enum {
+    CLOCK_SPEED_NORMAL      = 0,  // 8 KHz
+    CLOCK_SPEED_DOUBLE      = 1,  // 16 KHz
+    CLOCK_SPEED_FAST        = 2,  // 256 KHz
+    CLOCK_SPEED_FAST_DOUBLE = 3   // 512 KHz
+} clock_speed;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint16_t length;
+    uint8_t payload[PROTOCOL_MAX_PAYLOAD_SIZE];
+} protocol_message;
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint32_t capabilities;
+} message_hello;
+
+// Stop exchanging once the Game Boy sends stop_value
+#define EXCHANGE_FLAG_STOP_ON_MATCH (1 << 0)
+
+typedef struct __attribute__((packed)) {
+    uint32_t gap_us;     // Minimum time between bytes
+    uint8_t flags;
+    uint8_t stop_value;
+    uint8_t data[];      // Bytes to send, one after another
+} message_exchange;
+
+typedef struct __attribute__((packed)) {
+    uint8_t source;     // clock_source
+    uint8_t idle_byte;  // Sent when the Game Boy drives the clock and nothing is queued
+} message_set_clock_source;
+
+typedef struct __attribute__((packed)) {
+    uint8_t speed;  // clock_speed
+} message_set_clock_speed;
+
+// Clear latency statistics after reporting them
+#define LATENCY_FLAG_RESET (1 << 0)
+
+typedef struct __attribute__((packed)) {
+    uint8_t flags;
+} message_get_latency;
+
+typedef struct __attribute__((packed)) {
+    uint32_t count;
+    uint32_t p50_us;
+    uint32_t p95_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} message_latency_stage;
+
+typedef struct __attribute__((packed)) {
+    uint8_t stage_count;
+    message_latency_stage stages[];  // In latency_stage order
+} message_latency;
+
+typedef struct __attribute__((packed)) {
+    uint16_t interval_s;  // 0 stops reports
+} message_set_telemetry;
+
+#define TELEMETRY_TASK_NAME_LENGTH 12
+
+typedef struct __attribute__((packed)) {
+    char name[TELEMETRY_TASK_NAME_LENGTH];  // Not terminated if it fills the array
+    uint8_t cpu_percent;    // Share of one core since the previous report
+    uint16_t stack_unused;  // Bytes of stack never used since the task started
+} message_telemetry_task;
+
+/*
+    Periodic health report. The fixed fields are followed by, in order:
+
+      counter_count uint32_t counters, in telemetry_counter order
+      stage_count   message_latency_stage, in latency_stage order (since boot)
+      task_count    message_telemetry_task, busiest first
+
+    Newer firmware may add counters and stages at the end, so the counts must
+    be used to find each section.
+*/
+typedef struct __attribute__((packed)) {
+    uint8_t device_id[6];         // Wi-Fi MAC address
+    uint32_t uptime_s;
+    int8_t rssi;                  // 0 if not connected
+    uint32_t heap_free;           // Bytes
+    uint32_t heap_min_free;       // Lowest since boot
+    uint32_t heap_largest_block;
+    uint8_t cpu_busy_percent;     // Average of all cores since the previous report
+    uint8_t counter_count;
+    uint8_t stage_count;
+    uint8_t task_count;
+    uint8_t data[];
+} message_telemetry;
+
+// Stop and report as soon as the Game Boy sends the rule's rx value
+#define RESPONDER_RULE_FLAG_STOP (1 << 0)
+
+typedef struct __attribute__((packed)) {
+    uint8_t rx;  // Whenever the Game Boy sends this...
+    uint8_t tx;  // ...send this from then on
+    uint8_t flags;
+} responder_rule;
+
+/*
+    Lets the device run polling loops on its own. The device keeps sending
+    the same byte until the Game Boy sends something with a matching rule.
+*/
+typedef struct __attribute__((packed)) {
+    uint32_t gap_us;        // Minimum time between bytes
+    uint32_t timeout_ms;    // Give up if no stop rule matches by then
+    uint8_t initial_tx;     // First byte to send
+    responder_rule rules[]; // Fills the rest of the payload
+} message_responder;
+
+typedef enum {
+    RESPONDER_RESULT_STOPPED   = 0,
+    RESPONDER_RESULT_TIMED_OUT = 1
+} responder_result;
+
+typedef struct __attribute__((packed)) {
+    uint8_t result;           // responder_result
+    uint8_t last_rx;          // Last byte received from the Game Boy
+    uint8_t next_tx;          // Byte which would have been sent next
+    uint32_t exchange_count;  // Number of bytes exchanged
+} message_responder_result;
+
+/*
+    Reads the header of a message from a socket. The payload can then be
+    read with protocol_read_payload(), or streamed directly from the socket.
+
+    @param sock       File descriptor of socket to read from
+    @param out_msg    [output] The message whose header was read
+    @param timeout_ms Number of milliseconds to wait for the header, or -1 to
+                      wait forever
+
+    @returns Whether or not a valid header could be read from the socket.
+*/
+bool protocol_read_header(int sock, protocol_message* out_msg, int timeout_ms);
+
+/*
+    Reads the payload of a message from a socket.
+
+    @param sock       File descriptor of socket to read from
+    @param msg        [input/output] Message whose header was read with
+                      protocol_read_header(). Receives the payload.
+    @param timeout_ms Number of milliseconds to wait for the payload, or -1
+                      to wait forever
+
+    @returns Whether or not the payload could be read from the socket.
+*/
+bool protocol_read_payload(int sock, protocol_message* msg, int timeout_ms);
+
+/*
+    Writes a complete message to a socket.
+
+    @param sock       File descriptor of socket to write to
+    @param msg        The message to write. Only the first msg->length bytes
+                      of the payload are sent.
+    @param timeout_ms Number of milliseconds to wait for the message to be
+                      sent, or -1 to wait forever
+
+    @returns Whether or not the message could be written to the socket.
+*/
+bool protocol_write_message(int sock, const protocol_message* msg, int timeout_ms);
+
+#endif
@@ -0,0 +1,60 @@
+#include <assert.h>
+#include <string.h>
+
+#include <esp_attr.h>
+
+#include "ring_buffer.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+void ring_buffer_init(ring_buffer* rb, uint8_t* storage, size_t capacity)
+{
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+    rb->buf = storage;
+    rb->capacity = capacity;
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
+}
+
+size_t IRAM_ATTR ring_buffer_write(ring_buffer* rb, const uint8_t* data, size_t len)
+{
+    size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+
+    len = MIN(len, rb->capacity - (head - tail));
+
+    // Copy in up to two pieces, in case the data wraps around
+    size_t start = head & (rb->capacity - 1);
+    size_t first_len = MIN(len, rb->capacity - start);
+    memcpy(rb->buf + start, data, first_len);
+    memcpy(rb->buf, data + first_len, len - first_len);
+
+    // Publish the data to the consumer
+    atomic_store_explicit(&rb->head, head + len, memory_order_release);
+    return len;
+}
+
+size_t IRAM_ATTR ring_buffer_read(ring_buffer* rb, uint8_t* out_buf, size_t len)
+{
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+
+    len = MIN(len, head - tail);
+
+    size_t start = tail & (rb->capacity - 1);
+    size_t first_len = MIN(len, rb->capacity - start);
+    memcpy(out_buf, rb->buf + start, first_len);
+    memcpy(out_buf + first_len, rb->buf, len - first_len);
+
+    // Hand the space back to the producer
+    atomic_store_explicit(&rb->tail, tail + len, memory_order_release);
+    return len;
+}
+
+size_t ring_buffer_count(ring_buffer* rb)
+{
+    size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    return head - tail;
+}
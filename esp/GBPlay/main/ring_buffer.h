@@ -0,0 +1,60 @@
+#ifndef _RING_BUFFER_H
+#define _RING_BUFFER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Lock-free byte queue for passing data between exactly one producer task
+    and exactly one consumer task. Only the producer may write and only the
+    consumer may read. Reading and writing are in IRAM, so either side may be
+    an interrupt handler that runs while the flash cache is off.
+*/
+typedef struct {
+    uint8_t* buf;
+    size_t capacity;    // Must be a power of two
+    atomic_size_t head; // Total bytes ever written. Only modified by producer.
+    atomic_size_t tail; // Total bytes ever read. Only modified by consumer.
+} ring_buffer;
+
+/*
+    Prepares a ring buffer for use.
+
+    @param rb       The ring buffer to initialize
+    @param storage  Memory to store queued data in
+    @param capacity Size of storage. Must be a power of two.
+*/
+void ring_buffer_init(ring_buffer* rb, uint8_t* storage, size_t capacity);
+
+/*
+    Queues as much data as there is room for. Producer only.
+
+    @param rb   The ring buffer to write to
+    @param data Data to queue
+    @param len  Length of data
+
+    @returns The number of bytes actually queued
+*/
+size_t ring_buffer_write(ring_buffer* rb, const uint8_t* data, size_t len);
+
+/*
+    Dequeues as much data as is available, up to the specified amount.
+    Consumer only.
+
+    @param rb      The ring buffer to read from
+    @param out_buf [output] Buffer to store dequeued data in
+    @param len     Maximum number of bytes to dequeue
+
+    @returns The number of bytes actually dequeued
+*/
+size_t ring_buffer_read(ring_buffer* rb, uint8_t* out_buf, size_t len);
+
+/*
+    Returns the number of bytes which can currently be dequeued.
+
+    @param rb The ring buffer to check
+*/
+size_t ring_buffer_count(ring_buffer* rb);
+
+#endif
@@ -1,10 +1,18 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netdb.h>
+#include <unistd.h>
 
 #include <esp_log.h>
 #include <esp_timer.h>
 
+#include "datagram_stream.h"
 #include "socket.h"
 
 static bool _set_socket_is_blocking(int sock, bool is_blocking)
@@ -104,7 +112,7 @@ static bool _wait_for_socket_connect(int sock, int timeout_ms)
     return success;
 }
 
-static bool _connect_socket(int sock, struct addrinfo* address, int timeout_ms)
+static bool _connect_socket(int sock, const struct sockaddr_in* address, int timeout_ms)
 {
     // Temporarily switch to non-blocking so we can control the timeout
     if (!_set_socket_is_blocking(sock, false))
@@ -114,7 +122,7 @@ static bool _connect_socket(int sock, struct addrinfo* address, int timeout_ms)
     }
 
     bool success = true;
-    if (connect(sock, address->ai_addr, address->ai_addrlen) < 0)
+    if (connect(sock, (const struct sockaddr*)address, sizeof(*address)) < 0)
     {
         if (errno != EINPROGRESS)
         {
@@ -136,11 +144,40 @@ static bool _connect_socket(int sock, struct addrinfo* address, int timeout_ms)
     return success;
 }
 
-static int _create_socket(struct addrinfo* address, int timeout_ms)
+size_t socket_resolve(const char* address, uint16_t port, struct sockaddr_in* out_addrs, size_t max_addrs)
 {
-    assert(address->ai_protocol == IPPROTO_TCP);
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    char service[NI_MAXSERV] = {0};
+    snprintf(service, sizeof(service), "%d", port);
+    service[NI_MAXSERV - 1] = '\0';
+
+    struct addrinfo* address_info = NULL;
+    if (getaddrinfo(address, service, &hints, &address_info) != 0)
+    {
+        ESP_LOGE(__func__, "Could not get address info for %s:%d", address, port);
+        return 0;
+    }
 
-    int sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    size_t addr_count = 0;
+    for (struct addrinfo* a = address_info; a != NULL && addr_count < max_addrs; a = a->ai_next)
+    {
+        if (a->ai_family == AF_INET && a->ai_addrlen == sizeof(struct sockaddr_in))
+        {
+            memcpy(&out_addrs[addr_count++], a->ai_addr, sizeof(struct sockaddr_in));
+        }
+    }
+
+    freeaddrinfo(address_info);
+    return addr_count;
+}
+
+int socket_connect_address(const struct sockaddr_in* address, int timeout_ms)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock < 0)
     {
         ESP_LOGE(__func__, "Unable to create socket: errno %d", errno);
@@ -165,54 +202,77 @@ static int _create_socket(struct addrinfo* address, int timeout_ms)
     return sock;
 }
 
-int socket_connect(const char* address, uint16_t port, int timeout_ms)
+int socket_connect_datagram(const struct sockaddr_in* address, int timeout_ms)
 {
-    struct addrinfo hints = {0};
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-
-    char service[NI_MAXSERV] = {0};
-    snprintf(service, sizeof(service), "%d", port);
-    service[NI_MAXSERV - 1] = '\0';
+    return datagram_stream_connect(address, timeout_ms);
+}
 
-    struct addrinfo* address_info = NULL;
-    if (getaddrinfo(address, service, &hints, &address_info) != 0)
+// Waits until the socket is ready for the given events or the deadline passes.
+// A negative deadline means wait forever.
+static bool _wait_for_socket(int sock, short events, int64_t deadline)
+{
+    if (deadline < 0)
     {
-        ESP_LOGE(__func__, "Could not get address info for %s:%d", address, port);
-        return -1;
+        return true;
     }
-    else
+
+    while (true)
     {
-        int sock = -1;
-        for (struct addrinfo* a = address_info; a != NULL; a = a->ai_next)
+        int ms_to_wait = (deadline - esp_timer_get_time() + 999) / 1000;
+        if (ms_to_wait <= 0)
         {
-            sock = _create_socket(a, timeout_ms);
-            if (sock >= 0)
-            {
-                break;
-            }
+            errno = ETIMEDOUT;
+            return false;
         }
 
-        freeaddrinfo(address_info);
-        return sock;
+        struct pollfd fds[] = {{
+            .fd = sock,
+            .events = events
+        }};
+        int rc = poll(fds, 1, ms_to_wait);
+
+        if (rc > 0)
+        {
+            return true;
+        }
+        else if (rc < 0 && errno != EINTR)
+        {
+            return false;
+        }
     }
 }
 
-// TODO: detect unclean disconnect (read timeout)
-bool socket_read(int sock, uint8_t* out_buf, size_t buf_len)
+static int64_t _get_deadline(int timeout_ms)
 {
+    return (timeout_ms < 0) ? -1 : esp_timer_get_time() + ((int64_t)timeout_ms * 1000);
+}
+
+bool socket_read(int sock, uint8_t* out_buf, size_t buf_len, int timeout_ms)
+{
+    int64_t deadline = _get_deadline(timeout_ms);
+    if (datagram_stream_owns(sock))
+    {
+        return datagram_stream_read(sock, out_buf, buf_len, deadline);
+    }
+
+    int flags = (timeout_ms < 0) ? 0 : MSG_DONTWAIT;
     ssize_t bytes_read = 0;
 
     while (bytes_read < buf_len)
     {
-        ssize_t ret = recv(sock, out_buf + bytes_read, buf_len - bytes_read, 0);
+        if (!_wait_for_socket(sock, POLLIN, deadline))
+        {
+            ESP_LOGE(__func__, "Timed out reading socket data after %d ms", timeout_ms);
+            return false;
+        }
+
+        ssize_t ret = recv(sock, out_buf + bytes_read, buf_len - bytes_read, flags);
         if (ret == 0)
         {
             ESP_LOGE(__func__, "Socket closed when reading: errno %d", errno);
             return false;
         }
-        else if (ret == -1 && errno != EINTR)
+        else if (ret == -1 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
         {
             ESP_LOGE(__func__, "Error reading socket data: errno %d", errno);
             return false;
@@ -226,20 +286,32 @@ bool socket_read(int sock, uint8_t* out_buf, size_t buf_len)
     return true;
 }
 
-// TODO: detect unclean disconnect (write timeout)
-bool socket_write(int sock, const uint8_t* buf, size_t buf_len)
+bool socket_write(int sock, const uint8_t* buf, size_t buf_len, int timeout_ms)
 {
+    int64_t deadline = _get_deadline(timeout_ms);
+    if (datagram_stream_owns(sock))
+    {
+        return datagram_stream_write(sock, buf, buf_len, deadline);
+    }
+
+    int flags = (timeout_ms < 0) ? 0 : MSG_DONTWAIT;
     ssize_t bytes_written = 0;
 
     while (bytes_written < buf_len)
     {
-        ssize_t ret = send(sock, buf + bytes_written, buf_len - bytes_written, 0);
+        if (!_wait_for_socket(sock, POLLOUT, deadline))
+        {
+            ESP_LOGE(__func__, "Timed out writing socket data after %d ms", timeout_ms);
+            return false;
+        }
+
+        ssize_t ret = send(sock, buf + bytes_written, buf_len - bytes_written, flags);
         if (ret == 0)
         {
             ESP_LOGE(__func__, "Socket closed when writing: errno %d", errno);
             return false;
         }
-        else if (ret == -1 && errno != EINTR)
+        else if (ret == -1 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
         {
             ESP_LOGE(__func__, "Error writing socket data: errno %d", errno);
             return false;
@@ -252,3 +324,52 @@ bool socket_write(int sock, const uint8_t* buf, size_t buf_len)
 
     return true;
 }
+
+int socket_poll(int sock, int other_fd, int timeout_ms)
+{
+    if (datagram_stream_owns(sock))
+    {
+        return datagram_stream_poll(sock, other_fd, timeout_ms);
+    }
+
+    struct pollfd fds[] = {
+        { .fd = sock, .events = POLLIN },
+        { .fd = other_fd, .events = POLLIN }
+    };
+
+    int rc = poll(fds, (other_fd >= 0) ? 2 : 1, timeout_ms);
+    if (rc < 0)
+    {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
+
+        ESP_LOGE(__func__, "Failed waiting for socket data: errno %d", errno);
+        return -1;
+    }
+
+    int ready = 0;
+    if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+    {
+        ready |= SOCKET_POLL_READABLE;
+    }
+    if (other_fd >= 0 && (fds[1].revents & POLLIN))
+    {
+        ready |= SOCKET_POLL_OTHER;
+    }
+
+    return ready;
+}
+
+void socket_close(int sock)
+{
+    if (datagram_stream_owns(sock))
+    {
+        datagram_stream_close(sock);
+    }
+    else
+    {
+        close(sock);
+    }
+}
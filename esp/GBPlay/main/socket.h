@@ -1,39 +1,93 @@
 #ifndef _SOCKET_H
 #define _SOCKET_H
 
+#include <netinet/in.h>
+
+// Results of socket_poll()
+#define SOCKET_POLL_READABLE (1 << 0)
+#define SOCKET_POLL_OTHER    (1 << 1)
+
+/*
+    Looks up the IPv4 addresses of a server. This may block for as long as
+    it takes to query DNS, so callers should hold on to the results.
+
+    @param address   Host name or dotted address to look up
+    @param port      Port number to store in each result
+    @param out_addrs [output] Buffer to store resolved addresses in
+    @param max_addrs Maximum number of addresses to store in out_addrs
+
+    @returns The number of addresses found, or 0 on error.
+*/
+size_t socket_resolve(const char* address, uint16_t port, struct sockaddr_in* out_addrs, size_t max_addrs);
+
+/*
+    Attempts to open a socket to an already resolved address.
+
+    @param address    Address to connect to
+    @param timeout_ms Number of milliseconds to wait before timing out
+
+    @returns The socket file descriptor, or -1 on error.
+*/
+int socket_connect_address(const struct sockaddr_in* address, int timeout_ms);
+
 /*
-    Attempts to open a socket to the specified location.
+    Attempts to open a reliable stream over UDP to an already resolved
+    address. The result is used like any other socket from this file, but
+    copes better with lost packets. See datagram_stream.h.
 
     @param address    Address to connect to
-    @param port       Port number to connect to
     @param timeout_ms Number of milliseconds to wait before timing out
 
     @returns The socket file descriptor, or -1 on error.
 */
-int socket_connect(const char* address, uint16_t port, int timeout_ms);
+int socket_connect_datagram(const struct sockaddr_in* address, int timeout_ms);
 
 /*
     Reads data from a socket. Returns once enough data has been read to
     completely fill the specified buffer, or an error has occurred.
 
-    @param sock    File descriptor of socket to read from
-    @param out_buf [output] Buffer to store receieved data in
-    @param buf_len Length of receive buffer, out_buf
+    @param sock       File descriptor of socket to read from
+    @param out_buf    [output] Buffer to store receieved data in
+    @param buf_len    Length of receive buffer, out_buf
+    @param timeout_ms Number of milliseconds to wait for all of the data
+                      before giving up, or -1 to wait forever
 
     @returns Whether or not all of the data could be read from the socket.
 */
-bool socket_read(int sock, uint8_t* out_buf, size_t buf_len);
+bool socket_read(int sock, uint8_t* out_buf, size_t buf_len, int timeout_ms);
 
 /*
     Writes data to a socket. Returns once all of the data in the specified
     buffer has been written, or an error has occurred.
 
-    @param sock    File descriptor of socket to write to
-    @param buf     Buffer to write to the socket
-    @param buf_len Length of send buffer, buf
+    @param sock       File descriptor of socket to write to
+    @param buf        Buffer to write to the socket
+    @param buf_len    Length of send buffer, buf
+    @param timeout_ms Number of milliseconds to wait for all of the data to
+                      be sent before giving up, or -1 to wait forever
 
     @returns Whether or not all of the data could be written to the socket.
 */
-bool socket_write(int sock, const uint8_t* buf, size_t buf_len);
+bool socket_write(int sock, const uint8_t* buf, size_t buf_len, int timeout_ms);
+
+/*
+    Waits until a socket has data to read, or another file descriptor
+    becomes readable.
+
+    @param sock       File descriptor of socket to wait for
+    @param other_fd   Another file descriptor to wait for, or -1
+    @param timeout_ms Number of milliseconds to wait, or -1 to wait forever
+
+    @returns SOCKET_POLL_READABLE and/or SOCKET_POLL_OTHER depending on
+             what is ready, 0 on timeout, or -1 on error.
+*/
+int socket_poll(int sock, int other_fd, int timeout_ms);
+
+/*
+    Closes a socket opened by this file.
+
+    @param sock File descriptor of socket to close
+*/
+void socket_close(int sock);
 
 #endif
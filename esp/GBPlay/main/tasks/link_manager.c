@@ -0,0 +1,337 @@
+#include <stdatomic.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "../hardware/spi.h"
+#include "protocol.h"
+#include "ring_buffer.h"
+#include "link_manager.h"
+
+#define TASK_NAME "link-manager"
+
+// Must be powers of two, large enough to hold an entire batch
+#define REQUEST_BUFFER_SIZE  2048
+#define RESPONSE_BUFFER_SIZE 1024
+
+// Number of bytes handed to the SPI driver at once
+#define LINK_CHUNK_SIZE 64
+
+// Responders never run longer than this, so a dead connection is noticed
+#define RESPONDER_MAX_TIMEOUT_MS 30000
+
+typedef enum {
+    RESPONDER_ACTION_NONE = 0,
+    RESPONDER_ACTION_RESPOND,
+    RESPONDER_ACTION_STOP
+} responder_action;
+
+#define NOTIFY_BATCH_DONE (1 << 0)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static TaskHandle_t s_link_manager_task;
+static TaskHandle_t s_submitting_task;
+
+// Requests are the batch type and payload length, followed by the payload
+static uint8_t s_request_storage[REQUEST_BUFFER_SIZE];
+static uint8_t s_response_storage[RESPONSE_BUFFER_SIZE];
+static ring_buffer s_requests;
+static ring_buffer s_responses;
+
+static atomic_bool s_cancel;
+static link_batch_timing s_timing;
+static size_t s_submit_remaining;
+
+// Responder rules, indexed by received byte
+static uint8_t s_responder_actions[256];
+static uint8_t s_responder_tx[256];
+
+static size_t _read_available(uint8_t* out_buf, size_t max_len)
+{
+    // Wait until there is something to read or the batch is cancelled
+    while (true)
+    {
+        size_t len = ring_buffer_read(&s_requests, out_buf, max_len);
+        if (len > 0 || atomic_load(&s_cancel))
+        {
+            return len;
+        }
+
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+static bool _read_request(uint8_t* out_buf, size_t len)
+{
+    size_t bytes_read = 0;
+    while (bytes_read < len)
+    {
+        size_t ret = _read_available(out_buf + bytes_read, len - bytes_read);
+        if (ret == 0)
+        {
+            return false;
+        }
+        bytes_read += ret;
+    }
+
+    return true;
+}
+
+static void _run_exchange(uint16_t payload_len)
+{
+    message_exchange exchange = {0};
+    if (!_read_request((uint8_t*)&exchange, sizeof(exchange)))
+    {
+        return;
+    }
+
+    bool stop_on_match = (exchange.flags & EXCHANGE_FLAG_STOP_ON_MATCH) != 0;
+    bool stopped = false;
+    size_t remaining = payload_len - sizeof(exchange);
+
+    while (remaining > 0)
+    {
+        uint8_t tx[LINK_CHUNK_SIZE];
+        uint8_t rx[LINK_CHUNK_SIZE];
+
+        // Need to inspect each byte as it comes in when stopping on a match
+        size_t max_len = stop_on_match ? 1 : MIN(remaining, sizeof(tx));
+        size_t len = _read_available(tx, max_len);
+        if (len == 0)
+        {
+            // Cancelled
+            break;
+        }
+
+        remaining -= len;
+        if (stopped)
+        {
+            // Discard the rest of the batch
+            continue;
+        }
+
+        if (s_timing.link_start == 0)
+        {
+            s_timing.link_start = esp_timer_get_time();
+        }
+
+        spi_exchange_buffer(tx, rx, len, exchange.gap_us);
+        s_timing.link_end = esp_timer_get_time();
+        s_timing.byte_count += len;
+
+        // Always fits, since a response is never larger than its request
+        ring_buffer_write(&s_responses, rx, len);
+
+        stopped = stop_on_match && rx[0] == exchange.stop_value;
+    }
+}
+
+static void _run_responder(uint16_t payload_len)
+{
+    message_responder responder = {0};
+    if (!_read_request((uint8_t*)&responder, sizeof(responder)))
+    {
+        return;
+    }
+
+    memset(s_responder_actions, RESPONDER_ACTION_NONE, sizeof(s_responder_actions));
+
+    size_t remaining = payload_len - sizeof(responder);
+    while (remaining >= sizeof(responder_rule))
+    {
+        responder_rule rule = {0};
+        if (!_read_request((uint8_t*)&rule, sizeof(rule)))
+        {
+            return;
+        }
+        remaining -= sizeof(rule);
+
+        bool stop = (rule.flags & RESPONDER_RULE_FLAG_STOP) != 0;
+        s_responder_actions[rule.rx] = stop ? RESPONDER_ACTION_STOP : RESPONDER_ACTION_RESPOND;
+        s_responder_tx[rule.rx] = rule.tx;
+    }
+
+    // Ignore any trailing partial rule
+    uint8_t discard[sizeof(responder_rule)];
+    if (!_read_request(discard, remaining))
+    {
+        return;
+    }
+
+    uint32_t timeout_ms = MIN(responder.timeout_ms, RESPONDER_MAX_TIMEOUT_MS);
+    int64_t deadline = esp_timer_get_time() + ((int64_t)timeout_ms * 1000);
+
+    message_responder_result result = {
+        .result = RESPONDER_RESULT_TIMED_OUT
+    };
+
+    uint8_t tx = responder.initial_tx;
+    s_timing.link_start = esp_timer_get_time();
+
+    while (esp_timer_get_time() < deadline && !atomic_load(&s_cancel))
+    {
+        uint8_t rx = 0xFF;
+        spi_exchange_buffer(&tx, &rx, 1, responder.gap_us);
+
+        ++result.exchange_count;
+        result.last_rx = rx;
+
+        responder_action action = s_responder_actions[rx];
+        if (action == RESPONDER_ACTION_STOP)
+        {
+            result.result = RESPONDER_RESULT_STOPPED;
+            break;
+        }
+        else if (action == RESPONDER_ACTION_RESPOND)
+        {
+            tx = s_responder_tx[rx];
+        }
+    }
+
+    s_timing.link_end = esp_timer_get_time();
+    s_timing.byte_count = result.exchange_count;
+
+    result.next_tx = tx;
+    ring_buffer_write(&s_responses, (const uint8_t*)&result, sizeof(result));
+}
+
+static void _run_batch()
+{
+    uint8_t type = 0;
+    uint16_t payload_len = 0;
+
+    if (!_read_request(&type, sizeof(type)) ||
+        !_read_request((uint8_t*)&payload_len, sizeof(payload_len)))
+    {
+        return;
+    }
+
+    switch (type)
+    {
+        case LINK_BATCH_EXCHANGE:
+            _run_exchange(payload_len);
+            break;
+        case LINK_BATCH_RESPONDER:
+            _run_responder(payload_len);
+            break;
+    }
+}
+
+static void task_link_manager(void* data)
+{
+    while (true)
+    {
+        _run_batch();
+
+        if (atomic_load(&s_cancel))
+        {
+            // Throw away whatever was submitted
+            uint8_t discard[LINK_CHUNK_SIZE];
+            while (ring_buffer_read(&s_requests, discard, sizeof(discard)) > 0);
+
+            atomic_store(&s_cancel, false);
+        }
+
+        xTaskNotify(s_submitting_task, NOTIFY_BATCH_DONE, eSetBits);
+    }
+}
+
+static void _wait_for_batch_done()
+{
+    uint32_t bits = 0;
+    while (!(bits & NOTIFY_BATCH_DONE))
+    {
+        xTaskNotifyWait(
+            0,                  // ulBitsToClearOnEntry
+            NOTIFY_BATCH_DONE,  // ulBitsToClearOnExit
+            &bits,              // pulNotificationValue
+            portMAX_DELAY       // xTicksToWait
+        );
+    }
+}
+
+static void _submit(const uint8_t* data, size_t len)
+{
+    while (true)
+    {
+        size_t written = ring_buffer_write(&s_requests, data, len);
+        xTaskNotifyGive(s_link_manager_task);
+
+        data += written;
+        len -= written;
+        if (len == 0)
+        {
+            break;
+        }
+
+        // The buffer holds a whole batch, so this should never happen
+        ESP_LOGW(TASK_NAME, "Request buffer full. Waiting for link.");
+        vTaskDelay(1);
+    }
+}
+
+void link_begin_batch(link_batch_type type, uint16_t payload_len)
+{
+    s_submitting_task = xTaskGetCurrentTaskHandle();
+    s_submit_remaining = payload_len;
+
+    memset(&s_timing, 0, sizeof(s_timing));
+    s_timing.request_start = esp_timer_get_time();
+
+    uint8_t type_byte = type;
+    _submit(&type_byte, sizeof(type_byte));
+    _submit((const uint8_t*)&payload_len, sizeof(payload_len));
+}
+
+void link_submit(const uint8_t* data, size_t len)
+{
+    s_submit_remaining -= len;
+    if (s_submit_remaining == 0)
+    {
+        s_timing.request_end = esp_timer_get_time();
+    }
+
+    _submit(data, len);
+}
+
+size_t link_finish_batch(uint8_t* out_result, size_t max_len, link_batch_timing* out_timing)
+{
+    _wait_for_batch_done();
+
+    *out_timing = s_timing;
+    return ring_buffer_read(&s_responses, out_result, max_len);
+}
+
+void link_cancel_batch()
+{
+    atomic_store(&s_cancel, true);
+    xTaskNotifyGive(s_link_manager_task);
+
+    _wait_for_batch_done();
+
+    // Nobody will ever collect the responses
+    uint8_t discard[LINK_CHUNK_SIZE];
+    while (ring_buffer_read(&s_responses, discard, sizeof(discard)) > 0);
+}
+
+void task_link_manager_start(int core, int priority)
+{
+    ring_buffer_init(&s_requests, s_request_storage, sizeof(s_request_storage));
+    ring_buffer_init(&s_responses, s_response_storage, sizeof(s_response_storage));
+    atomic_init(&s_cancel, false);
+
+    xTaskCreatePinnedToCore(
+        &task_link_manager,
+        TASK_NAME,
+        4096,                   // Stack size
+        NULL,                   // Arguments
+        priority,               // Priority
+        &s_link_manager_task,   // Task handle (output parameter)
+        core                    // CPU core ID
+    );
+}
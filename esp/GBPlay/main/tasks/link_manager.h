@@ -0,0 +1,67 @@
+#ifndef _LINK_MANAGER_H
+#define _LINK_MANAGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    LINK_BATCH_EXCHANGE,  // Payload is a message_exchange
+    LINK_BATCH_RESPONDER  // Payload is a message_responder
+} link_batch_type;
+
+// Times (from esp_timer_get_time()) at which each stage of a batch happened
+typedef struct {
+    int64_t request_start;  // Request started arriving from the server
+    int64_t request_end;    // Last byte of request arrived from the server
+    int64_t link_start;     // First byte started exchanging with the Game Boy
+    int64_t link_end;       // Last byte finished exchanging with the Game Boy
+    int64_t response_sent;  // Response was written to the server
+    uint32_t byte_count;    // Number of bytes exchanged with the Game Boy
+} link_batch_timing;
+
+/*
+    Exchanges data with the Game Boy on behalf of the socket manager.
+
+    Requests are streamed to the link task as they arrive from the server, so
+    the first bytes can be exchanged while the rest are still being received.
+    Data is passed between tasks using lock-free ring buffers, so only one
+    task may submit batches.
+*/
+void task_link_manager_start(int core, int priority);
+
+/*
+    Starts a new batch of exchanges. Must be followed by exactly payload_len
+    bytes of link_submit() calls and then link_finish_batch(), or by
+    link_cancel_batch().
+
+    @param type        What to do with the payload
+    @param payload_len Length of the message payload
+*/
+void link_begin_batch(link_batch_type type, uint16_t payload_len);
+
+/*
+    Passes part of the current message payload to the link task.
+
+    @param data Payload data
+    @param len  Length of data
+*/
+void link_submit(const uint8_t* data, size_t len);
+
+/*
+    Waits for the link task to finish the current batch.
+
+    @param out_result [output] Response payload. For exchanges, the bytes
+                      received from the Game Boy. For responders, a
+                      message_responder_result.
+    @param max_len    Size of out_result
+    @param out_timing [output] Times at which each stage of the batch happened.
+                      response_sent is left for the caller to fill in.
+
+    @returns The length of the response payload
+*/
+size_t link_finish_batch(uint8_t* out_result, size_t max_len, link_batch_timing* out_timing);
+
+/* Abandons the current batch (e.g., because the server disconnected). */
+void link_cancel_batch();
+
+#endif
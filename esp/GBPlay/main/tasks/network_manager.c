@@ -1,27 +1,69 @@
 #include <string.h>
-#include <unistd.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <freertos/task.h>
+#include <freertos/timers.h>
 
 #include <esp_event.h>
 #include <esp_log.h>
 #include <esp_timer.h>
 
 #include "../hardware/wifi.h"
+#include "socket_manager.h"
+#include "telemetry.h"
 
 #define TASK_NAME "network-manager"
 
-#define IDLE_SCAN_PERIOD_SECONDS    30
-#define SCAN_LIST_SIZE              10
-#define NETWORK_HISTORY_SIZE        WIFI_MAX_SAVED_NETWORKS
+#define NETWORK_HISTORY_SIZE        16
 #define MINUTE_MICROSECONDS         (60 * 1000 * 1000)
 #define NETWORK_BLOCK_MINUTES       5
 
+// Time between reconnection attempts. Doubles after each failed attempt.
+#define MIN_RETRY_DELAY_MS          1000
+#define MAX_RETRY_DELAY_MS          (30 * 1000)
+
+// Time a network is skipped after failing to connect. Doubles with each
+// consecutive failure.
+#define MIN_NETWORK_BACKOFF_MS      1000
+#define MAX_NETWORK_BACKOFF_MS      (5 * 60 * 1000)
+
+// Remembered access points tried before falling back to scanning
+#define MAX_KNOWN_AP_ATTEMPTS       3
+
+// Older scan results aren't used to pick networks
+#define SCAN_RESULTS_MAX_AGE_US     (60 * 1000 * 1000)
+
+// How often to sample the RSSI of the connected access point
+#define RSSI_SAMPLE_PERIOD_MS       2000
+#define RSSI_HISTORY_SIZE           8
+
+// Look for a better access point when the signal is weak, or is getting
+// close to weak and falling this fast (dB over the sample history)
+#define ROAM_FALLING_RSSI_DB        6
+
+// Minimum time between scans for a better access point
+#define ROAM_SCAN_PERIOD_US         (30 * 1000 * 1000)
+
+// How much stronger another access point must be to be worth switching to
+#define ROAM_MIN_IMPROVEMENT_DB     8
+
+// Only switch once the link has been quiet this long, so transfers are never
+// interrupted. Candidates older than the max age are found again.
+#define ROAM_MIN_LINK_IDLE_MS       3000
+#define ROAM_CANDIDATE_MAX_AGE_US   (60 * 1000 * 1000)
+
+// Set when it's time to retry or sample the RSSI. The other bits are network
+// events.
+#define RSSI_SAMPLE_BIT             (1 << 6)
+#define RETRY_BIT                   (1 << 7)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 typedef struct {
     char ssid[WIFI_MAX_SSID_LENGTH + 1];
-    int64_t blocked_until;  // For blacklisting networks on disconnect
+    int64_t blocked_until;  // For skipping networks after disconnects and failures
+    int failure_count;      // Consecutive failed connection attempts
 } network_info;
 
 // Ring buffer of metadata for previously-used networks
@@ -29,11 +71,32 @@ typedef struct {
     network_info used_networks[NETWORK_HISTORY_SIZE];
     char prev_ssid[WIFI_MAX_SSID_LENGTH + 1];
     int next_index;
+
+    // Ring buffer of recent RSSI samples of the connected access point
+    int8_t rssi_samples[RSSI_HISTORY_SIZE];
+    int rssi_sample_count;
+    int next_rssi_index;
 } network_history;
 
 static EventGroupHandle_t s_connection_event_group;
+static TimerHandle_t s_retry_timer;
+static TimerHandle_t s_rssi_timer;
 static network_history s_network_history = {0};
 
+// Access point to switch to once the link is idle
+static wifi_network_credentials s_roam_candidate;
+static int64_t s_roam_candidate_time = 0;  // 0 if there is no candidate
+static int64_t s_last_roam_scan_time = 0;
+static bool s_roam_scan_pending = false;
+static bool s_is_roaming = false;
+
+// Cleared when the user leaves a network, so we stay disconnected
+static bool s_should_reconnect = false;
+static int s_retry_delay_ms = MIN_RETRY_DELAY_MS;
+
+// Too big for the task stack
+static wifi_ap_info s_scan_results[WIFI_MAX_SCAN_RESULTS];
+
 static void _on_disconnect(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
     xEventGroupSetBits(s_connection_event_group, NETWORK_EVENT_DROPPED);
@@ -54,6 +117,21 @@ static void _on_connect(void* arg, esp_event_base_t event_base, int32_t event_id
     xEventGroupSetBits(s_connection_event_group, NETWORK_EVENT_CONNECTED);
 }
 
+static void _on_scan_done(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+    xEventGroupSetBits(s_connection_event_group, NETWORK_EVENT_SCAN_DONE);
+}
+
+static void _on_retry_timer(TimerHandle_t timer)
+{
+    xEventGroupSetBits(s_connection_event_group, RETRY_BIT);
+}
+
+static void _on_rssi_timer(TimerHandle_t timer)
+{
+    xEventGroupSetBits(s_connection_event_group, RSSI_SAMPLE_BIT);
+}
+
 static network_info* _ensure_network_info(const char* ssid)
 {
     for (int i = 0; i < NETWORK_HISTORY_SIZE; ++i)
@@ -83,6 +161,18 @@ static void _clear_network_history()
     s_network_history.next_index = 0;
 }
 
+static bool _is_blocked(const char* ssid)
+{
+    network_info* info = _ensure_network_info(ssid);
+    if (info->blocked_until > esp_timer_get_time())
+    {
+        ESP_LOGD(TASK_NAME, "Skipped network '%s' due to temporary block", ssid);
+        return true;
+    }
+
+    return false;
+}
+
 static void _block_network(network_info* info)
 {
     ESP_LOGI(
@@ -94,24 +184,28 @@ static void _block_network(network_info* info)
     info->blocked_until = esp_timer_get_time() + (NETWORK_BLOCK_MINUTES * MINUTE_MICROSECONDS);
 }
 
-static bool _try_connect(wifi_network_credentials* creds)
+static void _back_off_network(network_info* info)
 {
-    network_info* info = _ensure_network_info(creds->ssid);
-    if (info->blocked_until > esp_timer_get_time())
-    {
-        ESP_LOGD(TASK_NAME, "Skipped network '%s' due to temporary block", creds->ssid);
-        return false;
-    }
+    // Capped well before the shift could overflow
+    int shift = MIN(info->failure_count, 16);
+    int backoff_ms = MIN(MIN_NETWORK_BACKOFF_MS << shift, MAX_NETWORK_BACKOFF_MS);
+    ++info->failure_count;
+
+    ESP_LOGI(TASK_NAME, "Skipping network '%s' for %d ms", info->ssid, backoff_ms);
+    info->blocked_until = esp_timer_get_time() + ((int64_t)backoff_ms * 1000);
+}
 
+static bool _try_connect(wifi_network_credentials* creds)
+{
     ESP_LOGI(TASK_NAME, "Trying network '%s'...", creds->ssid);
-    if (wifi_connect(creds->ssid, creds->pass, false /* force */))
+    if (wifi_connect_to_ap(creds, false /* force */))
     {
         ESP_LOGI(TASK_NAME, "Successfully connected to network '%s'", creds->ssid);
         return true;
     }
 
     ESP_LOGI(TASK_NAME, "Failed to connect to network '%s'", creds->ssid);
-    _block_network(info);
+    _back_off_network(_ensure_network_info(creds->ssid));
     return false;
 }
 
@@ -124,26 +218,97 @@ static bool _try_connect_prev()
         return false;
     }
 
-    return _try_connect(&creds);
+    return creds.channel != 0 && !_is_blocked(creds.ssid) && _try_connect(&creds);
+}
+
+// Whether network a should be tried before network b
+static bool _is_preferred(const wifi_network_credentials* a, const wifi_network_credentials* b)
+{
+    // Networks that have been failing go last
+    if (a->failure_count != b->failure_count)
+    {
+        return a->failure_count < b->failure_count;
+    }
+
+    return a->last_connected > b->last_connected;
 }
 
-static bool _try_autoconnect()
+static bool _try_known_access_points()
 {
-    ESP_LOGI(TASK_NAME, "Trying to auto-connect to a network...");
+    // Going straight to a remembered access point is much quicker than
+    // scanning, and usually works since access points rarely move. There
+    // can be many saved networks, so only the most promising are tried.
+    wifi_network_credentials candidates[MAX_KNOWN_AP_ATTEMPTS] = {0};
+    int candidate_count = 0;
+
+    int count = wifi_get_saved_network_count();
+    for (int i = 0; i < count; ++i)
+    {
+        // The previous network was already tried
+        wifi_network_credentials creds = {0};
+        if (!wifi_get_saved_network_at(i, &creds) ||
+            creds.channel == 0 ||
+            strcmp(creds.ssid, s_network_history.prev_ssid) == 0)
+        {
+            continue;
+        }
+
+        // Insertion sort into the short list
+        int position = candidate_count;
+        while (position > 0 && _is_preferred(&creds, &candidates[position - 1]))
+        {
+            --position;
+        }
+
+        if (position >= MAX_KNOWN_AP_ATTEMPTS)
+        {
+            continue;
+        }
+
+        int last = MIN(candidate_count, MAX_KNOWN_AP_ATTEMPTS - 1);
+        memmove(&candidates[position + 1], &candidates[position], (last - position) * sizeof(candidates[0]));
+        candidates[position] = creds;
+        candidate_count = MIN(candidate_count + 1, MAX_KNOWN_AP_ATTEMPTS);
+    }
+
+    for (int i = 0; i < candidate_count; ++i)
+    {
+        if (!_is_blocked(candidates[i].ssid) && _try_connect(&candidates[i]))
+        {
+            return true;
+        }
+    }
 
-    // Results will be sorted by RSSI in descending order
-    wifi_ap_info available_aps[SCAN_LIST_SIZE] = {0};
-    uint16_t ap_count = SCAN_LIST_SIZE;
-    wifi_scan(available_aps, &ap_count);
+    return false;
+}
 
-    ESP_LOGI(TASK_NAME, "Found %d networks", ap_count);
+static bool _try_scanned_networks()
+{
+    uint16_t ap_count = WIFI_MAX_SCAN_RESULTS;
+    int64_t scan_time = 0;
+    wifi_get_scan_results(s_scan_results, &ap_count, &scan_time);
+
+    if (scan_time == 0 || esp_timer_get_time() - scan_time > SCAN_RESULTS_MAX_AGE_US)
+    {
+        return false;
+    }
 
     for (int i = 0; i < ap_count; ++i)
     {
-        wifi_ap_info* ap = &available_aps[i];
+        wifi_ap_info* ap = &s_scan_results[i];
 
         wifi_network_credentials creds = {0};
-        if (wifi_get_saved_network(ap->ssid, &creds) && _try_connect(&creds))
+        if (!wifi_get_saved_network(ap->ssid, &creds) || _is_blocked(ap->ssid))
+        {
+            continue;
+        }
+
+        // The scan already found the access point, so connect to it directly
+        memcpy(creds.bssid, ap->bssid, sizeof(creds.bssid));
+        creds.channel = ap->channel;
+        creds.auth_mode = ap->auth_mode;
+
+        if (_try_connect(&creds))
         {
             return true;
         }
@@ -152,6 +317,178 @@ static bool _try_autoconnect()
     return false;
 }
 
+static void _try_reconnect(bool after_scan)
+{
+    if (!s_should_reconnect || wifi_is_connected())
+    {
+        return;
+    }
+
+    ESP_LOGI(TASK_NAME, "Trying to reconnect to a network...");
+    if (_try_connect_prev() || _try_known_access_points() || _try_scanned_networks())
+    {
+        return;
+    }
+
+    if (after_scan)
+    {
+        // The next retry is already scheduled
+        return;
+    }
+
+    // Results wake us up again, without waiting for the retry
+    wifi_scan_start(false /* quick */);
+
+    ESP_LOGI(TASK_NAME, "Retrying in %d ms", s_retry_delay_ms);
+    xTimerChangePeriod(s_retry_timer, pdMS_TO_TICKS(s_retry_delay_ms), portMAX_DELAY);
+    s_retry_delay_ms = MIN(s_retry_delay_ms * 2, MAX_RETRY_DELAY_MS);
+}
+
+static void _clear_rssi_history()
+{
+    s_network_history.rssi_sample_count = 0;
+    s_network_history.next_rssi_index = 0;
+}
+
+// Average of the oldest or newest samples, or of all of them
+static int _average_rssi(int first, int count)
+{
+    int total = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        // Oldest sample is at next_rssi_index once the buffer is full
+        int index = (s_network_history.next_rssi_index + first + i) % RSSI_HISTORY_SIZE;
+        total += s_network_history.rssi_samples[index];
+    }
+    return total / count;
+}
+
+static void _pick_roam_candidate()
+{
+    s_roam_scan_pending = false;
+
+    wifi_ap_info current = {0};
+    if (!wifi_get_connected_ap(&current))
+    {
+        return;
+    }
+
+    int current_rssi = _average_rssi(0, RSSI_HISTORY_SIZE);
+
+    uint16_t ap_count = WIFI_MAX_SCAN_RESULTS;
+    wifi_get_scan_results(s_scan_results, &ap_count, NULL);
+
+    wifi_ap_info* best_ap = NULL;
+    for (int i = 0; i < ap_count; ++i)
+    {
+        wifi_ap_info* ap = &s_scan_results[i];
+        if (ap->rssi < current_rssi + ROAM_MIN_IMPROVEMENT_DB ||
+            ap->rssi < WIFI_WEAK_RSSI_THRESHOLD ||
+            (best_ap != NULL && ap->rssi <= best_ap->rssi) ||
+            memcmp(ap->bssid, current.bssid, sizeof(ap->bssid)) == 0 ||
+            !wifi_get_saved_network(ap->ssid, &s_roam_candidate) ||
+            _is_blocked(ap->ssid))
+        {
+            continue;
+        }
+
+        best_ap = ap;
+    }
+
+    if (best_ap == NULL || !wifi_get_saved_network(best_ap->ssid, &s_roam_candidate))
+    {
+        return;
+    }
+
+    memcpy(s_roam_candidate.bssid, best_ap->bssid, sizeof(s_roam_candidate.bssid));
+    s_roam_candidate.channel = best_ap->channel;
+    s_roam_candidate.auth_mode = best_ap->auth_mode;
+    s_roam_candidate_time = esp_timer_get_time();
+
+    ESP_LOGI(
+        TASK_NAME,
+        "Will switch from network '%s' (%d dBm) to '%s' (%d dBm) when the link is idle",
+        current.ssid,
+        current_rssi,
+        best_ap->ssid,
+        best_ap->rssi
+    );
+}
+
+static void _roam()
+{
+    ESP_LOGI(TASK_NAME, "Switching to network '%s'...", s_roam_candidate.ssid);
+
+    // Leaving the current network is expected, so don't block it
+    s_is_roaming = true;
+    s_roam_candidate_time = 0;
+    telemetry_count(TELEMETRY_COUNTER_ROAMS);
+
+    if (!wifi_connect_to_ap(&s_roam_candidate, true /* force */))
+    {
+        ESP_LOGW(TASK_NAME, "Failed to switch to network '%s'", s_roam_candidate.ssid);
+        _back_off_network(_ensure_network_info(s_roam_candidate.ssid));
+
+        s_should_reconnect = true;
+        _try_reconnect(false /* after_scan */);
+    }
+}
+
+static void _sample_rssi()
+{
+    wifi_ap_info current = {0};
+    if (!wifi_get_connected_ap(&current))
+    {
+        return;
+    }
+
+    s_network_history.rssi_samples[s_network_history.next_rssi_index] = current.rssi;
+    s_network_history.next_rssi_index = (s_network_history.next_rssi_index + 1) % RSSI_HISTORY_SIZE;
+    if (s_network_history.rssi_sample_count < RSSI_HISTORY_SIZE)
+    {
+        ++s_network_history.rssi_sample_count;
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+
+    if (s_roam_candidate_time != 0)
+    {
+        if (now - s_roam_candidate_time > ROAM_CANDIDATE_MAX_AGE_US)
+        {
+            s_roam_candidate_time = 0;
+        }
+        else if (socket_manager_get_link_idle_ms() >= ROAM_MIN_LINK_IDLE_MS)
+        {
+            _roam();
+        }
+        return;
+    }
+
+    int average = _average_rssi(0, RSSI_HISTORY_SIZE);
+    int trend = _average_rssi(RSSI_HISTORY_SIZE / 2, RSSI_HISTORY_SIZE / 2) -
+                _average_rssi(0, RSSI_HISTORY_SIZE / 2);
+
+    bool is_weak = average < WIFI_WEAK_RSSI_THRESHOLD;
+    bool is_falling = average < WIFI_MED_RSSI_THRESHOLD && trend <= -ROAM_FALLING_RSSI_DB;
+
+    if ((is_weak || is_falling) &&
+        !s_roam_scan_pending &&
+        (s_last_roam_scan_time == 0 || now - s_last_roam_scan_time > ROAM_SCAN_PERIOD_US))
+    {
+        ESP_LOGI(
+            TASK_NAME,
+            "Signal is %s (%d dBm, %+d dB). Looking for a better access point.",
+            is_weak ? "weak" : "falling",
+            average,
+            trend
+        );
+
+        s_last_roam_scan_time = now;
+        s_roam_scan_pending = wifi_scan_start(true /* quick */);
+    }
+}
+
 static void task_network_manager(void* data)
 {
     // Future enhancements, probably overkill:
@@ -162,7 +499,6 @@ static void task_network_manager(void* data)
     //     Technically gbplay will still work with no internet connection if hosted locally
     // * Prefer networks that previously had internet access over ones that didn't
     //     New member of network_info
-    // * Exponential backoff (for blacklisting and time between scans)
 
     while (true)
     {
@@ -174,19 +510,17 @@ static void task_network_manager(void* data)
             portMAX_DELAY
         );
 
-        if (bits & NETWORK_EVENT_DROPPED)
+        if (bits & (NETWORK_EVENT_LEFT | NETWORK_EVENT_DROPPED))
         {
-            // Could have been a false alarm (disconnect + reconnect by us)
-            if (!wifi_is_connected())
-            {
-                ESP_LOGI(TASK_NAME, "Connection dropped");
+            xTimerStop(s_rssi_timer, portMAX_DELAY);
+            s_roam_candidate_time = 0;
+            s_roam_scan_pending = false;
+        }
 
-                // Try to reconnect
-                while (!wifi_is_connected() && !_try_connect_prev() && !_try_autoconnect())
-                {
-                    sleep(IDLE_SCAN_PERIOD_SECONDS);
-                }
-            }
+        if ((bits & NETWORK_EVENT_LEFT) && s_is_roaming)
+        {
+            // Left for a better access point
+            s_is_roaming = false;
         }
         else if (bits & NETWORK_EVENT_LEFT)
         {
@@ -195,12 +529,54 @@ static void task_network_manager(void* data)
             // Deprioritize network the user chose to leave
             network_info* info = _ensure_network_info(s_network_history.prev_ssid);
             _block_network(info);
+
+            s_should_reconnect = false;
+            xTimerStop(s_retry_timer, portMAX_DELAY);
         }
-        else if (bits & NETWORK_EVENT_CONNECTED)
+
+        if (bits & NETWORK_EVENT_CONNECTED)
         {
             ESP_LOGI(TASK_NAME, "Connected to network '%s'", s_network_history.prev_ssid);
+            telemetry_count(TELEMETRY_COUNTER_NETWORK_CONNECTS);
 
             _clear_network_history();
+            _clear_rssi_history();
+
+            s_should_reconnect = false;
+            s_retry_delay_ms = MIN_RETRY_DELAY_MS;
+            xTimerStop(s_retry_timer, portMAX_DELAY);
+            xTimerStart(s_rssi_timer, portMAX_DELAY);
+        }
+
+        if (bits & RSSI_SAMPLE_BIT)
+        {
+            _sample_rssi();
+        }
+
+        if ((bits & NETWORK_EVENT_SCAN_DONE) && s_roam_scan_pending && wifi_is_connected())
+        {
+            _pick_roam_candidate();
+        }
+
+        if (bits & NETWORK_EVENT_DROPPED)
+        {
+            // Could have been a false alarm (disconnect + reconnect by us)
+            if (!wifi_is_connected())
+            {
+                ESP_LOGI(TASK_NAME, "Connection dropped");
+                telemetry_count(TELEMETRY_COUNTER_NETWORK_DROPS);
+
+                s_should_reconnect = true;
+                _try_reconnect(false /* after_scan */);
+            }
+        }
+        else if (bits & RETRY_BIT)
+        {
+            _try_reconnect(false /* after_scan */);
+        }
+        else if (bits & NETWORK_EVENT_SCAN_DONE)
+        {
+            _try_reconnect(true /* after_scan */);
         }
     }
 }
@@ -208,6 +584,20 @@ static void task_network_manager(void* data)
 void task_network_manager_start(int core, int priority)
 {
     s_connection_event_group = xEventGroupCreate();
+    s_retry_timer = xTimerCreate(
+        "network-retry",
+        pdMS_TO_TICKS(MIN_RETRY_DELAY_MS),
+        pdFALSE,  // uxAutoReload
+        NULL,     // pvTimerID
+        &_on_retry_timer
+    );
+    s_rssi_timer = xTimerCreate(
+        "network-rssi",
+        pdMS_TO_TICKS(RSSI_SAMPLE_PERIOD_MS),
+        pdTRUE,   // uxAutoReload
+        NULL,     // pvTimerID
+        &_on_rssi_timer
+    );
 
     ESP_ERROR_CHECK(esp_event_handler_instance_register(
         NETWORK_EVENT, NETWORK_EVENT_DROPPED, &_on_disconnect, NULL, NULL
@@ -218,6 +608,9 @@ void task_network_manager_start(int core, int priority)
     ESP_ERROR_CHECK(esp_event_handler_instance_register(
         NETWORK_EVENT, NETWORK_EVENT_CONNECTED, &_on_connect, NULL, NULL
     ));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(
+        NETWORK_EVENT, NETWORK_EVENT_SCAN_DONE, &_on_scan_done, NULL, NULL
+    ));
 
     xTaskCreatePinnedToCore(
         &task_network_manager,
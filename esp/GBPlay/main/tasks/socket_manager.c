@@ -4,13 +4,34 @@
 
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
+#ifdef CONFIG_IDF_TARGET_LINUX
+// Host eventfds can always be written from the simulated link thread
+#define EFD_SUPPORT_ISR 0
+#else
+#include <esp_vfs_eventfd.h>
+#endif
+
+#include "../hardware/power.h"
 #include "../hardware/spi.h"
 #include "../hardware/storage.h"
 #include "../hardware/wifi.h"
+#include "latency.h"
+#include "link_manager.h"
+#include "protocol.h"
 #include "socket.h"
+#include "socket_manager.h"
+#include "telemetry.h"
 
 #define TASK_NAME "socket-manager"
 
@@ -18,32 +39,156 @@
 
 #define SERVER_HOST_STORAGE_KEY "server_host"
 #define SERVER_PORT_STORAGE_KEY "server_port"
+#define LINK_TIMEOUT_STORAGE_KEY "link_timeout_ms"
+#define SERVER_ADDRESS_STORAGE_KEY "server_addr"
+#define SERVER_TRANSPORT_STORAGE_KEY "server_transport"
+#define GAME_STORAGE_KEY "game"
+#define JOIN_CODE_STORAGE_KEY "join_code"
+
+// Value of the transport setting which selects UDP instead of TCP
+#define SERVER_TRANSPORT_UDP "udp"
 
 #define DEFAULT_SERVER_HOST "192.168.0.115"
 #define DEFAULT_SERVER_PORT 1989
 
+// Longest possible DNS name
+#define SERVER_HOST_MAX_LENGTH 253
+
+// Maximum number of addresses tried when looking up the server
+#define MAX_SERVER_ADDRESSES 4
+
+// A cached address is given less time to connect, so a stale one doesn't
+// hold up looking up the server again
+#define CACHED_CONNECTION_TIMEOUT_MS 2000
+
+// Cached server addresses are looked up again after this long, even if
+// they still work
+#define SERVER_ADDRESS_TTL_S (24 * 60 * 60)
+
+// Link requests are passed to the link in pieces of this size
+#define LINK_REQUEST_CHUNK_SIZE 64
+
+// The connection is considered dead if the server is silent for this long
+#define DEFAULT_LINK_TIMEOUT_MS 300
+#define MIN_LINK_TIMEOUT_MS     50
+
+// Number of heartbeats sent per timeout period while idle
+#define HEARTBEATS_PER_TIMEOUT 3
+
+// Without link traffic for this long, the session is considered inactive and
+// the device is allowed to sleep
+#define POWER_SAVE_IDLE_MS 10000
+
+// While sleeping, packets from the server can take up to a beacon listen
+// interval to arrive, so the server is given longer to answer
+#define POWER_SAVE_LINK_TIMEOUT_MS 3000
+
+// Reports are at least this far apart, whatever the server asks for
+#define MIN_TELEMETRY_INTERVAL_S 5
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef struct {
+    char host[SERVER_HOST_MAX_LENGTH + 1];
+    uint16_t port;
+    struct sockaddr_in address;
+    int64_t resolved_at;  // Seconds since the epoch, from time()
+} server_address_cache;
+
 static TaskHandle_t s_socket_manager_task;
 
+// Server settings and the last address that worked for them, so reconnecting
+// after a network blip doesn't need storage or DNS. Settings are read from
+// storage again whenever the cached address stops working.
+static server_address_cache s_server;
+static bool s_server_config_loaded = false;
+static bool s_server_address_valid = false;
+
+// Whether to reach the server over UDP instead of TCP
+static bool s_use_datagrams = false;
+
+// Signalled from interrupt context when the Game Boy sends us a byte
+static int s_link_event_fd = -1;
+
+// Also used as the deadline for reading or writing a message
+static int s_link_timeout_ms = DEFAULT_LINK_TIMEOUT_MS;
+
+// For measuring how long the server takes to send the next request
+static int64_t s_last_response_sent = 0;
+
+// When the link was last used, in milliseconds. Read by other tasks.
+static atomic_uint s_last_link_activity_ms = 0;
+
+// Set by the server for each connection. 0 when it doesn't want reports.
+static int64_t s_telemetry_interval_us = 0;
+static int64_t s_next_telemetry_time = 0;
+
+// Too big for the task stack
+static protocol_message s_rx_msg;
+static protocol_message s_tx_msg;
+
+static void _on_link_receive(void* arg)
+{
+    uint64_t count = 1;
+    write(s_link_event_fd, &count, sizeof(count));
+}
+
 static void _on_network_connect(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
     // Wake up the task
     xTaskNotify(s_socket_manager_task, 0, eNoAction);
 }
 
-static int _connect_to_server()
+static uint32_t _get_time_ms()
 {
-    bool should_free_host = true;
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+static void _mark_link_activity()
+{
+    atomic_store(&s_last_link_activity_ms, _get_time_ms());
+}
+
+// Longest setting stored as a number or keyword
+#define MAX_SETTING_LENGTH 16
+
+static void _load_link_timeout()
+{
+    s_link_timeout_ms = DEFAULT_LINK_TIMEOUT_MS;
+
+    char timeout_str[MAX_SETTING_LENGTH] = {0};
+    if (storage_read_string(LINK_TIMEOUT_STORAGE_KEY, timeout_str, sizeof(timeout_str)))
+    {
+        long ret = strtol(timeout_str, NULL, 10 /* base */);
+        if (ret < MIN_LINK_TIMEOUT_MS || errno == ERANGE || ret > INT32_MAX / 1000)
+        {
+            ESP_LOGW(
+                TASK_NAME,
+                "Configured link timeout %s is invalid. Using default of %d ms.",
+                timeout_str,
+                s_link_timeout_ms
+            );
+        }
+        else
+        {
+            s_link_timeout_ms = ret;
+        }
+    }
+}
 
-    char* server_host = storage_get_string(SERVER_HOST_STORAGE_KEY);
-    if (server_host == NULL)
+static void _load_server_config()
+{
+    // Storage keeps settings in memory, so this doesn't touch flash after the
+    // first time and doesn't allocate
+    if (!storage_read_string(SERVER_HOST_STORAGE_KEY, s_server.host, sizeof(s_server.host)))
     {
-        server_host = DEFAULT_SERVER_HOST;
-        should_free_host = false;
+        strcpy(s_server.host, DEFAULT_SERVER_HOST);
     }
 
-    uint16_t server_port = DEFAULT_SERVER_PORT;
-    char* server_port_str = storage_get_string(SERVER_PORT_STORAGE_KEY);
-    if (server_port_str != NULL)
+    s_server.port = DEFAULT_SERVER_PORT;
+    char server_port_str[MAX_SETTING_LENGTH] = {0};
+    if (storage_read_string(SERVER_PORT_STORAGE_KEY, server_port_str, sizeof(server_port_str)))
     {
         long ret = strtol(server_port_str, NULL, 10 /* base */);
         if (ret == 0 || errno == ERANGE || ret > UINT16_MAX)
@@ -52,51 +197,603 @@ static int _connect_to_server()
                 TASK_NAME,
                 "Configured server port %s is invalid. Using default port of %d.",
                 server_port_str,
-                server_port
+                s_server.port
             );
         }
         else
         {
-            server_port = ret;
+            s_server.port = ret;
+        }
+    }
+
+    char transport[MAX_SETTING_LENGTH] = {0};
+    s_use_datagrams = storage_read_string(SERVER_TRANSPORT_STORAGE_KEY, transport, sizeof(transport)) &&
+                      strcmp(transport, SERVER_TRANSPORT_UDP) == 0;
+
+    // Only use the saved address if it was looked up for the current settings
+    s_server_address_valid = false;
+
+    server_address_cache saved = {0};
+    if (storage_read_blob(SERVER_ADDRESS_STORAGE_KEY, &saved, sizeof(saved)) &&
+        strcmp(saved.host, s_server.host) == 0 &&
+        saved.port == s_server.port)
+    {
+        s_server.address = saved.address;
+        s_server.resolved_at = saved.resolved_at;
+        s_server_address_valid = true;
+    }
+
+    _load_link_timeout();
+    s_server_config_loaded = true;
+}
+
+static bool _is_server_address_expired()
+{
+    // Without a synchronized clock, time can go backwards across restarts.
+    // Give the address the benefit of the doubt, since a failed connection
+    // causes another lookup anyway.
+    int64_t now = time(NULL);
+    return now >= s_server.resolved_at && now - s_server.resolved_at > SERVER_ADDRESS_TTL_S;
+}
+
+static void _cache_server_address(const struct sockaddr_in* address)
+{
+    int64_t now = time(NULL);
+
+    // The lookup time changes every time, so only refresh the saved copy when
+    // the address changed or the saved time is getting old. Otherwise lookups
+    // while the server is down would write to flash on every attempt.
+    server_address_cache saved = {0};
+    bool save = !storage_read_blob(SERVER_ADDRESS_STORAGE_KEY, &saved, sizeof(saved)) ||
+                strcmp(saved.host, s_server.host) != 0 ||
+                saved.port != s_server.port ||
+                saved.address.sin_addr.s_addr != address->sin_addr.s_addr ||
+                saved.address.sin_port != address->sin_port ||
+                now < saved.resolved_at ||
+                now - saved.resolved_at > SERVER_ADDRESS_TTL_S / 2;
+
+    s_server.address = *address;
+    s_server.resolved_at = now;
+    s_server_address_valid = true;
+
+    if (save)
+    {
+        storage_set_blob(SERVER_ADDRESS_STORAGE_KEY, &s_server, sizeof(s_server));
+    }
+}
+
+static int _open_socket(const struct sockaddr_in* address, int timeout_ms)
+{
+    return s_use_datagrams ? socket_connect_datagram(address, timeout_ms)
+                           : socket_connect_address(address, timeout_ms);
+}
+
+static int _resolve_and_connect()
+{
+    ESP_LOGI(TASK_NAME, "Looking up backend server at %s:%d", s_server.host, s_server.port);
+
+    struct sockaddr_in addresses[MAX_SERVER_ADDRESSES];
+    size_t address_count = socket_resolve(s_server.host, s_server.port, addresses, MAX_SERVER_ADDRESSES);
+
+    for (size_t i = 0; i < address_count; ++i)
+    {
+        int sock = _open_socket(&addresses[i], CONNECTION_TIMEOUT_MS);
+        if (sock >= 0)
+        {
+            _cache_server_address(&addresses[i]);
+            return sock;
         }
+    }
+
+    return -1;
+}
 
-        free(server_port_str);
+static int _connect_to_server()
+{
+    if (!s_server_config_loaded)
+    {
+        _load_server_config();
     }
 
-    ESP_LOGI(TASK_NAME, "Connecting to backend server at %s:%d", server_host, server_port);
+    bool tried_cached_address = false;
+    if (s_server_address_valid && !_is_server_address_expired())
+    {
+        ESP_LOGI(
+            TASK_NAME,
+            "Connecting to backend server at %s:%d over %s using cached address",
+            s_server.host,
+            s_server.port,
+            s_use_datagrams ? "UDP" : "TCP"
+        );
 
-    int sock = socket_connect(server_host, server_port, CONNECTION_TIMEOUT_MS);
+        int sock = _open_socket(&s_server.address, CACHED_CONNECTION_TIMEOUT_MS);
+        if (sock >= 0)
+        {
+            return sock;
+        }
 
-    if (should_free_host)
+        ESP_LOGW(TASK_NAME, "Cached server address failed. Reloading server settings.");
+        tried_cached_address = true;
+
+        // The settings may have changed since the address was cached
+        _load_server_config();
+    }
+
+    int sock = _resolve_and_connect();
+    if (sock < 0 && s_server_address_valid && !tried_cached_address)
     {
-        free(server_host);
+        // An expired address is better than nothing when the lookup fails
+        ESP_LOGW(TASK_NAME, "Falling back to expired server address");
+        sock = _open_socket(&s_server.address, CACHED_CONNECTION_TIMEOUT_MS);
     }
 
     return sock;
 }
 
-static void _handle_data_until_error(int sock)
+static void _append_string(protocol_message* message, const char* value)
+{
+    size_t length = strlen(value);
+
+    message->payload[message->length++] = (uint8_t)length;
+    memcpy(&message->payload[message->length], value, length);
+    message->length += length;
+}
+
+static void _load_join_code(char* out_code)
+{
+    char code[MAX_SETTING_LENGTH] = {0};
+    if (!storage_read_string(JOIN_CODE_STORAGE_KEY, code, sizeof(code)))
+    {
+        return;
+    }
+
+    bool valid = strlen(code) == PROTOCOL_JOIN_CODE_LENGTH;
+    for (int i = 0; valid && i < PROTOCOL_JOIN_CODE_LENGTH; ++i)
+    {
+        valid = isalpha((unsigned char)code[i]);
+    }
+
+    if (valid)
+    {
+        strcpy(out_code, code);
+    }
+    else
+    {
+        ESP_LOGW(
+            TASK_NAME,
+            "Configured join code %s is invalid. It must be %d letters. Joining a public session.",
+            code,
+            PROTOCOL_JOIN_CODE_LENGTH
+        );
+    }
+}
+
+static bool _send_hello(int sock)
+{
+    message_hello hello = {
+        .version = PROTOCOL_VERSION,
+        .capabilities = DEVICE_CAPABILITY_TIMED_EXCHANGE |
+                        DEVICE_CAPABILITY_EXTERNAL_CLOCK |
+                        DEVICE_CAPABILITY_LOCAL_RESPONDER |
+                        DEVICE_CAPABILITY_CLOCK_SPEED |
+                        DEVICE_CAPABILITY_LATENCY_STATS |
+                        DEVICE_CAPABILITY_TELEMETRY
+    };
+
+    s_tx_msg.type = MESSAGE_TYPE_HELLO;
+    s_tx_msg.length = sizeof(hello);
+    memcpy(s_tx_msg.payload, &hello, sizeof(hello));
+
+    // Empty strings let the server choose the game or find a session
+    char game[PROTOCOL_MAX_GAME_LENGTH + 1] = {0};
+    char join_code[PROTOCOL_JOIN_CODE_LENGTH + 1] = {0};
+    storage_read_string(GAME_STORAGE_KEY, game, sizeof(game));
+    _load_join_code(join_code);
+
+    _append_string(&s_tx_msg, game);
+    _append_string(&s_tx_msg, join_code);
+
+    return protocol_write_message(sock, &s_tx_msg, s_link_timeout_ms);
+}
+
+static bool _send_heartbeat(int sock)
+{
+    s_tx_msg.type = MESSAGE_TYPE_HEARTBEAT;
+    s_tx_msg.length = 0;
+
+    return protocol_write_message(sock, &s_tx_msg, s_link_timeout_ms);
+}
+
+static void _record_batch_timing(const link_batch_timing* timing)
+{
+    latency_record(LATENCY_STAGE_RECEIVE, timing->request_end - timing->request_start);
+    latency_record(LATENCY_STAGE_SEND, timing->response_sent - timing->link_end);
+
+    if (timing->byte_count > 0)
+    {
+        int64_t link_time = timing->link_end - timing->link_start;
+
+        latency_record(LATENCY_STAGE_LINK_WAIT, timing->link_start - timing->request_start);
+        latency_record(LATENCY_STAGE_LINK, link_time);
+        latency_record(LATENCY_STAGE_LINK_PER_BYTE, link_time / timing->byte_count);
+    }
+
+    // Longer gaps mean the game was idle, not that the server was slow
+    int64_t server_time = timing->request_start - s_last_response_sent;
+    if (s_last_response_sent != 0 && server_time < (int64_t)s_link_timeout_ms * 1000)
+    {
+        latency_record(LATENCY_STAGE_SERVER, server_time);
+    }
+    s_last_response_sent = timing->response_sent;
+
+    // Positive overlap means the link started before the request was fully received
+    ESP_LOGD(
+        TASK_NAME,
+        "Batch timing (us): receive %" PRId64 ", link %" PRId64 ", overlap %" PRId64 ", respond %" PRId64,
+        timing->request_end - timing->request_start,
+        timing->link_end - timing->link_start,
+        timing->request_end - timing->link_start,
+        timing->response_sent - timing->link_end
+    );
+}
+
+static bool _handle_get_latency(int sock, const protocol_message* msg)
+{
+    bool reset = msg->length >= sizeof(message_get_latency) &&
+                 (((const message_get_latency*)msg->payload)->flags & LATENCY_FLAG_RESET);
+
+    message_latency* response = (message_latency*)s_tx_msg.payload;
+    response->stage_count = LATENCY_STAGE_COUNT;
+
+    for (int i = 0; i < LATENCY_STAGE_COUNT; ++i)
+    {
+        latency_stats stats = {0};
+        latency_get_stats(i, &stats);
+
+        response->stages[i] = (message_latency_stage){
+            .count = stats.count,
+            .p50_us = stats.p50_us,
+            .p95_us = stats.p95_us,
+            .p99_us = stats.p99_us,
+            .max_us = stats.max_us
+        };
+    }
+
+    if (reset)
+    {
+        latency_reset();
+    }
+
+    s_tx_msg.type = MESSAGE_TYPE_GET_LATENCY;
+    s_tx_msg.length = sizeof(message_latency) + (LATENCY_STAGE_COUNT * sizeof(message_latency_stage));
+
+    return protocol_write_message(sock, &s_tx_msg, s_link_timeout_ms);
+}
+
+static bool _handle_set_telemetry(const protocol_message* msg)
+{
+    if (msg->length < sizeof(message_set_telemetry))
+    {
+        ESP_LOGE(TASK_NAME, "Telemetry message is too short (%d bytes)", msg->length);
+        return false;
+    }
+
+    int interval_s = ((const message_set_telemetry*)msg->payload)->interval_s;
+    if (interval_s == 0)
+    {
+        s_telemetry_interval_us = 0;
+        return true;
+    }
+
+    s_telemetry_interval_us = (int64_t)MAX(interval_s, MIN_TELEMETRY_INTERVAL_S) * 1000 * 1000;
+
+    // The first report gives the server something to compare later ones with
+    s_next_telemetry_time = esp_timer_get_time();
+    return true;
+}
+
+static bool _send_telemetry(int sock)
+{
+    s_tx_msg.type = MESSAGE_TYPE_TELEMETRY;
+    s_tx_msg.length = telemetry_build_report(s_tx_msg.payload, sizeof(s_tx_msg.payload));
+
+    return protocol_write_message(sock, &s_tx_msg, s_link_timeout_ms);
+}
+
+static bool _handle_link_request(int sock, const protocol_message* msg)
+{
+    link_batch_type type = LINK_BATCH_EXCHANGE;
+    size_t min_length = sizeof(message_exchange);
+
+    if (msg->type == MESSAGE_TYPE_RUN_RESPONDER)
+    {
+        type = LINK_BATCH_RESPONDER;
+        min_length = sizeof(message_responder);
+    }
+
+    if (msg->length < min_length)
+    {
+        ESP_LOGE(TASK_NAME, "Message of type 0x%02X is too short (%d bytes)", msg->type, msg->length);
+        return false;
+    }
+
+    if (spi_get_role() != SPI_ROLE_MASTER)
+    {
+        ESP_LOGE(TASK_NAME, "Cannot drive the link while the Game Boy drives the clock");
+        return false;
+    }
+
+    _mark_link_activity();
+    link_begin_batch(type, msg->length);
+
+    // Hand the request to the link as it arrives so that the first bytes can
+    // be exchanged while the rest are still in flight
+    uint16_t remaining = msg->length;
+    while (remaining > 0)
+    {
+        uint8_t chunk[LINK_REQUEST_CHUNK_SIZE];
+        size_t chunk_len = MIN(remaining, sizeof(chunk));
+
+        if (!socket_read(sock, chunk, chunk_len, s_link_timeout_ms))
+        {
+            link_cancel_batch();
+            return false;
+        }
+
+        link_submit(chunk, chunk_len);
+        remaining -= chunk_len;
+    }
+
+    link_batch_timing timing = {0};
+
+    s_tx_msg.type = msg->type;
+    s_tx_msg.length = link_finish_batch(s_tx_msg.payload, sizeof(s_tx_msg.payload), &timing);
+
+    bool success = protocol_write_message(sock, &s_tx_msg, s_link_timeout_ms);
+
+    _mark_link_activity();
+    timing.response_sent = esp_timer_get_time();
+    _record_batch_timing(&timing);
+
+    return success;
+}
+
+static bool _handle_set_clock_source(const protocol_message* msg)
+{
+    if (msg->length < sizeof(message_set_clock_source))
+    {
+        ESP_LOGE(TASK_NAME, "Clock source message is too short (%d bytes)", msg->length);
+        return false;
+    }
+
+    const message_set_clock_source* config = (const message_set_clock_source*)msg->payload;
+    bool external = (config->source == CLOCK_SOURCE_GAME_BOY);
+
+    ESP_LOGI(TASK_NAME, "Game Boy will use %s clock", external ? "its internal" : "an external");
+
+    spi_slave_set_idle_byte(config->idle_byte);
+    return spi_set_role(external ? SPI_ROLE_SLAVE : SPI_ROLE_MASTER);
+}
+
+static bool _handle_set_clock_speed(const protocol_message* msg)
+{
+    if (msg->length < sizeof(message_set_clock_speed))
+    {
+        ESP_LOGE(TASK_NAME, "Clock speed message is too short (%d bytes)", msg->length);
+        return false;
+    }
+
+    const message_set_clock_speed* config = (const message_set_clock_speed*)msg->payload;
+    if (config->speed >= SPI_CLOCK_SPEED_COUNT)
+    {
+        ESP_LOGE(TASK_NAME, "Unknown clock speed %d", config->speed);
+        return false;
+    }
+
+    spi_clock_speed speed = (spi_clock_speed)config->speed;
+    ESP_LOGI(TASK_NAME, "Link clock set to %" PRIu32 " Hz", spi_get_clock_speed_hz(speed));
+
+    return spi_set_clock_speed(speed);
+}
+
+static bool _handle_queue_responses(const protocol_message* msg)
+{
+    if (spi_get_role() != SPI_ROLE_SLAVE)
+    {
+        ESP_LOGE(TASK_NAME, "Cannot queue responses while we drive the clock");
+        return false;
+    }
+
+    _mark_link_activity();
+
+    size_t queued = spi_slave_queue_tx(msg->payload, msg->length);
+    if (queued < msg->length)
+    {
+        ESP_LOGW(TASK_NAME, "Response queue full. Dropped %d bytes.", (int)(msg->length - queued));
+    }
+
+    return true;
+}
+
+static bool _forward_received_bytes(int sock)
+{
+    uint64_t count = 0;
+    read(s_link_event_fd, &count, sizeof(count));
+
+    _mark_link_activity();
+
+    s_tx_msg.type = MESSAGE_TYPE_RECEIVED;
+    while ((s_tx_msg.length = spi_slave_read_rx(s_tx_msg.payload, sizeof(s_tx_msg.payload))) > 0)
+    {
+        if (!protocol_write_message(sock, &s_tx_msg, s_link_timeout_ms))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool _handle_next_message(int sock)
 {
-    // TODO: abstract this to use a generic client, rather than socket
-    //  Will making it easier to handle different types of packets
+    if (!protocol_read_header(sock, &s_rx_msg, s_link_timeout_ms))
+    {
+        return false;
+    }
+
+    if (s_rx_msg.type == MESSAGE_TYPE_EXCHANGE || s_rx_msg.type == MESSAGE_TYPE_RUN_RESPONDER)
+    {
+        // Payload is streamed straight to the link
+        return _handle_link_request(sock, &s_rx_msg);
+    }
+
+    if (!protocol_read_payload(sock, &s_rx_msg, s_link_timeout_ms))
+    {
+        return false;
+    }
+
+    switch (s_rx_msg.type)
+    {
+        case MESSAGE_TYPE_SET_CLOCK_SOURCE:
+            return _handle_set_clock_source(&s_rx_msg);
+        case MESSAGE_TYPE_SET_CLOCK_SPEED:
+            return _handle_set_clock_speed(&s_rx_msg);
+        case MESSAGE_TYPE_QUEUE_RESPONSES:
+            return _handle_queue_responses(&s_rx_msg);
+        case MESSAGE_TYPE_GET_LATENCY:
+            return _handle_get_latency(sock, &s_rx_msg);
+        case MESSAGE_TYPE_TELEMETRY:
+            return _handle_set_telemetry(&s_rx_msg);
+        case MESSAGE_TYPE_HEARTBEAT:
+            // Only here to show the server is still there
+            return true;
+        default:
+            ESP_LOGW(TASK_NAME, "Ignoring unknown message type 0x%02X", s_rx_msg.type);
+            return true;
+    }
+}
+
+static void _handle_messages_until_error(int sock)
+{
+    if (!_send_hello(sock))
+    {
+        return;
+    }
+
+    s_last_response_sent = 0;
+    s_telemetry_interval_us = 0;
+
+    // Handling a message counts as hearing from the server, even if it
+    // kept us busy for longer than the timeout
+    int64_t last_rx_time = esp_timer_get_time();
+    int64_t last_heartbeat_time = last_rx_time;
+
+    // Stay awake at first, since the server is about to start a session
+    int64_t connected_time = last_rx_time;
+    bool is_power_saving = false;
+    power_set_session_active(true);
+
     while (true)
     {
-        uint8_t rx = 0;
-        if (!socket_read(sock, &rx, sizeof(rx)))
+        int64_t now = esp_timer_get_time();
+
+        bool is_idle = (now - connected_time) >= (int64_t)POWER_SAVE_IDLE_MS * 1000 &&
+                       socket_manager_get_link_idle_ms() >= POWER_SAVE_IDLE_MS;
+        if (is_idle != is_power_saving)
+        {
+            is_power_saving = is_idle;
+            power_set_session_active(!is_power_saving);
+
+            // The server had longer to answer while we were sleeping, so
+            // start the timeout over at the new pace
+            last_rx_time = now;
+        }
+
+        if (is_power_saving)
+        {
+            // Disarmed by any clock edge, even one that didn't make a byte
+            spi_arm_link_wakeup();
+        }
+
+        int64_t timeout_us = (int64_t)s_link_timeout_ms * 1000;
+        if (is_power_saving)
         {
+            timeout_us = MAX(timeout_us, (int64_t)POWER_SAVE_LINK_TIMEOUT_MS * 1000);
+        }
+        int64_t heartbeat_interval_us = timeout_us / HEARTBEATS_PER_TIMEOUT;
+
+        if (now - last_rx_time >= timeout_us)
+        {
+            ESP_LOGW(
+                TASK_NAME,
+                "Nothing received from server for %" PRId64 " ms. Assuming the connection is dead.",
+                (now - last_rx_time) / 1000
+            );
             break;
         }
 
-        uint8_t tx = spi_exchange_byte(rx);
-        if (!socket_write(sock, &tx, sizeof(tx)))
+        int64_t next_heartbeat_time = MAX(last_rx_time, last_heartbeat_time) + heartbeat_interval_us;
+        if (now >= next_heartbeat_time)
+        {
+            if (!_send_heartbeat(sock))
+            {
+                break;
+            }
+
+            last_heartbeat_time = now;
+            next_heartbeat_time = now + heartbeat_interval_us;
+        }
+
+        if (s_telemetry_interval_us > 0 && now >= s_next_telemetry_time)
+        {
+            if (!_send_telemetry(sock))
+            {
+                break;
+            }
+
+            s_next_telemetry_time = now + s_telemetry_interval_us;
+        }
+
+        int64_t wake_time = MIN(next_heartbeat_time, last_rx_time + timeout_us);
+        if (s_telemetry_interval_us > 0)
+        {
+            wake_time = MIN(wake_time, s_next_telemetry_time);
+        }
+        int poll_timeout_ms = (wake_time - now + 999) / 1000;
+
+        int ready = socket_poll(sock, s_link_event_fd, poll_timeout_ms);
+        if (ready < 0)
         {
             break;
         }
+
+        if ((ready & SOCKET_POLL_OTHER) && !_forward_received_bytes(sock))
+        {
+            break;
+        }
+
+        if (ready & SOCKET_POLL_READABLE)
+        {
+            if (!_handle_next_message(sock))
+            {
+                break;
+            }
+            last_rx_time = esp_timer_get_time();
+        }
     }
+
+    // Each session starts with us driving the clock at the original speed
+    spi_set_role(SPI_ROLE_MASTER);
+    spi_set_clock_speed(SPI_CLOCK_SPEED_NORMAL);
+
+    power_set_session_active(false);
 }
 
 static void task_socket_manager(void *data)
 {
+    // For measuring how long reconnecting takes
+    int64_t connection_lost_time = 0;
+
     while (true)
     {
         if (!wifi_is_connected())
@@ -123,17 +820,38 @@ static void task_socket_manager(void *data)
         else
         {
             ESP_LOGI(TASK_NAME, "Successfully connected to backend server");
+            telemetry_count(TELEMETRY_COUNTER_SERVER_CONNECTS);
+
+            if (connection_lost_time != 0)
+            {
+                ESP_LOGI(
+                    TASK_NAME,
+                    "Reconnected %" PRId64 " ms after losing the connection",
+                    (esp_timer_get_time() - connection_lost_time) / 1000
+                );
+            }
 
-            _handle_data_until_error(sock);
+            _handle_messages_until_error(sock);
 
             ESP_LOGI(TASK_NAME, "Closing socket");
-            close(sock);
+            socket_close(sock);
+
+            connection_lost_time = esp_timer_get_time();
         }
     }
 }
 
 void task_socket_manager_start(int core, int priority)
 {
+#ifndef CONFIG_IDF_TARGET_LINUX
+    esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_vfs_eventfd_register(&eventfd_config));
+#endif
+
+    s_link_event_fd = eventfd(0, EFD_SUPPORT_ISR);
+    assert(s_link_event_fd >= 0);
+    spi_slave_set_rx_callback(&_on_link_receive, NULL);
+
     ESP_ERROR_CHECK(esp_event_handler_instance_register(
         NETWORK_EVENT, NETWORK_EVENT_CONNECTED, &_on_network_connect, NULL, NULL
     ));
@@ -148,3 +866,9 @@ void task_socket_manager_start(int core, int priority)
         core                    // CPU core ID
     );
 }
+
+uint32_t socket_manager_get_link_idle_ms()
+{
+    // Unsigned subtraction copes with the millisecond counter wrapping
+    return _get_time_ms() - atomic_load(&s_last_link_activity_ms);
+}
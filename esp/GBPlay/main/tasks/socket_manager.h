@@ -1,9 +1,20 @@
 #ifndef _SOCKET_MANAGER_H
 #define _SOCKET_MANAGER_H
 
+#include <stdint.h>
+
 /*
     Maintains a socket connection to the backend server.
 */
 void task_socket_manager_start(int core, int priority);
 
+/*
+    Reports how long the Game Boy has gone without exchanging data through
+    the server. Briefly losing the network is least disruptive when this is
+    high, e.g., between game sessions.
+
+    @returns Milliseconds since the link was last used
+*/
+uint32_t socket_manager_get_link_idle_ms();
+
 #endif
@@ -1,24 +1,37 @@
-#include <unistd.h>
-
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
+#include <esp_event.h>
+
 #include "../hardware/led.h"
 #include "../hardware/wifi.h"
 
 #define TASK_NAME "status-indicator"
 
+#define BLINK_INTERVAL_MS 1000
+
+static TaskHandle_t s_status_indicator_task;
+
+static void _on_network_change(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+    xTaskNotifyGive(s_status_indicator_task);
+}
+
 static void task_status_indicator(void* data)
 {
     bool led_on = false;
 
     while (true)
     {
+        bool is_connected = wifi_is_connected();
+
         // Blink if not connected to wifi, otherwise solid
-        led_on = wifi_is_connected() || !led_on;
+        led_on = is_connected || !led_on;
         led_set_state(led_on);
 
-        sleep(1);
+        // Only blinking needs waking up on a schedule, so the device can sleep
+        // undisturbed while connected
+        ulTaskNotifyTake(pdTRUE, is_connected ? portMAX_DELAY : pdMS_TO_TICKS(BLINK_INTERVAL_MS));
     }
 }
 
@@ -30,7 +43,17 @@ void task_status_indicator_start(int core, int priority)
         configMINIMAL_STACK_SIZE,  // Stack size
         NULL,                      // Arguments
         priority,                  // Priority
-        NULL,                      // Task handle (output parameter)
+        &s_status_indicator_task,  // Task handle (output parameter)
         core                       // CPU core ID
     );
+
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(
+        NETWORK_EVENT, NETWORK_EVENT_CONNECTED, &_on_network_change, NULL, NULL
+    ));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(
+        NETWORK_EVENT, NETWORK_EVENT_DROPPED, &_on_network_change, NULL, NULL
+    ));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(
+        NETWORK_EVENT, NETWORK_EVENT_LEFT, &_on_network_change, NULL, NULL
+    ));
 }
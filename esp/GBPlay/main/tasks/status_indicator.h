@@ -4,7 +4,8 @@
 /*
     Updates the status LED based on device state.
 
-    Solid if connected to Wi-Fi, otherwise blinking.
+    Solid if connected to Wi-Fi, otherwise blinking. Only wakes up when the
+    connection changes, or to blink.
 */
 void task_status_indicator_start(int core, int priority);
 
@@ -0,0 +1,203 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_timer.h>
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+#include <esp_heap_caps.h>
+#endif
+
+#include "hardware/wifi.h"
+#include "latency.h"
+#include "protocol.h"
+#include "telemetry.h"
+
+// Tasks beyond this are left out of CPU use entirely
+#define MAX_TRACKED_TASKS 32
+
+// Only the busiest tasks are reported, to keep reports small
+#define MAX_REPORTED_TASKS 6
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static atomic_uint s_counters[TELEMETRY_COUNTER_COUNT];
+
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+typedef struct {
+    TaskHandle_t handle;
+    configRUN_TIME_COUNTER_TYPE run_time;
+} task_run_time;
+
+// Only touched by the task building reports
+static TaskStatus_t s_tasks[MAX_TRACKED_TASKS];
+static configRUN_TIME_COUNTER_TYPE s_task_deltas[MAX_TRACKED_TASKS];
+static task_run_time s_prev_run_times[MAX_TRACKED_TASKS];
+static task_run_time s_run_times[MAX_TRACKED_TASKS];
+static int s_prev_task_count = 0;
+static configRUN_TIME_COUNTER_TYPE s_prev_total_run_time = 0;
+
+static configRUN_TIME_COUNTER_TYPE _get_prev_run_time(TaskHandle_t handle)
+{
+    for (int i = 0; i < s_prev_task_count; ++i)
+    {
+        if (s_prev_run_times[i].handle == handle)
+        {
+            return s_prev_run_times[i].run_time;
+        }
+    }
+
+    // Started since the previous report
+    return 0;
+}
+
+static bool _is_idle_task(const TaskStatus_t* task)
+{
+    return strncmp(task->pcTaskName, "IDLE", 4) == 0;
+}
+
+// Measures CPU use since the previous call and adds the busiest tasks to the
+// report. Returns the number of bytes added.
+static size_t _add_tasks(message_telemetry* report, uint8_t* out, size_t max_length)
+{
+    configRUN_TIME_COUNTER_TYPE total_run_time = 0;
+    UBaseType_t task_count = uxTaskGetSystemState(s_tasks, MAX_TRACKED_TASKS, &total_run_time);
+
+    // Counters wrap, but unsigned subtraction still gives the right difference
+    configRUN_TIME_COUNTER_TYPE elapsed = total_run_time - s_prev_total_run_time;
+    configRUN_TIME_COUNTER_TYPE idle = 0;
+
+    for (int i = 0; i < task_count; ++i)
+    {
+        s_task_deltas[i] = s_tasks[i].ulRunTimeCounter - _get_prev_run_time(s_tasks[i].xHandle);
+        if (_is_idle_task(&s_tasks[i]))
+        {
+            idle += s_task_deltas[i];
+            s_task_deltas[i] = 0;
+        }
+
+        // Tasks are listed in a different order each time, so the previous
+        // snapshot can only be replaced once every task has been looked up
+        s_run_times[i] = (task_run_time){
+            .handle = s_tasks[i].xHandle,
+            .run_time = s_tasks[i].ulRunTimeCounter
+        };
+    }
+
+    memcpy(s_prev_run_times, s_run_times, task_count * sizeof(s_run_times[0]));
+    s_prev_task_count = task_count;
+    s_prev_total_run_time = total_run_time;
+
+    if (elapsed == 0)
+    {
+        return 0;
+    }
+
+    // Run time counts wall-clock time, so each core adds up to the elapsed time
+    uint64_t capacity = (uint64_t)elapsed * portNUM_PROCESSORS;
+    report->cpu_busy_percent = (idle >= capacity) ? 0 : 100 - (uint8_t)((uint64_t)idle * 100 / capacity);
+
+    size_t length = 0;
+    while (report->task_count < MAX_REPORTED_TASKS && length + sizeof(message_telemetry_task) <= max_length)
+    {
+        int busiest = -1;
+        for (int i = 0; i < task_count; ++i)
+        {
+            if (s_task_deltas[i] > 0 && (busiest < 0 || s_task_deltas[i] > s_task_deltas[busiest]))
+            {
+                busiest = i;
+            }
+        }
+
+        if (busiest < 0)
+        {
+            break;
+        }
+
+        message_telemetry_task entry = {
+            .cpu_percent = (uint8_t)MIN(100, (uint64_t)s_task_deltas[busiest] * 100 / elapsed),
+            .stack_unused = (uint16_t)MIN(UINT16_MAX, s_tasks[busiest].usStackHighWaterMark)
+        };
+        strncpy(entry.name, s_tasks[busiest].pcTaskName, sizeof(entry.name));
+
+        memcpy(out + length, &entry, sizeof(entry));
+        length += sizeof(entry);
+        ++report->task_count;
+
+        s_task_deltas[busiest] = 0;
+    }
+
+    return length;
+}
+#endif
+
+void telemetry_count(telemetry_counter counter)
+{
+    atomic_fetch_add(&s_counters[counter], 1);
+}
+
+size_t telemetry_build_report(uint8_t* out_payload, size_t max_length)
+{
+    size_t length = sizeof(message_telemetry) +
+                    (TELEMETRY_COUNTER_COUNT * sizeof(uint32_t)) +
+                    (LATENCY_STAGE_COUNT * sizeof(message_latency_stage));
+    assert(length <= max_length);
+
+    message_telemetry* report = (message_telemetry*)out_payload;
+    memset(report, 0, sizeof(message_telemetry));
+
+    wifi_get_mac_address(report->device_id);
+    report->uptime_s = esp_timer_get_time() / 1000000;
+
+    wifi_ap_info ap = {0};
+    if (wifi_get_connected_ap(&ap))
+    {
+        report->rssi = ap.rssi;
+    }
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+    multi_heap_info_t heap = {0};
+    heap_caps_get_info(&heap, MALLOC_CAP_8BIT);
+
+    report->heap_free = heap.total_free_bytes;
+    report->heap_min_free = heap.minimum_free_bytes;
+    report->heap_largest_block = heap.largest_free_block;
+#endif
+
+    uint8_t* data = report->data;
+
+    report->counter_count = TELEMETRY_COUNTER_COUNT;
+    for (int i = 0; i < TELEMETRY_COUNTER_COUNT; ++i)
+    {
+        uint32_t value = atomic_load(&s_counters[i]);
+        memcpy(data, &value, sizeof(value));
+        data += sizeof(value);
+    }
+
+    // Cumulative, so reports don't interfere with the server's own queries
+    report->stage_count = LATENCY_STAGE_COUNT;
+    for (int i = 0; i < LATENCY_STAGE_COUNT; ++i)
+    {
+        latency_stats stats = {0};
+        latency_get_stats(i, &stats);
+
+        message_latency_stage stage = {
+            .count = stats.count,
+            .p50_us = stats.p50_us,
+            .p95_us = stats.p95_us,
+            .p99_us = stats.p99_us,
+            .max_us = stats.max_us
+        };
+        memcpy(data, &stage, sizeof(stage));
+        data += sizeof(stage);
+    }
+
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+    length += _add_tasks(report, data, max_length - length);
+#endif
+
+    return length;
+}
@@ -0,0 +1,35 @@
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Events counted since boot and reported to the server
+typedef enum {
+    TELEMETRY_COUNTER_NETWORK_CONNECTS,  // Joined a Wi-Fi network
+    TELEMETRY_COUNTER_NETWORK_DROPS,     // Lost a Wi-Fi network unexpectedly
+    TELEMETRY_COUNTER_ROAMS,             // Switched to a stronger access point
+    TELEMETRY_COUNTER_SERVER_CONNECTS,   // Opened a connection to the server
+    TELEMETRY_COUNTER_COUNT
+} telemetry_counter;
+
+/*
+    Adds one to a counter. Safe to call from any task.
+
+    @param counter The counter to increment
+*/
+void telemetry_count(telemetry_counter counter);
+
+/*
+    Fills in a telemetry report (message_telemetry) with the current state of
+    the device. CPU use is measured since the previous report, so this should
+    only be called by one task.
+
+    @param out_payload [output] Receives the report
+    @param max_length  Size of out_payload in bytes
+
+    @returns The length of the report in bytes
+*/
+size_t telemetry_build_report(uint8_t* out_payload, size_t max_length);
+
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <esp_err.h>
+
+#include "mock_hardware.h"
+
+#define ESP_INTR_FLAG_IRAM (1 << 10)
+
+typedef int gpio_num_t;
+
+typedef enum {
+    GPIO_MODE_INPUT = 1,
+    GPIO_MODE_OUTPUT = 2
+} gpio_mode_t;
+
+typedef enum {
+    GPIO_INTR_DISABLE,
+    GPIO_INTR_POSEDGE,
+    GPIO_INTR_NEGEDGE,
+    GPIO_INTR_ANYEDGE,
+    GPIO_INTR_LOW_LEVEL,
+    GPIO_INTR_HIGH_LEVEL
+} gpio_int_type_t;
+
+typedef void (*gpio_isr_t)(void* arg);
+
+static inline esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+    mock_gpio_isr_service_flags = intr_alloc_flags;
+    return ESP_OK;
+}
+
+static inline esp_err_t gpio_reset_pin(gpio_num_t pin)
+{
+    mock_gpio_levels[pin] = 1;  // Pulled up
+    return ESP_OK;
+}
+
+static inline esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode)
+{
+    return ESP_OK;
+}
+
+static inline esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+    mock_gpio_levels[pin] = level;
+    return ESP_OK;
+}
+
+static inline esp_err_t gpio_set_intr_type(gpio_num_t pin, gpio_int_type_t intr_type)
+{
+    return ESP_OK;
+}
+
+static inline esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t isr_handler, void* args)
+{
+    mock_gpio_isr = isr_handler;
+    mock_gpio_isr_arg = args;
+    return ESP_OK;
+}
+
+static inline esp_err_t gpio_isr_handler_remove(gpio_num_t pin)
+{
+    mock_gpio_isr = NULL;
+    mock_gpio_isr_arg = NULL;
+    return ESP_OK;
+}
+
+static inline esp_err_t gpio_wakeup_enable(gpio_num_t pin, gpio_int_type_t intr_type)
+{
+    mock_gpio_is_wakeup_enabled = true;
+    return ESP_OK;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "mock_hardware.h"
+
+static inline bool spi_flash_cache_enabled(void)
+{
+    return mock_is_cache_enabled;
+}
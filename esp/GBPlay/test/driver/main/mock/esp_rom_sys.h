@@ -0,0 +1,8 @@
+#pragma once
+
+// Busy-waits move the simulated clock forward instead
+#include_next <esp_rom_sys.h>
+
+#include "mock_hardware.h"
+
+#define esp_rom_delay_us(us) mock_delay_us(us)
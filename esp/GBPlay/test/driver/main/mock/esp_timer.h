@@ -0,0 +1,12 @@
+#pragma once
+
+// Runs timers on the simulated clock. A timer fires as soon as it's started,
+// after moving the clock forward by its timeout.
+#include_next <esp_timer.h>
+
+#include "mock_hardware.h"
+
+#define esp_timer_get_time()                     mock_timer_get_time()
+#define esp_timer_create(args, out_handle)       mock_timer_create((args)->callback, (args)->arg, (void**)(out_handle))
+#define esp_timer_start_once(handle, timeout_us) mock_timer_start_once((handle), (timeout_us))
+#define esp_timer_delete(handle)                 mock_timer_delete(handle)
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <driver/gpio.h>
+
+#include "mock_hardware.h"
+
+// The register block is never touched, only passed along
+typedef struct {
+    uint32_t unused;
+} gpio_dev_t;
+
+extern gpio_dev_t GPIO;
+
+static inline void gpio_ll_wakeup_disable(gpio_dev_t* hw, uint32_t pin)
+{
+    mock_gpio_is_wakeup_enabled = false;
+}
+
+static inline void gpio_ll_set_intr_type(gpio_dev_t* hw, uint32_t pin, gpio_int_type_t intr_type)
+{
+}
+
+static inline int gpio_ll_get_level(gpio_dev_t* hw, uint32_t pin)
+{
+    return mock_gpio_levels[pin];
+}
+
+static inline void gpio_ll_set_level(gpio_dev_t* hw, uint32_t pin, uint32_t level)
+{
+    mock_gpio_levels[pin] = level;
+}
@@ -0,0 +1,229 @@
+#include <string.h>
+
+#include <driver/spi_master.h>
+#include <hal/gpio_ll.h>
+
+#include "mock_hardware.h"
+
+#define NS_PER_US (1000LL)
+#define NS_PER_S  (1000LL * 1000 * 1000)
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef struct {
+    spi_transaction_t* txn;
+    int64_t start_ns;
+    int64_t end_ns;
+} mock_spi_queued;
+
+typedef struct {
+    mock_callback callback;
+    void* arg;
+} mock_timer;
+
+struct mock_spi_device {
+    int queue_size;
+};
+
+uint8_t mock_spi_tx[MOCK_SPI_MAX_BYTES];
+int64_t mock_spi_tx_time_ns[MOCK_SPI_MAX_BYTES];
+size_t mock_spi_tx_count = 0;
+size_t mock_spi_transaction_lengths[MOCK_SPI_MAX_TRANSACTIONS];
+size_t mock_spi_transaction_count = 0;
+int mock_spi_max_in_flight = 0;
+bool mock_spi_is_bus_initialized = false;
+int mock_spi_clock_speed_hz = 0;
+
+int mock_timer_start_count = 0;
+int64_t mock_delay_total_us = 0;
+
+int mock_gpio_levels[MOCK_GPIO_COUNT];
+mock_callback mock_gpio_isr = NULL;
+void* mock_gpio_isr_arg = NULL;
+int mock_gpio_isr_service_flags = 0;
+bool mock_gpio_is_wakeup_enabled = false;
+
+bool mock_is_cache_enabled = true;
+
+gpio_dev_t GPIO;
+
+static int64_t s_now_ns = 0;
+
+static struct mock_spi_device s_device;
+static bool s_is_device_added = false;
+
+// Transactions that were queued and whose results haven't been collected
+static mock_spi_queued s_in_flight[MOCK_SPI_MAX_TRANSACTIONS];
+static int s_in_flight_count = 0;
+static int64_t s_bus_free_time_ns = 0;
+
+static mock_timer s_timer;
+
+void mock_clear_records()
+{
+    mock_spi_tx_count = 0;
+    mock_spi_transaction_count = 0;
+    mock_spi_max_in_flight = 0;
+    mock_timer_start_count = 0;
+    mock_delay_total_us = 0;
+}
+
+void mock_advance_us(int64_t us)
+{
+    s_now_ns += us * NS_PER_US;
+}
+
+int64_t mock_get_time_ns()
+{
+    return s_now_ns;
+}
+
+int64_t mock_spi_get_byte_time_ns()
+{
+    return (8 * NS_PER_S) / mock_spi_clock_speed_hz;
+}
+
+void mock_gpio_set_input(int pin, int level)
+{
+    mock_gpio_levels[pin] = level;
+}
+
+int64_t mock_timer_get_time()
+{
+    return s_now_ns / NS_PER_US;
+}
+
+int mock_timer_create(mock_callback callback, void* arg, void** out_handle)
+{
+    s_timer.callback = callback;
+    s_timer.arg = arg;
+    *out_handle = &s_timer;
+    return ESP_OK;
+}
+
+int mock_timer_start_once(void* handle, uint64_t timeout_us)
+{
+    mock_timer* timer = handle;
+
+    ++mock_timer_start_count;
+    mock_advance_us(timeout_us);
+    timer->callback(timer->arg);
+    return ESP_OK;
+}
+
+int mock_timer_delete(void* handle)
+{
+    return ESP_OK;
+}
+
+void mock_delay_us(uint32_t us)
+{
+    mock_delay_total_us += us;
+    mock_advance_us(us);
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t* bus_config, int dma_chan)
+{
+    if (mock_spi_is_bus_initialized)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    mock_spi_is_bus_initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_free(spi_host_device_t host)
+{
+    if (!mock_spi_is_bus_initialized || s_is_device_added)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    mock_spi_is_bus_initialized = false;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t* dev_config, spi_device_handle_t* out_handle)
+{
+    if (!mock_spi_is_bus_initialized || s_is_device_added || dev_config->queue_size > MOCK_SPI_MAX_TRANSACTIONS)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    s_device.queue_size = dev_config->queue_size;
+    s_is_device_added = true;
+    mock_spi_clock_speed_hz = dev_config->clock_speed_hz;
+
+    *out_handle = &s_device;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle)
+{
+    if (!s_is_device_added || s_in_flight_count > 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    s_is_device_added = false;
+    return ESP_OK;
+}
+
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t* trans, TickType_t ticks_to_wait)
+{
+    // Nothing else can complete a transaction here, so a full queue would
+    // block forever
+    if (!s_is_device_added || s_in_flight_count >= handle->queue_size)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (mock_spi_transaction_count < MOCK_SPI_MAX_TRANSACTIONS)
+    {
+        mock_spi_transaction_lengths[mock_spi_transaction_count++] = trans->length / 8;
+    }
+
+    // Starts as soon as the bus is free
+    mock_spi_queued* queued = &s_in_flight[s_in_flight_count++];
+    queued->txn = trans;
+    queued->start_ns = MAX(s_now_ns, s_bus_free_time_ns);
+    queued->end_ns = queued->start_ns + (trans->length * NS_PER_S) / mock_spi_clock_speed_hz;
+    s_bus_free_time_ns = queued->end_ns;
+
+    mock_spi_max_in_flight = MAX(mock_spi_max_in_flight, s_in_flight_count);
+    return ESP_OK;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t** out_trans, TickType_t ticks_to_wait)
+{
+    if (s_in_flight_count == 0)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    mock_spi_queued done = s_in_flight[0];
+    memmove(&s_in_flight[0], &s_in_flight[1], --s_in_flight_count * sizeof(s_in_flight[0]));
+    s_now_ns = MAX(s_now_ns, done.end_ns);
+
+    // The buffers are read now rather than when queued, so a buffer reused
+    // while its transaction was in flight shows up as wrong bytes
+    spi_transaction_t* txn = done.txn;
+    const uint8_t* tx = (txn->flags & SPI_TRANS_USE_TXDATA) ? txn->tx_data : txn->tx_buffer;
+    uint8_t* rx = (txn->flags & SPI_TRANS_USE_RXDATA) ? txn->rx_data : txn->rx_buffer;
+
+    // The other end answers each byte with its complement
+    for (size_t i = 0; i < txn->length / 8; ++i)
+    {
+        if (mock_spi_tx_count < MOCK_SPI_MAX_BYTES)
+        {
+            mock_spi_tx[mock_spi_tx_count] = tx[i];
+            mock_spi_tx_time_ns[mock_spi_tx_count] = done.start_ns + (i * 8 * NS_PER_S) / mock_spi_clock_speed_hz;
+            ++mock_spi_tx_count;
+        }
+        rx[i] = ~tx[i];
+    }
+
+    *out_trans = txn;
+    return ESP_OK;
+}
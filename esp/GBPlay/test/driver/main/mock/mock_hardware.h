@@ -0,0 +1,82 @@
+#ifndef _MOCK_HARDWARE_H
+#define _MOCK_HARDWARE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Stand-ins for the ESP32 peripherals used by the link cable driver. Time is
+// simulated: it only moves when the driver waits or the bus is busy, so the
+// tests can check timings exactly.
+
+#define MOCK_SPI_MAX_BYTES        2048
+#define MOCK_SPI_MAX_TRANSACTIONS 16
+#define MOCK_GPIO_COUNT           40
+
+typedef void (*mock_callback)(void* arg);
+
+// Bytes clocked out as a master, in order, and when each started shifting
+extern uint8_t mock_spi_tx[MOCK_SPI_MAX_BYTES];
+extern int64_t mock_spi_tx_time_ns[MOCK_SPI_MAX_BYTES];
+extern size_t mock_spi_tx_count;
+
+// Length of each transaction in bytes, in the order they were queued
+extern size_t mock_spi_transaction_lengths[MOCK_SPI_MAX_TRANSACTIONS];
+extern size_t mock_spi_transaction_count;
+
+// Most transactions that were queued at once
+extern int mock_spi_max_in_flight;
+
+extern bool mock_spi_is_bus_initialized;
+extern int mock_spi_clock_speed_hz;
+
+// Calls to esp_timer_start_once(), and the time spent in esp_rom_delay_us()
+extern int mock_timer_start_count;
+extern int64_t mock_delay_total_us;
+
+extern int mock_gpio_levels[MOCK_GPIO_COUNT];
+extern mock_callback mock_gpio_isr;
+extern void* mock_gpio_isr_arg;
+extern int mock_gpio_isr_service_flags;
+extern bool mock_gpio_is_wakeup_enabled;
+
+// Whether the flash cache is on, as seen by the clock interrupt handler
+extern bool mock_is_cache_enabled;
+
+/* Clears everything recorded so far. Doesn't change the time or the setup. */
+void mock_clear_records();
+
+/*
+    Lets time pass without the driver doing anything.
+
+    @param us Number of microseconds to advance by
+*/
+void mock_advance_us(int64_t us);
+
+/* Returns the simulated time in nanoseconds. */
+int64_t mock_get_time_ns();
+
+/*
+    Returns how long a byte takes to shift at the current clock speed.
+
+    @returns The time in nanoseconds
+*/
+int64_t mock_spi_get_byte_time_ns();
+
+/*
+    Sets the level of a pin as seen by the driver, such as a line driven by
+    the Game Boy. Doesn't call the interrupt handler.
+
+    @param pin   Pin number
+    @param level 0 or 1
+*/
+void mock_gpio_set_input(int pin, int level);
+
+// Used by the mock headers in place of the ESP-IDF functions
+int64_t mock_timer_get_time();
+int mock_timer_create(mock_callback callback, void* arg, void** out_handle);
+int mock_timer_start_once(void* handle, uint64_t timeout_us);
+int mock_timer_delete(void* handle);
+void mock_delay_us(uint32_t us);
+
+#endif
@@ -0,0 +1,6 @@
+#pragma once
+
+// Same pins as the ESP32
+#define SPI2_IOMUX_PIN_NUM_MISO 12
+#define SPI2_IOMUX_PIN_NUM_MOSI 13
+#define SPI2_IOMUX_PIN_NUM_CLK  14
@@ -0,0 +1,317 @@
+#include <stdlib.h>
+
+#include <driver/gpio.h>
+#include <soc/spi_pins.h>
+#include <unity.h>
+
+#include "hardware/spi.h"
+#include "mock_hardware.h"
+
+// Crosses two DMA chunk boundaries (512 bytes each)
+#define BULK_EXCHANGE_LENGTH 1100
+
+#define NS_PER_US 1000
+#define NS_PER_S  (1000LL * 1000 * 1000)
+
+// Same pins as the driver
+#define GB_PIN_MOSI SPI2_IOMUX_PIN_NUM_MOSI
+#define GB_PIN_MISO SPI2_IOMUX_PIN_NUM_MISO
+#define GB_PIN_SCLK SPI2_IOMUX_PIN_NUM_CLK
+
+// Half a clock period at 8 KHz
+#define HALF_CLOCK_PERIOD_US 61
+
+static int s_rx_callback_count = 0;
+
+static void _on_slave_rx(void* arg)
+{
+    ++s_rx_callback_count;
+}
+
+static void _clock_edge(int level)
+{
+    mock_advance_us(HALF_CLOCK_PERIOD_US);
+    mock_gpio_set_input(GB_PIN_SCLK, level);
+    mock_gpio_isr(mock_gpio_isr_arg);
+}
+
+// Plays the Game Boy driving the clock. Shifts out the top bits of tx and
+// returns the bits the device shifted out at the same time.
+static uint8_t _clock_bits(uint8_t tx, int bit_count)
+{
+    uint8_t rx = 0;
+    for (int i = 0; i < bit_count; ++i)
+    {
+        // Mode 3: the device shifts out on the falling edge and samples on
+        // the rising edge
+        _clock_edge(0);
+        mock_gpio_set_input(GB_PIN_MISO, (tx >> (7 - i)) & 1);
+        _clock_edge(1);
+        rx = (rx << 1) | mock_gpio_levels[GB_PIN_MOSI];
+    }
+    return rx;
+}
+
+static uint8_t _clock_byte(uint8_t tx)
+{
+    return _clock_bits(tx, 8);
+}
+
+void setUp()
+{
+    mock_clear_records();
+    s_rx_callback_count = 0;
+}
+
+void tearDown()
+{
+    // Also when a slave test fails partway
+    mock_is_cache_enabled = true;
+    spi_slave_set_rx_callback(NULL, NULL);
+    spi_set_role(SPI_ROLE_MASTER);
+}
+
+static void test_contiguous_exchange_is_chunked_in_order()
+{
+    uint8_t tx[BULK_EXCHANGE_LENGTH];
+    uint8_t rx[BULK_EXCHANGE_LENGTH];
+    for (size_t i = 0; i < sizeof(tx); ++i)
+    {
+        tx[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    spi_exchange_buffer(tx, rx, sizeof(tx), 0 /* gap_us */);
+
+    // Split into DMA-sized chunks, with the next one always queued behind
+    // the one on the wire
+    TEST_ASSERT_EQUAL(3, mock_spi_transaction_count);
+    TEST_ASSERT_EQUAL(512, mock_spi_transaction_lengths[0]);
+    TEST_ASSERT_EQUAL(512, mock_spi_transaction_lengths[1]);
+    TEST_ASSERT_EQUAL(76, mock_spi_transaction_lengths[2]);
+    TEST_ASSERT_EQUAL(2, mock_spi_max_in_flight);
+
+    // Every byte went out in order, and each reply lines up with the byte it
+    // answered
+    TEST_ASSERT_EQUAL(sizeof(tx), mock_spi_tx_count);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(tx, mock_spi_tx, sizeof(tx));
+    for (size_t i = 0; i < sizeof(tx); ++i)
+    {
+        TEST_ASSERT_EQUAL_UINT8((uint8_t)~tx[i], rx[i]);
+    }
+
+    // The bus never went idle between chunks
+    for (size_t i = 1; i < sizeof(tx); ++i)
+    {
+        int64_t expected_ns = (int64_t)i * 8 * NS_PER_S / mock_spi_clock_speed_hz;
+        TEST_ASSERT_EQUAL((int)expected_ns, (int)(mock_spi_tx_time_ns[i] - mock_spi_tx_time_ns[0]));
+    }
+}
+
+static void test_exchange_byte_matches_buffer()
+{
+    TEST_ASSERT_EQUAL_UINT8(0x5A, spi_exchange_byte(0xA5));
+    TEST_ASSERT_EQUAL(1, mock_spi_tx_count);
+    TEST_ASSERT_EQUAL_UINT8(0xA5, mock_spi_tx[0]);
+}
+
+static void test_long_gap_blocks_then_spins()
+{
+    const uint32_t gap_us = 3000;
+    const int64_t byte_time_ns = mock_spi_get_byte_time_ns();
+
+    uint8_t tx[8] = { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40 };
+    uint8_t rx[sizeof(tx)];
+    spi_exchange_buffer(tx, rx, sizeof(tx), gap_us);
+
+    TEST_ASSERT_EQUAL(sizeof(tx), mock_spi_tx_count);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(tx, mock_spi_tx, sizeof(tx));
+
+    // Each byte starts a full gap after the previous one finished shifting.
+    // The clock is read in whole microseconds, so allow for rounding.
+    for (size_t i = 1; i < sizeof(tx); ++i)
+    {
+        int gap_ns = (int)(mock_spi_tx_time_ns[i] - mock_spi_tx_time_ns[i - 1] - byte_time_ns);
+        TEST_ASSERT_GREATER_OR_EQUAL_INT(gap_us * NS_PER_US - NS_PER_US, gap_ns);
+        TEST_ASSERT_LESS_OR_EQUAL_INT(gap_us * NS_PER_US, gap_ns);
+    }
+
+    // Most of each gap is spent blocked on the timer, only the end spinning
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(sizeof(tx) - 1, mock_timer_start_count);
+    TEST_ASSERT_LESS_OR_EQUAL_INT(sizeof(tx) * 100, (int)mock_delay_total_us);
+}
+
+static void test_short_gap_only_spins()
+{
+    const uint32_t gap_us = 50;
+    const int64_t byte_time_ns = mock_spi_get_byte_time_ns();
+
+    uint8_t tx[4] = { 0x12, 0x34, 0x56, 0x78 };
+    uint8_t rx[sizeof(tx)];
+    spi_exchange_buffer(tx, rx, sizeof(tx), gap_us);
+
+    TEST_ASSERT_EQUAL(sizeof(tx), mock_spi_tx_count);
+    for (size_t i = 1; i < sizeof(tx); ++i)
+    {
+        int gap_ns = (int)(mock_spi_tx_time_ns[i] - mock_spi_tx_time_ns[i - 1] - byte_time_ns);
+        TEST_ASSERT_GREATER_OR_EQUAL_INT(gap_us * NS_PER_US - NS_PER_US, gap_ns);
+        TEST_ASSERT_LESS_OR_EQUAL_INT(gap_us * NS_PER_US, gap_ns);
+    }
+
+    TEST_ASSERT_EQUAL(0, mock_timer_start_count);
+}
+
+static void test_gap_carries_over_between_exchanges()
+{
+    const uint32_t gap_us = 5000;
+    const int64_t byte_time_ns = mock_spi_get_byte_time_ns();
+
+    uint8_t rx = 0;
+    spi_exchange_buffer((const uint8_t[]){ 0x11 }, &rx, 1, gap_us);
+    spi_exchange_buffer((const uint8_t[]){ 0x22 }, &rx, 1, gap_us);
+
+    TEST_ASSERT_EQUAL(2, mock_spi_tx_count);
+    int gap_ns = (int)(mock_spi_tx_time_ns[1] - mock_spi_tx_time_ns[0] - byte_time_ns);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(gap_us * NS_PER_US - NS_PER_US, gap_ns);
+}
+
+static void test_idle_link_does_not_delay_first_byte()
+{
+    const uint32_t gap_us = 5000;
+
+    // Longer than the gap since the last byte of the previous test
+    mock_advance_us(2 * gap_us);
+
+    uint8_t rx = 0;
+    int64_t start_ns = mock_get_time_ns();
+    spi_exchange_buffer((const uint8_t[]){ 0x33 }, &rx, 1, gap_us);
+
+    TEST_ASSERT_EQUAL(1, mock_spi_tx_count);
+    TEST_ASSERT_EQUAL(0, (int)(mock_spi_tx_time_ns[0] - start_ns));
+    TEST_ASSERT_EQUAL(0, mock_timer_start_count);
+    TEST_ASSERT_EQUAL(0, (int)mock_delay_total_us);
+}
+
+static void test_slave_answers_with_queued_bytes_then_idle_byte()
+{
+    const uint8_t queued[] = { 0xA1, 0xB2, 0xC3 };
+    const uint8_t sent[] = { 0x10, 0x20, 0x30, 0x40, 0x50 };
+
+    // Loaded into the shift register as soon as the role switches
+    spi_slave_set_idle_byte(0x7E);
+    TEST_ASSERT_TRUE(spi_set_role(SPI_ROLE_SLAVE));
+    TEST_ASSERT_FALSE(mock_spi_is_bus_initialized);
+    TEST_ASSERT_TRUE(mock_gpio_isr != NULL);
+
+    spi_slave_set_rx_callback(&_on_slave_rx, NULL);
+    TEST_ASSERT_EQUAL(sizeof(queued), spi_slave_queue_tx(queued, sizeof(queued)));
+
+    // The queued bytes go out in order after the byte that was already
+    // loaded, then the idle byte once they run out
+    const uint8_t expected[] = { 0x7E, 0xA1, 0xB2, 0xC3, 0x7E };
+    uint8_t replies[sizeof(sent)];
+    for (size_t i = 0; i < sizeof(sent); ++i)
+    {
+        replies[i] = _clock_byte(sent[i]);
+    }
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, replies, sizeof(expected));
+
+    // Every byte the Game Boy sent is reported once, in order
+    uint8_t rx[sizeof(sent) + 1];
+    TEST_ASSERT_EQUAL(sizeof(sent), spi_slave_read_rx(rx, sizeof(rx)));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(sent, rx, sizeof(sent));
+    TEST_ASSERT_EQUAL(sizeof(sent), s_rx_callback_count);
+
+    // The Game Boy picks the speed now, and it must be one we can follow
+    TEST_ASSERT_FALSE(spi_set_clock_speed(SPI_CLOCK_SPEED_FAST));
+}
+
+static void test_slave_restarts_byte_after_pause()
+{
+    TEST_ASSERT_TRUE(spi_set_role(SPI_ROLE_SLAVE));
+    TEST_ASSERT_EQUAL(1, spi_slave_queue_tx((const uint8_t[]){ 0xC6 }, 1));
+
+    // Loads the queued byte
+    _clock_byte(0x00);
+
+    // The Game Boy stopped partway through a transfer
+    _clock_bits(0xFF, 3);
+    mock_advance_us(2000);
+
+    // The next transfer is received whole, and the queued byte isn't lost
+    uint8_t reply = _clock_byte(0x5A);
+    TEST_ASSERT_EQUAL_UINT8(0xC6, reply);
+
+    uint8_t rx[3];
+    TEST_ASSERT_EQUAL(2, spi_slave_read_rx(rx, sizeof(rx)));
+    TEST_ASSERT_EQUAL_UINT8(0x5A, rx[1]);
+}
+
+static void test_slave_keeps_clocking_while_cache_disabled()
+{
+    // The clock must keep being followed while flash is written
+    TEST_ASSERT_TRUE(mock_gpio_isr_service_flags & ESP_INTR_FLAG_IRAM);
+
+    TEST_ASSERT_TRUE(spi_set_role(SPI_ROLE_SLAVE));
+    spi_slave_set_rx_callback(&_on_slave_rx, NULL);
+
+    mock_is_cache_enabled = false;
+    _clock_byte(0x3C);
+
+    // Received, but the callback may be in flash, so it has to wait
+    uint8_t rx = 0;
+    TEST_ASSERT_EQUAL(1, spi_slave_read_rx(&rx, 1));
+    TEST_ASSERT_EQUAL_UINT8(0x3C, rx);
+    TEST_ASSERT_EQUAL(0, s_rx_callback_count);
+
+    // Called on the first edge after the cache comes back
+    mock_is_cache_enabled = true;
+    _clock_edge(0);
+    TEST_ASSERT_EQUAL(1, s_rx_callback_count);
+}
+
+static void test_link_wakeup_disarmed_by_first_edge()
+{
+    TEST_ASSERT_TRUE(spi_set_role(SPI_ROLE_SLAVE));
+
+    spi_arm_link_wakeup();
+    TEST_ASSERT_TRUE(mock_gpio_is_wakeup_enabled);
+
+    _clock_byte(0x81);
+    TEST_ASSERT_FALSE(mock_gpio_is_wakeup_enabled);
+
+    uint8_t rx = 0;
+    TEST_ASSERT_EQUAL(1, spi_slave_read_rx(&rx, 1));
+    TEST_ASSERT_EQUAL_UINT8(0x81, rx);
+}
+
+static void test_slave_role_refused_at_fast_clock()
+{
+    TEST_ASSERT_TRUE(spi_set_clock_speed(SPI_CLOCK_SPEED_FAST));
+    TEST_ASSERT_FALSE(spi_set_role(SPI_ROLE_SLAVE));
+    TEST_ASSERT_EQUAL(SPI_ROLE_MASTER, spi_get_role());
+    TEST_ASSERT_TRUE(mock_spi_is_bus_initialized);
+    TEST_ASSERT_TRUE(spi_set_clock_speed(SPI_CLOCK_SPEED_NORMAL));
+}
+
+void app_main()
+{
+    UNITY_BEGIN();
+
+    spi_initialize();
+
+    RUN_TEST(test_contiguous_exchange_is_chunked_in_order);
+    RUN_TEST(test_exchange_byte_matches_buffer);
+    RUN_TEST(test_long_gap_blocks_then_spins);
+    RUN_TEST(test_short_gap_only_spins);
+    RUN_TEST(test_gap_carries_over_between_exchanges);
+    RUN_TEST(test_idle_link_does_not_delay_first_byte);
+    RUN_TEST(test_slave_answers_with_queued_bytes_then_idle_byte);
+    RUN_TEST(test_slave_restarts_byte_after_pause);
+    RUN_TEST(test_slave_keeps_clocking_while_cache_disabled);
+    RUN_TEST(test_link_wakeup_disarmed_by_first_edge);
+    RUN_TEST(test_slave_role_refused_at_fast_clock);
+
+    spi_deinitialize();
+
+    exit(UNITY_END() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
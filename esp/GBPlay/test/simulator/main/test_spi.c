@@ -0,0 +1,320 @@
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <esp_timer.h>
+#include <unity.h>
+
+#include "hardware/spi.h"
+
+// Same variable the simulated link cable reads
+#define LINK_SOCKET_ENV "GBPLAY_LINK_SOCKET"
+
+// More than the driver puts in one DMA transfer (512 bytes)
+#define BULK_EXCHANGE_LENGTH 1100
+
+#define PEER_MAX_BYTES 2048
+
+// How often the peer checks whether it should start driving the clock
+#define PEER_POLL_TIMEOUT_MS 10
+
+// Allowed on top of the expected time, for scheduling on a busy machine
+#define TIMING_SLACK_US (10 * 1000)
+
+// How long to wait for the device to answer bytes sent by the peer
+#define PEER_DRIVE_TIMEOUT_US (1000 * 1000)
+
+// Plays the Game Boy on the other end of the simulated link cable. Answers
+// each byte with its complement and notes when it arrived.
+static char s_peer_path[64];
+static int s_peer_listen_fd = -1;
+static pthread_t s_peer_thread;
+static uint8_t s_peer_rx[PEER_MAX_BYTES];
+static int64_t s_peer_rx_time_us[PEER_MAX_BYTES];
+static volatile size_t s_peer_rx_count = 0;
+
+// Bytes for the peer to send while it drives the clock, and the replies.
+// The peer clears the flag once it has them all.
+static uint8_t s_peer_master_tx[PEER_MAX_BYTES];
+static uint8_t s_peer_master_rx[PEER_MAX_BYTES];
+static size_t s_peer_master_len = 0;
+static atomic_bool s_is_peer_driving = false;
+
+static atomic_int s_rx_callback_count = 0;
+
+static bool _drive_clock(int fd)
+{
+    for (size_t i = 0; i < s_peer_master_len; ++i)
+    {
+        if (write(fd, &s_peer_master_tx[i], 1) != 1 || read(fd, &s_peer_master_rx[i], 1) != 1)
+        {
+            return false;
+        }
+    }
+
+    atomic_store(&s_is_peer_driving, false);
+    return true;
+}
+
+static void* _peer_thread(void* arg)
+{
+    int fd = accept(s_peer_listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    while (true)
+    {
+        if (atomic_load(&s_is_peer_driving))
+        {
+            if (!_drive_clock(fd))
+            {
+                break;
+            }
+            continue;
+        }
+
+        struct pollfd fds[] = {{
+            .fd = fd,
+            .events = POLLIN
+        }};
+        if (poll(fds, 1, PEER_POLL_TIMEOUT_MS) == 0)
+        {
+            continue;
+        }
+
+        uint8_t b = 0;
+        if (read(fd, &b, 1) != 1)
+        {
+            break;
+        }
+
+        // Each exchange finishes before the next starts, so the test only
+        // looks at these once they're written
+        size_t i = s_peer_rx_count;
+        if (i < PEER_MAX_BYTES)
+        {
+            s_peer_rx[i] = b;
+            s_peer_rx_time_us[i] = esp_timer_get_time();
+            s_peer_rx_count = i + 1;
+        }
+
+        b = ~b;
+        if (write(fd, &b, 1) != 1)
+        {
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void _start_peer()
+{
+    snprintf(s_peer_path, sizeof(s_peer_path), "/tmp/gbplay-spi-test-%d.sock", (int)getpid());
+    unlink(s_peer_path);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, s_peer_path, sizeof(addr.sun_path) - 1);
+
+    // Runs outside any test, so there's nothing to report failures to
+    s_peer_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(s_peer_listen_fd >= 0);
+    assert(bind(s_peer_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(s_peer_listen_fd, 1) == 0);
+    assert(pthread_create(&s_peer_thread, NULL, &_peer_thread, NULL) == 0);
+
+    setenv(LINK_SOCKET_ENV, s_peer_path, 1 /* overwrite */);
+}
+
+static void _stop_peer()
+{
+    // The peer sees the link close once the SPI interface is shut down
+    pthread_join(s_peer_thread, NULL);
+    close(s_peer_listen_fd);
+    unlink(s_peer_path);
+}
+
+// Has the peer send bytes while it drives the clock, and waits until the
+// device has answered and handled all of them
+static void _peer_drive_clock(const uint8_t* tx, size_t len)
+{
+    memcpy(s_peer_master_tx, tx, len);
+    s_peer_master_len = len;
+    atomic_store(&s_is_peer_driving, true);
+
+    // The device answers each byte before reporting it
+    int64_t deadline_us = esp_timer_get_time() + PEER_DRIVE_TIMEOUT_US;
+    while ((atomic_load(&s_is_peer_driving) || atomic_load(&s_rx_callback_count) < (int)len) &&
+           esp_timer_get_time() < deadline_us)
+    {
+        usleep(1000);
+    }
+}
+
+static void _on_slave_rx(void* arg)
+{
+    atomic_fetch_add(&s_rx_callback_count, 1);
+}
+
+static uint32_t _get_byte_time_us()
+{
+    return (8 * 1000 * 1000) / spi_get_clock_speed_hz(spi_get_clock_speed());
+}
+
+void setUp()
+{
+    s_peer_rx_count = 0;
+    atomic_store(&s_rx_callback_count, 0);
+}
+
+void tearDown()
+{
+    // Also when a slave test fails partway
+    spi_slave_set_rx_callback(NULL, NULL);
+    spi_set_role(SPI_ROLE_MASTER);
+}
+
+static void test_contiguous_exchange_keeps_byte_order()
+{
+    uint8_t tx[BULK_EXCHANGE_LENGTH];
+    uint8_t rx[BULK_EXCHANGE_LENGTH];
+    for (size_t i = 0; i < sizeof(tx); ++i)
+    {
+        tx[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    spi_exchange_buffer(tx, rx, sizeof(tx), 0 /* gap_us */);
+
+    // The Game Boy got every byte in order, and each reply lines up with
+    // the byte it answered
+    TEST_ASSERT_EQUAL(sizeof(tx), s_peer_rx_count);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(tx, s_peer_rx, sizeof(tx));
+    for (size_t i = 0; i < sizeof(tx); ++i)
+    {
+        TEST_ASSERT_EQUAL_UINT8((uint8_t)~tx[i], rx[i]);
+    }
+}
+
+static void test_exchange_byte_matches_buffer()
+{
+    TEST_ASSERT_EQUAL_UINT8(0x5A, spi_exchange_byte(0xA5));
+    TEST_ASSERT_EQUAL(1, s_peer_rx_count);
+    TEST_ASSERT_EQUAL_UINT8(0xA5, s_peer_rx[0]);
+}
+
+static void test_spaced_exchange_waits_between_bytes()
+{
+    const uint32_t gap_us = 3000;
+    const uint32_t byte_time_us = _get_byte_time_us();
+
+    uint8_t tx[8] = { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40 };
+    uint8_t rx[sizeof(tx)];
+    spi_exchange_buffer(tx, rx, sizeof(tx), gap_us);
+
+    TEST_ASSERT_EQUAL(sizeof(tx), s_peer_rx_count);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(tx, s_peer_rx, sizeof(tx));
+
+    // Each byte starts a full gap after the previous one finished shifting
+    for (size_t i = 1; i < sizeof(tx); ++i)
+    {
+        int interval_us = (int)(s_peer_rx_time_us[i] - s_peer_rx_time_us[i - 1]);
+        TEST_ASSERT_GREATER_OR_EQUAL_INT(gap_us + byte_time_us, interval_us);
+        TEST_ASSERT_LESS_OR_EQUAL_INT(gap_us + byte_time_us + TIMING_SLACK_US, interval_us);
+    }
+}
+
+static void test_gap_carries_over_between_exchanges()
+{
+    const uint32_t gap_us = 5000;
+    const uint32_t byte_time_us = _get_byte_time_us();
+
+    uint8_t rx = 0;
+    spi_exchange_buffer((const uint8_t[]){ 0x11 }, &rx, 1, gap_us);
+    spi_exchange_buffer((const uint8_t[]){ 0x22 }, &rx, 1, gap_us);
+
+    TEST_ASSERT_EQUAL(2, s_peer_rx_count);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(gap_us + byte_time_us, (int)(s_peer_rx_time_us[1] - s_peer_rx_time_us[0]));
+}
+
+static void test_idle_link_does_not_delay_first_byte()
+{
+    const uint32_t gap_us = 5000;
+
+    // Longer than the gap since the last byte of the previous test
+    usleep(2 * gap_us);
+
+    uint8_t rx = 0;
+    int64_t start_us = esp_timer_get_time();
+    spi_exchange_buffer((const uint8_t[]){ 0x33 }, &rx, 1, gap_us);
+
+    TEST_ASSERT_EQUAL(1, s_peer_rx_count);
+    TEST_ASSERT_LESS_THAN_INT(gap_us, (int)(s_peer_rx_time_us[0] - start_us));
+}
+
+static void test_slave_answers_with_queued_bytes_then_idle_byte()
+{
+    const uint8_t queued[] = { 0xA1, 0xB2, 0xC3 };
+    const uint8_t sent[] = { 0x10, 0x20, 0x30, 0x40, 0x50 };
+
+    // Loaded into the shift register as soon as the role switches
+    spi_slave_set_idle_byte(0x7E);
+    TEST_ASSERT_TRUE(spi_set_role(SPI_ROLE_SLAVE));
+    spi_slave_set_rx_callback(&_on_slave_rx, NULL);
+    TEST_ASSERT_EQUAL(sizeof(queued), spi_slave_queue_tx(queued, sizeof(queued)));
+
+    _peer_drive_clock(sent, sizeof(sent));
+    TEST_ASSERT_FALSE(atomic_load(&s_is_peer_driving));
+
+    // The queued bytes go out in order after the byte that was already
+    // loaded, then the idle byte once they run out
+    const uint8_t expected[] = { 0x7E, 0xA1, 0xB2, 0xC3, 0x7E };
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, s_peer_master_rx, sizeof(expected));
+
+    // Every byte the Game Boy sent is reported once, in order
+    uint8_t rx[sizeof(sent) + 1];
+    TEST_ASSERT_EQUAL(sizeof(sent), spi_slave_read_rx(rx, sizeof(rx)));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(sent, rx, sizeof(sent));
+    TEST_ASSERT_EQUAL(sizeof(sent), atomic_load(&s_rx_callback_count));
+
+    // The Game Boy picks the speed now, and it must be one we can follow
+    TEST_ASSERT_FALSE(spi_set_clock_speed(SPI_CLOCK_SPEED_FAST));
+}
+
+static void test_slave_role_refused_at_fast_clock()
+{
+    TEST_ASSERT_TRUE(spi_set_clock_speed(SPI_CLOCK_SPEED_FAST));
+    TEST_ASSERT_FALSE(spi_set_role(SPI_ROLE_SLAVE));
+    TEST_ASSERT_EQUAL(SPI_ROLE_MASTER, spi_get_role());
+    TEST_ASSERT_TRUE(spi_set_clock_speed(SPI_CLOCK_SPEED_NORMAL));
+}
+
+void app_main()
+{
+    UNITY_BEGIN();
+
+    _start_peer();
+    spi_initialize();
+
+    RUN_TEST(test_contiguous_exchange_keeps_byte_order);
+    RUN_TEST(test_exchange_byte_matches_buffer);
+    RUN_TEST(test_spaced_exchange_waits_between_bytes);
+    RUN_TEST(test_gap_carries_over_between_exchanges);
+    RUN_TEST(test_idle_link_does_not_delay_first_byte);
+    RUN_TEST(test_slave_answers_with_queued_bytes_then_idle_byte);
+    RUN_TEST(test_slave_role_refused_at_fast_clock);
+
+    spi_deinitialize();
+    _stop_peer();
+
+    exit(UNITY_END() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,102 @@
+// Measures how many byte exchanges per second one core can drive with a
+// device that doesn't support framing, against the per-byte listener
+// approach GameBoyClient used to take. The device is simulated in-process
+// and answers each byte on the next turn of the event loop, so the figures
+// are the server's own overhead.
+//
+// Usage: npm run build && npm run bench:exchange
+
+import { Duplex } from "stream";
+import { GameBoyClient, LinkSocket } from "../src/client";
+
+const EXCHANGE_COUNT = 200000;
+const RUNS = 3;
+
+function createDevice(): LinkSocket {
+    const device = new Duplex({
+        read() {},
+        write(chunk: Buffer, _encoding, callback) {
+            callback();
+
+            // Several bytes can arrive in one chunk. Each gets a reply.
+            setImmediate(() => device.push(Buffer.from(chunk.map(b => b ^ 0xFF))));
+        }
+    });
+
+    return Object.assign(device, { remoteAddress: "bench", remotePort: 0 });
+}
+
+// How exchangeByte() worked before exchanges were queued: a data listener,
+// close listener, timer and promise for every byte
+function exchangeByteWithListeners(socket: LinkSocket, tx: number): Promise<number> {
+    return new Promise<number>((resolve, reject) => {
+        let sentByte = false;
+
+        const timeout = setTimeout(() => socket.destroy(), 10000);
+
+        const cleanup = () => {
+            clearTimeout(timeout);
+            socket.removeListener("close", closeListener);
+            socket.removeListener("data", dataListener);
+        };
+
+        const closeListener = () => {
+            cleanup();
+            reject(new Error("Disconnected before responding."));
+        };
+
+        const dataListener = (data: Buffer) => {
+            if (sentByte) {
+                cleanup();
+                resolve(data.readUInt8(0));
+            }
+        };
+
+        socket.once("close", closeListener);
+        socket.on("data", dataListener);
+
+        socket.write(new Uint8Array([ tx & 0xFF ]), (err?: Error | null) => {
+            if (err) {
+                cleanup();
+                reject(err);
+            } else {
+                sentByte = true;
+            }
+        });
+    });
+}
+
+async function measure(name: string, exchange: (tx: number) => Promise<number>): Promise<void> {
+    for (let run = 0; run < RUNS; ++run) {
+        const start = process.hrtime.bigint();
+        for (let i = 0; i < EXCHANGE_COUNT; ++i) {
+            const rx = await exchange(i);
+            if (rx !== ((i & 0xFF) ^ 0xFF)) {
+                throw new Error(`${name}: expected ${(i & 0xFF) ^ 0xFF}, got ${rx}.`);
+            }
+        }
+        const elapsedS = Number(process.hrtime.bigint() - start) / 1e9;
+
+        console.log(`${name} (run ${run + 1}): ${Math.round(EXCHANGE_COUNT / elapsedS)} exchanges/s`);
+    }
+}
+
+async function main(): Promise<void> {
+    const log = console.info;
+    console.info = () => {};
+
+    const socket = createDevice();
+    await measure("listener per byte", tx => exchangeByteWithListeners(socket, tx));
+
+    // Waits out the hello timeout before its first exchange
+    const client = new GameBoyClient(createDevice(), 0 /* sendDelayMs */);
+    await measure("queued exchanges", tx => client.exchangeByte(tx));
+
+    client.disconnect();
+    console.info = log;
+}
+
+main().catch((error: Error) => {
+    console.error(error.message);
+    process.exit(1);
+});
@@ -0,0 +1,90 @@
+// Connects clients to the matchmaker as fast as it will take them and reports
+// how long each join takes as the number of sessions grows to 100k. Half of
+// the clients ask for a public session and the other half bring join codes,
+// so both lookups are covered. Clients are stand-ins which never touch a
+// socket, so the figures are the matchmaker's own cost.
+//
+// Usage: npm run build && npm run bench:matchmaking
+
+import { EventEmitter } from "events";
+import { GameBoyClient, JoinRequest } from "../src/client";
+import { GameSession, stateHandler } from "../src/game-session";
+import { JOIN_CODE_LENGTH } from "../src/protocol";
+import { Matchmaker } from "../src/matchmaker";
+
+const SESSION_TARGET = 100000;
+const REPORT_INTERVAL = 10000;
+
+// Waits for players forever, so sessions pile up
+class LobbySession extends GameSession {
+    @stateHandler(0)
+    handleWaitingForPlayers() {}
+}
+
+function createClient(index: number): GameBoyClient {
+    const events = new EventEmitter();
+    const client = {
+        id: `bench:${index}`,
+        on: (event: string, listener: (...args: any[]) => void) => events.on(event, listener),
+        isConnected: () => true,
+        disconnect: () => events.emit("disconnect"),
+        setClockSource: () => Promise.resolve(),
+        setClockSpeed: () => Promise.resolve()
+    };
+
+    return client as unknown as GameBoyClient;
+}
+
+function createCode(index: number): string {
+    let code = "";
+    for (let i = 0; i < JOIN_CODE_LENGTH; ++i, index = Math.floor(index / 26)) {
+        code += String.fromCharCode(65 + (index % 26));
+    }
+    return code;
+}
+
+function percentile(sortedUs: number[], p: number): string {
+    return sortedUs[Math.min(sortedUs.length - 1, Math.floor(sortedUs.length * p / 100))].toFixed(1);
+}
+
+async function main(): Promise<void> {
+    const log = console.info;
+    console.info = () => {};
+
+    const matchmaker = new Matchmaker("lobby");
+    matchmaker.register("lobby", id => new LobbySession(id));
+
+    let joinTimesUs: number[] = [];
+    let nextReport = REPORT_INTERVAL;
+
+    // Two clients per session: the first creates it and the second fills it
+    for (let i = 0; matchmaker.sessionCount < SESSION_TARGET || i % 2 === 1; ++i) {
+        const pair = Math.floor(i / 2);
+        const request: JoinRequest = (pair % 2 === 0) ? {} : { code: createCode(pair) };
+
+        const start = process.hrtime.bigint();
+        await matchmaker.join(createClient(i), request);
+        joinTimesUs.push(Number(process.hrtime.bigint() - start) / 1000);
+
+        if (matchmaker.sessionCount >= nextReport && i % 2 === 1) {
+            joinTimesUs.sort((a, b) => a - b);
+            log(
+                `${matchmaker.sessionCount} sessions: join p50=${percentile(joinTimesUs, 50)} us ` +
+                `p99=${percentile(joinTimesUs, 99)} us max=${percentile(joinTimesUs, 100)} us`
+            );
+
+            joinTimesUs = [];
+            nextReport += REPORT_INTERVAL;
+        }
+    }
+
+    console.info = log;
+
+    // Sessions never end, so nothing else will stop the process
+    process.exit(0);
+}
+
+main().catch((error: Error) => {
+    console.error(error.message);
+    process.exit(1);
+});
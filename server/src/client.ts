@@ -1,6 +1,84 @@
 import { EventEmitter } from "events";
-import { Socket } from "net";
-import { sleep } from "./util";
+import { Duplex } from "stream";
+import {
+    ClockSource,
+    ClockSpeed,
+    DeviceCapability,
+    EXCHANGE_FLAG_STOP_ON_MATCH,
+    encodeMessage,
+    LATENCY_FLAG_RESET,
+    MAX_PAYLOAD_SIZE,
+    Message,
+    MessageReader,
+    MessageType,
+    RESPONDER_RULE_FLAG_STOP,
+    ResponderResult
+} from "./protocol";
+import { PendingExchanges } from "./pending-exchanges";
+import { decodeTelemetry, LATENCY_STAGE_SIZE, readLatencyStage, TelemetryReport } from "./telemetry";
+import { timerWheel } from "./timer-wheel";
+
+// Exchange message header: gap (4 bytes), flags (1 byte), stop value (1 byte)
+const EXCHANGE_HEADER_SIZE = 6;
+const MAX_EXCHANGE_SIZE = MAX_PAYLOAD_SIZE - EXCHANGE_HEADER_SIZE;
+
+// Responder message header: gap (4 bytes), timeout (4 bytes), initial value (1 byte)
+const RESPONDER_HEADER_SIZE = 9;
+const RESPONDER_RULE_SIZE = 3;
+
+// Responder result: result (1 byte), last received value (1 byte),
+// next value to send (1 byte), exchange count (4 bytes)
+const RESPONDER_RESULT_SIZE = 7;
+
+// One buffer per byte value, so sending a byte allocates nothing. They are
+// never modified, so sharing them while a write is queued is safe.
+const SINGLE_BYTE_BUFFERS = Array.from({ length: 256 }, (_, b) => Buffer.from([ b ]));
+
+// Percentiles of pacing error are taken over the most recent bytes only
+const PACING_SAMPLE_COUNT = 1024;
+
+/**
+ * How long a device spends in one stage of handling link requests.
+ */
+export interface LatencyStats {
+    stage: string;
+    count: number;
+    p50Us: number;
+    p95Us: number;
+    p99Us: number;
+    maxUs: number;
+}
+
+/**
+ * What a device asked to join, as set up by its owner. Devices running older
+ * firmware don't ask for anything.
+ */
+export interface JoinRequest {
+    /** Name of the game to play */
+    game?: string;
+
+    /** Code of a private session to join or create */
+    code?: string;
+}
+
+/**
+ * A message waiting for the device's response.
+ */
+interface PendingRequest {
+    type: MessageType;
+    resolve: (payload: Buffer) => void;
+    reject: (error: Error) => void;
+    timeoutMs: number;
+    deadlineMs: number;
+}
+
+/**
+ * Connection to a device. Either a TCP socket or a datagram stream.
+ */
+export type LinkSocket = Duplex & {
+    readonly remoteAddress?: string;
+    readonly remotePort?: number;
+};
 
 /**
  * Represents a Game Boy connected via a networked link cable.
@@ -10,13 +88,44 @@ export class GameBoyClient {
 
     private static readonly dataTimeoutMs = 10000;
 
+    // Devices that support framing say hello as soon as they connect
+    private static readonly helloTimeoutMs = 500;
+
+    // How long a device runs a responder before checking back in
+    private static readonly responderTimeoutMs = 5000;
+
     private lastReceivedByte: number = 0;
-    private lastSendTime: number = Date.now();
+    private lastSendTime: number = timerWheel.now();
     private eventEmitter: EventEmitter = new EventEmitter({ captureRejections: true });
 
-    constructor(private readonly socket: Socket, private sendDelayMs: number = 5) {
+    private capabilities: number = 0;
+    private joinRequest: JoinRequest = {};
+    private messageReader: MessageReader = new MessageReader();
+    private pendingRequests: PendingRequest[] = [];
+
+    // Devices without framing answer each byte as it is sent
+    private pendingExchanges: PendingExchanges = new PendingExchanges();
+
+    // Disconnects when the oldest request or exchange goes unanswered
+    private readonly deadlineTimer = timerWheel.createTimer(() => this.onDeadline());
+
+    // Spaces out bytes sent to devices without framing
+    private readonly pacingTimer = timerWheel.createTimer(() => this.onPacingTimer());
+    private pacingTargetMs: number = 0;
+    private writingByte: boolean = false;
+
+    // How late each paced byte was released, in microseconds
+    private readonly pacingErrorsUs = new Float64Array(PACING_SAMPLE_COUNT);
+    private pacingErrorCount: number = 0;
+    private pacingErrorMaxUs: number = 0;
+
+    private readonly ready: Promise<void>;
+    private isReady: boolean = false;
+
+    constructor(private readonly socket: LinkSocket, private sendDelayMs: number = 5) {
         this.id = `${socket.remoteAddress}:${socket.remotePort}`;
         this.onConnect();
+        this.ready = this.waitForHello();
     }
 
     private onConnect(): void {
@@ -28,6 +137,16 @@ export class GameBoyClient {
 
         this.socket.on("close", async () => {
             console.info(`Client '${this.id}' socket closed.`);
+
+            const error = new Error(`Client '${this.id}' disconnected before responding.`);
+            this.deadlineTimer.stop();
+            this.pendingExchanges.rejectAll(error);
+            for (const request of this.pendingRequests.splice(0)) {
+                request.reject(error);
+            }
+
+            this.pacingTimer.stop();
+
             this.eventEmitter.emit("disconnect");
         });
 
@@ -36,15 +155,327 @@ export class GameBoyClient {
         });
     }
 
-    private waitSendDelay(): Promise<void> {
+    private waitForHello(): Promise<void> {
+        return new Promise<void>(resolve => {
+            const finish = () => {
+                clearTimeout(timeout);
+                this.socket.removeListener("close", finish);
+                this.socket.removeListener("data", helloListener);
+                this.isReady = true;
+                resolve();
+            };
+
+            const finishUnframed = () => {
+                this.socket.on("data", (data: Buffer) => this.onByteData(data));
+                finish();
+            };
+
+            // Devices running older firmware never send anything unprompted
+            const timeout = setTimeout(() => {
+                if (this.messageReader.hasPendingData()) {
+                    console.warn(`Client '${this.id}' sent data before receiving any. Discarding.`);
+                    this.messageReader.drain();
+                }
+                finishUnframed();
+            }, GameBoyClient.helloTimeoutMs);
+
+            const helloListener = (data: Buffer) => {
+                this.messageReader.push(data);
+
+                const message = this.messageReader.next();
+                if (!message) {
+                    // Wait for the rest
+                    return;
+                }
+
+                if (message.type === MessageType.Hello && message.payload.length >= 5) {
+                    const version = message.payload.readUInt8(0);
+                    this.capabilities = message.payload.readUInt32LE(1);
+                    this.joinRequest = this.readJoinRequest(message.payload.subarray(5));
+                    console.info(
+                        `Client '${this.id}' supports protocol version ${version} ` +
+                        `(capabilities 0x${this.capabilities.toString(16)}).`
+                    );
+
+                    this.socket.on("data", (data: Buffer) => this.onMessageData(data));
+                    finish();
+                } else {
+                    console.warn(`Client '${this.id}' sent data before receiving any. Discarding.`);
+                    this.messageReader.drain();
+                    finishUnframed();
+                }
+            };
+
+            this.socket.once("close", finish);
+            this.socket.on("data", helloListener);
+        });
+    }
+
+    private readJoinRequest(data: Buffer): JoinRequest {
+        // Each string is a length (1 byte) followed by that many characters
+        const strings: string[] = [];
+        for (let offset = 0; offset < data.length && strings.length < 2; ) {
+            const length = data.readUInt8(offset);
+            strings.push(data.subarray(offset + 1, offset + 1 + length).toString("latin1"));
+            offset += 1 + length;
+        }
+
+        return {
+            game: strings[0] || undefined,
+            code: strings[1] || undefined
+        };
+    }
+
+    private onMessageData(data: Buffer): void {
+        this.messageReader.push(data);
+
+        let message: Message | undefined;
+        while ((message = this.messageReader.next())) {
+            if (message.type === MessageType.Received) {
+                // Sent whenever the Game Boy drives the clock, not in response to anything
+                this.eventEmitter.emit("receive", [...message.payload]);
+                continue;
+            }
+
+            if (message.type === MessageType.Telemetry) {
+                // Sent periodically once enabled, not in response to anything
+                const report = decodeTelemetry(message.payload);
+                if (report) {
+                    this.eventEmitter.emit("telemetry", report);
+                } else {
+                    console.warn(`Client '${this.id}' sent a malformed telemetry report. Discarding.`);
+                }
+                continue;
+            }
+
+            if (message.type === MessageType.Heartbeat) {
+                // Devices drop the connection if we stay quiet for too long
+                this.sendMessage(MessageType.Heartbeat, Buffer.alloc(0)).catch((err: Error) => {
+                    console.warn(`Failed to reply to heartbeat from client '${this.id}': ${err.message}`);
+                });
+                continue;
+            }
+
+            const request = this.pendingRequests.shift();
+            if (request) {
+                this.armRequestDeadline();
+
+                if (message.type !== request.type) {
+                    request.reject(new Error(`Client '${this.id}' sent message of type ${message.type} instead of ${request.type}.`));
+                } else {
+                    request.resolve(message.payload);
+                }
+            } else {
+                console.warn(`Client '${this.id}' sent unexpected message of type ${message.type}. Discarding.`);
+            }
+        }
+    }
+
+    private onByteData(data: Buffer): void {
+        // Several replies can arrive together
+        for (let i = 0; i < data.length; ++i) {
+            if (this.pendingExchanges.sentLength === 0) {
+                console.warn(`Client '${this.id}' sent data before receiving any. Discarding.`);
+                break;
+            }
+
+            this.lastReceivedByte = data[i];
+            this.pendingExchanges.resolveNext(data[i]);
+        }
+
+        if (this.pendingExchanges.length > 0) {
+            this.deadlineTimer.start(GameBoyClient.dataTimeoutMs);
+        } else {
+            this.deadlineTimer.stop();
+        }
+    }
+
+    private onByteWritten = (err?: Error | null): void => {
+        this.writingByte = false;
+
+        if (err) {
+            // Closing rejects every pending exchange
+            this.disconnect();
+        } else {
+            this.lastSendTime = timerWheel.now();
+            this.sendNextByte();
+        }
+    };
+
+    private sendNextByte(): void {
+        // The write callback or pacing timer sends the next byte
+        if (this.writingByte || this.pacingTimer.isScheduled || !this.pendingExchanges.hasUnsent()) {
+            return;
+        }
+
         // Account for connection latency in delay time
-        const sendDelta = Date.now() - this.lastSendTime;
-        const msToSleep = this.sendDelayMs - sendDelta;
+        const targetMs = this.lastSendTime + this.sendDelayMs;
+        if (targetMs > timerWheel.now()) {
+            this.pacingTargetMs = targetMs;
+            this.pacingTimer.startAt(targetMs);
+            return;
+        }
+
+        this.writeNextByte();
+    }
+
+    private writeNextByte(): void {
+        const tx = this.pendingExchanges.takeUnsent();
+        if (tx === undefined) {
+            return;
+        }
+
+        // Don't wait forever
+        this.deadlineTimer.start(GameBoyClient.dataTimeoutMs);
+
+        this.writingByte = true;
+        this.socket.write(SINGLE_BYTE_BUFFERS[tx], this.onByteWritten);
+    }
+
+    private onDeadline(): void {
+        const timeoutMs = this.pendingRequests[0]?.timeoutMs ?? GameBoyClient.dataTimeoutMs;
+        console.warn(`Client '${this.id}' did not respond within ${timeoutMs} ms. Disconnecting.`)
+        this.disconnect();
+    }
+
+    private armRequestDeadline(): void {
+        // Responses come in order, so only the oldest request can be overdue
+        if (this.pendingRequests.length > 0) {
+            this.deadlineTimer.startAt(this.pendingRequests[0].deadlineMs);
+        } else {
+            this.deadlineTimer.stop();
+        }
+    }
+
+    private onPacingTimer(): void {
+        const errorUs = (timerWheel.now() - this.pacingTargetMs) * 1000;
+
+        this.pacingErrorsUs[this.pacingErrorCount % PACING_SAMPLE_COUNT] = errorUs;
+        this.pacingErrorMaxUs = Math.max(this.pacingErrorMaxUs, errorUs);
+        ++this.pacingErrorCount;
+
+        this.writeNextByte();
+    }
+
+    private hasCapability(capability: DeviceCapability): boolean {
+        return (this.capabilities & capability) !== 0;
+    }
+
+    private sendMessage(type: MessageType, payload: Buffer): Promise<void> {
+        return new Promise<void>((resolve, reject) => {
+            this.socket.write(encodeMessage(type, payload), (err?: Error) => {
+                if (err) {
+                    reject(err);
+                } else {
+                    resolve();
+                }
+            });
+        });
+    }
+
+    /**
+     * Sends a message which the device answers with a message of the same type.
+     * @param type Type of message
+     * @param payload Message contents
+     * @param timeoutMs How long to wait for the response before disconnecting
+     * @returns The response payload
+     */
+    private request(type: MessageType, payload: Buffer, timeoutMs: number): Promise<Buffer> {
+        if (this.socket.destroyed) {
+            return Promise.reject(new Error(`Client '${this.id}' disconnected before responding.`));
+        }
+
+        return new Promise<Buffer>((resolve, reject) => {
+            const request: PendingRequest = {
+                type,
+                resolve,
+                reject,
+                timeoutMs,
+                deadlineMs: timerWheel.now() + timeoutMs
+            };
+
+            this.pendingRequests.push(request);
+            if (this.pendingRequests.length === 1) {
+                this.armRequestDeadline();
+            }
+
+            this.socket.write(encodeMessage(type, payload), (err?: Error) => {
+                const index = this.pendingRequests.indexOf(request);
+                if (err && index >= 0) {
+                    this.pendingRequests.splice(index, 1);
+                    this.armRequestDeadline();
+                    reject(err);
+                }
+            });
+        });
+    }
+
+    /**
+     * Sends bytes to the Game Boy in a single message and lets the device
+     * space them out according to the send delay.
+     * @param tx The values to send
+     * @param stopValue If specified, the device will stop sending once the
+     *                  Game Boy responds with this value
+     * @returns The bytes received from the Game Boy
+     */
+    private async exchangeBatch(tx: number[], stopValue?: number): Promise<number[]> {
+        const payload = Buffer.alloc(EXCHANGE_HEADER_SIZE + tx.length);
+        payload.writeUInt32LE(Math.round(this.sendDelayMs * 1000), 0);
+        payload.writeUInt8((stopValue !== undefined) ? EXCHANGE_FLAG_STOP_ON_MATCH : 0, 4);
+        payload.writeUInt8((stopValue || 0) & 0xFF, 5);
+        tx.forEach((b, i) => payload.writeUInt8(b & 0xFF, EXCHANGE_HEADER_SIZE + i));
+
+        // Don't wait forever, but account for the time the device spends sending
+        const timeoutMs = GameBoyClient.dataTimeoutMs + (tx.length * this.sendDelayMs);
+        const rx = [...await this.request(MessageType.Exchange, payload, timeoutMs)];
+
+        if (rx.length > 0) {
+            this.lastReceivedByte = rx[rx.length - 1];
+        }
+        return rx;
+    }
+
+    /**
+     * Has the device exchange bytes on its own until the Game Boy sends one
+     * of the stop values or the responder times out.
+     * @param initialTx The first value to send
+     * @param responses Pairs of [received, next value to send]
+     * @param stopValues Values which end the exchange
+     * @returns Whether or not a stop value was received, and the value the
+     *          device would have sent next
+     */
+    private async runResponder(
+        initialTx: number,
+        responses: [number, number][],
+        stopValues: number[]
+    ): Promise<{ stopped: boolean, nextTx: number }> {
+        const rules = [
+            ...responses.map(([rx, tx]) => [rx, tx, 0]),
+            ...stopValues.map(rx => [rx, 0, RESPONDER_RULE_FLAG_STOP])
+        ];
+
+        const payload = Buffer.alloc(RESPONDER_HEADER_SIZE + (rules.length * RESPONDER_RULE_SIZE));
+        payload.writeUInt32LE(Math.round(this.sendDelayMs * 1000), 0);
+        payload.writeUInt32LE(GameBoyClient.responderTimeoutMs, 4);
+        payload.writeUInt8(initialTx & 0xFF, 8);
+        rules.forEach((rule, i) => {
+            rule.forEach((b, j) => payload.writeUInt8(b & 0xFF, RESPONDER_HEADER_SIZE + (i * RESPONDER_RULE_SIZE) + j));
+        });
+
+        const timeoutMs = GameBoyClient.dataTimeoutMs + GameBoyClient.responderTimeoutMs;
+        const result = await this.request(MessageType.RunResponder, payload, timeoutMs);
 
-        if (msToSleep > 0) {
-            return sleep(msToSleep);
+        if (result.length < RESPONDER_RESULT_SIZE) {
+            throw new Error(`Client '${this.id}' sent a malformed responder result.`);
         }
-        return Promise.resolve();
+
+        if (result.readUInt32LE(3) > 0) {
+            this.lastReceivedByte = result.readUInt8(1);
+        }
+        return {
+            stopped: result.readUInt8(0) === ResponderResult.Stopped,
+            nextTx: result.readUInt8(2)
+        };
     }
 
     /**
@@ -52,7 +483,25 @@ export class GameBoyClient {
      * @param event Name of event
      * @param listener Event listener
      */
-    on(event: "disconnect", listener: () => void): void {
+    on(event: "disconnect", listener: () => void): void;
+
+    /**
+     * Adds a listener for bytes sent by the Game Boy while it drives the clock.
+     * @param event Name of event
+     * @param listener Event listener. Receives the bytes in the order they
+     *                 were sent.
+     */
+    on(event: "receive", listener: (bytes: number[]) => void): void;
+
+    /**
+     * Adds a listener for telemetry reports, once enabled with
+     * enableTelemetry().
+     * @param event Name of event
+     * @param listener Event listener
+     */
+    on(event: "telemetry", listener: (report: TelemetryReport) => void): void;
+
+    on(event: string, listener: (...args: any[]) => void): void {
         this.eventEmitter.on(event, listener);
     }
 
@@ -65,55 +514,165 @@ export class GameBoyClient {
     }
 
     /**
-     * Sends a byte to the Game Boy and returns the byte the Game Boy sent.
-     * @param tx The value to send (only the least significant byte will be used)
-     * @returns The byte received from the connected Game Boy
+     * Selects which side of the link drives the serial clock. Devices drive
+     * the clock by default.
+     * @param source The side which should drive the clock
+     * @param idleByte When the Game Boy drives the clock, the byte to send
+     *                 whenever no responses are queued
      */
-    async exchangeByte(tx: number): Promise<number> {
-        await this.waitSendDelay();
+    async setClockSource(source: ClockSource, idleByte: number = 0xFF): Promise<void> {
+        await this.ready;
 
-        return new Promise<number>((resolve, reject) => {
-            let sentByte = false;
+        if (!this.hasCapability(DeviceCapability.ExternalClock)) {
+            if (source !== ClockSource.Device) {
+                throw new Error(`Client '${this.id}' does not support being clocked by the Game Boy.`);
+            }
+            return;
+        }
 
-            // Don't wait forever
-            const timeout = setTimeout(() => {
-                console.warn(`Client '${this.id}' did not respond within ${GameBoyClient.dataTimeoutMs} ms. Disconnecting.`)
-                this.disconnect();
-            }, GameBoyClient.dataTimeoutMs);
+        const payload = Buffer.from([ source, idleByte & 0xFF ]);
+        return this.sendMessage(MessageType.SetClockSource, payload);
+    }
 
-            const cleanup = () => {
-                clearTimeout(timeout);
-                this.socket.removeListener("close", closeListener);
-                this.socket.removeListener("data", dataListener);
-            };
+    /**
+     * Sets the link clock speed used whenever the device drives the clock.
+     * Devices use the normal speed by default.
+     * @param speed The speed the Game Boy expects
+     */
+    async setClockSpeed(speed: ClockSpeed): Promise<void> {
+        await this.ready;
 
-            const closeListener = () => {
-                cleanup();
-                reject(new Error(`Client '${this.id}' disconnected before responding.`));
-            };
+        if (!this.hasCapability(DeviceCapability.ClockSpeed)) {
+            if (speed !== ClockSpeed.Normal) {
+                throw new Error(`Client '${this.id}' does not support changing the link clock speed.`);
+            }
+            return;
+        }
 
-            const dataListener = (data: Buffer) => {
-                if (sentByte) {
-                    cleanup();
-                    this.lastReceivedByte = data.readUInt8(0);
-                    resolve(this.lastReceivedByte);
-                } else {
-                    console.warn(`Client '${this.id}' sent data before receiving any. Discarding.`);
-                }
-            };
+        return this.sendMessage(MessageType.SetClockSpeed, Buffer.from([ speed ]));
+    }
 
-            this.socket.once("close", closeListener);
-            this.socket.on("data", dataListener);
+    /**
+     * Queues bytes to send the next times the Game Boy drives the clock.
+     * Bytes received in exchange are reported through the "receive" event.
+     * @param bytes The values to send (only the least significant byte of
+     *              each value will be used)
+     */
+    async queueResponses(bytes: number[]): Promise<void> {
+        for (let i = 0; i < bytes.length; i += MAX_PAYLOAD_SIZE) {
+            const chunk = bytes.slice(i, i + MAX_PAYLOAD_SIZE).map(b => b & 0xFF);
+            await this.sendMessage(MessageType.QueueResponses, Buffer.from(chunk));
+        }
+    }
 
-            this.socket.write(new Uint8Array([ tx & 0xFF ]), (err?: Error) => {
-                if (err) {
-                    cleanup();
-                    reject(err);
-                } else {
-                    sentByte = true;
-                    this.lastSendTime = Date.now();
-                }
-            });
+    /**
+     * Returns what the device asked to join once it has said hello.
+     */
+    async getJoinRequest(): Promise<JoinRequest> {
+        await this.ready;
+        return this.joinRequest;
+    }
+
+    /**
+     * Retrieves statistics about where the device spends its time when
+     * handling link requests.
+     * @param reset Whether the device should clear its statistics afterwards
+     * @returns Statistics for each stage, or an empty array if the device
+     *          doesn't collect them
+     */
+    async getLatencyStats(reset: boolean = false): Promise<LatencyStats[]> {
+        await this.ready;
+
+        if (!this.hasCapability(DeviceCapability.LatencyStats)) {
+            return [];
+        }
+
+        const payload = Buffer.from([ reset ? LATENCY_FLAG_RESET : 0 ]);
+        const response = await this.request(MessageType.GetLatency, payload, GameBoyClient.dataTimeoutMs);
+
+        // Stage count (1 byte), then LATENCY_STAGE_SIZE bytes per stage
+        const stageCount = Math.min(
+            response.readUInt8(0),
+            Math.floor((response.length - 1) / LATENCY_STAGE_SIZE)
+        );
+
+        const stats: LatencyStats[] = [];
+        for (let i = 0; i < stageCount; ++i) {
+            stats.push(readLatencyStage(response, 1 + (i * LATENCY_STAGE_SIZE), i));
+        }
+        return stats;
+    }
+
+    /**
+     * Retrieves statistics about how late the server sent bytes to devices
+     * without framing, compared to the send delay. Devices with framing
+     * space out bytes themselves, so have no samples.
+     * @param reset Whether to clear the statistics afterwards
+     * @returns Pacing error, with percentiles over the most recent bytes
+     */
+    getPacingStats(reset: boolean = false): LatencyStats {
+        const samples = this.pacingErrorsUs.slice(0, Math.min(this.pacingErrorCount, PACING_SAMPLE_COUNT)).sort();
+        const percentile = (p: number) => (samples.length > 0)
+            ? Math.round(samples[Math.min(samples.length - 1, Math.floor(samples.length * p / 100))])
+            : 0;
+
+        const stats: LatencyStats = {
+            stage: "server-pacing",
+            count: this.pacingErrorCount,
+            p50Us: percentile(50),
+            p95Us: percentile(95),
+            p99Us: percentile(99),
+            maxUs: Math.round(this.pacingErrorMaxUs)
+        };
+
+        if (reset) {
+            this.pacingErrorCount = 0;
+            this.pacingErrorMaxUs = 0;
+        }
+        return stats;
+    }
+
+    /**
+     * Asks the device to send telemetry reports periodically. Reports are
+     * delivered through the "telemetry" event. Devices which don't collect
+     * telemetry are left alone.
+     * @param intervalS Time between reports in seconds, or 0 to stop them
+     */
+    async enableTelemetry(intervalS: number): Promise<void> {
+        await this.ready;
+
+        if (!this.hasCapability(DeviceCapability.Telemetry)) {
+            return;
+        }
+
+        const payload = Buffer.alloc(2);
+        payload.writeUInt16LE(intervalS, 0);
+        return this.sendMessage(MessageType.Telemetry, payload);
+    }
+
+    /**
+     * Sends a byte to the Game Boy and returns the byte the Game Boy sent.
+     * @param tx The value to send (only the least significant byte will be used)
+     * @returns The byte received from the connected Game Boy
+     */
+    exchangeByte(tx: number): Promise<number> {
+        if (!this.isReady) {
+            return this.ready.then(() => this.exchangeByte(tx));
+        }
+
+        if (this.hasCapability(DeviceCapability.TimedExchange)) {
+            return this.exchangeBatch([tx]).then(rx => rx[0]);
+        }
+
+        if (this.socket.destroyed) {
+            return Promise.reject(new Error(`Client '${this.id}' disconnected before responding.`));
+        }
+
+        // The returned promise is the only allocation. The byte is sent once
+        // earlier bytes are out and the send delay has passed.
+        return new Promise<number>((resolve, reject) => {
+            this.pendingExchanges.push(tx, resolve, reject);
+            this.sendNextByte();
         });
     }
 
@@ -135,13 +694,66 @@ export class GameBoyClient {
         await this.exchangeByte(other.lastReceivedByte);
     }
 
+    /**
+     * Exchanges bytes with this Game Boy and the specified Game Boy, `other`,
+     * at the same time. Each is sent the byte the other sent in the previous
+     * exchange, so this takes one round trip instead of two but delivers
+     * every byte one exchange late.
+     * @param other The second Game Boy to communicate with
+     * @param onTransfer Optional callback to intercept the received values
+     */
+    async swapBytes(other: GameBoyClient, onTransfer?: (b1: number, b2: number) => void): Promise<void> {
+        // Both bytes are picked before either exchange starts
+        const [rx, otherRx] = await Promise.all([
+            this.exchangeByte(other.lastReceivedByte),
+            other.exchangeByte(this.lastReceivedByte)
+        ]);
+
+        if (onTransfer) {
+            onTransfer(rx, otherRx);
+        }
+    }
+
+    /**
+     * Repeatedly exchanges bytes with the Game Boy, changing what is sent
+     * based on what is received, until the Game Boy sends the stop value.
+     * Devices which support it do this locally instead of paying a round
+     * trip per byte.
+     * @param initialTx The first value to send
+     * @param responses Pairs of [received, next value to send]. If the Game
+     *                  Boy sends a value with no pair, the previous value is
+     *                  sent again.
+     * @param stopValue The value to wait for from the Game Boy
+     */
+    async respondUntil(initialTx: number, responses: [number, number][], stopValue: number): Promise<void> {
+        await this.ready;
+
+        let tx = initialTx;
+
+        if (this.hasCapability(DeviceCapability.LocalResponder)) {
+            // Responders time out periodically. Pick up where the last one left off.
+            let stopped = false;
+            while (!stopped) {
+                ({ stopped, nextTx: tx } = await this.runResponder(tx, responses, [stopValue]));
+            }
+            return;
+        }
+
+        const responseMap = new Map<number, number>(responses);
+        let rx: number;
+
+        while ((rx = await this.exchangeByte(tx)) !== stopValue) {
+            tx = responseMap.get(rx) ?? tx;
+        }
+    }
+
     /**
      * Repeatedly polls the Game Boy until it responds with the specified value.
      * @param pollValue The value to send in order to poll the Game Boy
      * @param waitValue The value to wait for from the Game Boy
      */
-    async waitForByte(pollValue: number, waitValue: number): Promise<void> {
-        while ((await this.exchangeByte(pollValue)) !== waitValue);
+    waitForByte(pollValue: number, waitValue: number): Promise<void> {
+        return this.respondUntil(pollValue, [], waitValue);
     }
 
     /**
@@ -151,6 +763,15 @@ export class GameBoyClient {
      * @returns The last value received from the Game Boy
      */
     async sendBuffer(buf: number[]): Promise<number> {
+        await this.ready;
+
+        if (this.hasCapability(DeviceCapability.TimedExchange)) {
+            for (let i = 0; i < buf.length; i += MAX_EXCHANGE_SIZE) {
+                await this.exchangeBatch(buf.slice(i, i + MAX_EXCHANGE_SIZE));
+            }
+            return this.lastReceivedByte;
+        }
+
         let rx = 0;
         for (const b of buf) {
             rx = await this.exchangeByte(b);
@@ -158,6 +779,13 @@ export class GameBoyClient {
         return rx;
     }
 
+    /**
+     * Returns whether the connection to the client is still open.
+     */
+    isConnected(): boolean {
+        return !this.socket.destroyed;
+    }
+
     /**
      * Closes the connection to the client.
      */
@@ -0,0 +1,280 @@
+import { createSocket, RemoteInfo, Socket } from "dgram";
+import { Duplex } from "stream";
+
+// Datagram header: stream ID (4 bytes), flags (1 byte), number of bytes
+// received from the peer (4 bytes), stream position of the data (4 bytes)
+const HEADER_SIZE = 13;
+
+const FLAG_SYN = 1 << 0;  // Opening the stream
+const FLAG_FIN = 1 << 1;  // Closing the stream
+
+// Keeps datagrams under the usual MTU
+const MAX_DATA_SIZE = 1024;
+
+// Unacknowledged data is sent again after this long without an acknowledgement
+const RETRANSMIT_INTERVAL_MS = 20;
+
+// Devices send heartbeats while idle, so a quiet stream has been abandoned
+const IDLE_TIMEOUT_MS = 30000;
+
+// Stream positions wrap around, so compare them by their distance
+function distance(from: number, to: number): number {
+    return (to - from) | 0;
+}
+
+/**
+ * Reliable, ordered byte stream carried over UDP. Every datagram repeats the
+ * bytes the peer has not acknowledged yet, up to the datagram size, so a lost
+ * datagram is normally made up for by the next one instead of stalling the
+ * stream until a retransmission. Matches the device's datagram_stream.c.
+ */
+export class DatagramStream extends Duplex {
+    public readonly remoteAddress: string;
+    public readonly remotePort: number;
+
+    // Sent data which hasn't been acknowledged. The first byte is at stream
+    // position txAcked.
+    private txBuffer: Buffer = Buffer.alloc(0);
+    private txAcked: number = 0;
+    private rxTotal: number = 0;
+
+    private retransmitTimer?: NodeJS.Timeout;
+    private idleTimer?: NodeJS.Timeout;
+
+    constructor(
+        private readonly socket: Socket,
+        remote: RemoteInfo,
+        public readonly streamId: number
+    ) {
+        super();
+        this.remoteAddress = remote.address;
+        this.remotePort = remote.port;
+        this.resetIdleTimer();
+    }
+
+    private resetIdleTimer(): void {
+        clearTimeout(this.idleTimer);
+        this.idleTimer = setTimeout(() => this.destroy(), IDLE_TIMEOUT_MS);
+    }
+
+    private send(flags: number, seq: number, dataLength: number): void {
+        const start = distance(this.txAcked, seq);
+        const datagram = Buffer.alloc(HEADER_SIZE + dataLength);
+
+        datagram.writeUInt32LE(this.streamId, 0);
+        datagram.writeUInt8(flags, 4);
+        datagram.writeUInt32LE(this.rxTotal >>> 0, 5);
+        datagram.writeUInt32LE(seq >>> 0, 9);
+        this.txBuffer.copy(datagram, HEADER_SIZE, start, start + dataLength);
+
+        // A datagram that can't be sent is no different from one that gets lost
+        this.socket.send(datagram, this.remotePort, this.remoteAddress, () => {});
+    }
+
+    private sendData(newest: boolean): void {
+        const dataLength = Math.min(this.txBuffer.length, MAX_DATA_SIZE);
+        const start = newest ? this.txBuffer.length - dataLength : 0;
+        this.send(0, this.txAcked + start, dataLength);
+
+        clearTimeout(this.retransmitTimer);
+        this.retransmitTimer = setTimeout(() => this.sendData(false), RETRANSMIT_INTERVAL_MS);
+    }
+
+    private handleAck(ack: number): void {
+        const ackedLength = distance(this.txAcked, ack);
+        if (ackedLength <= 0 || ackedLength > this.txBuffer.length) {
+            // Old or bogus
+            return;
+        }
+
+        this.txBuffer = this.txBuffer.subarray(ackedLength);
+        this.txAcked = ack;
+
+        if (this.txBuffer.length === 0) {
+            clearTimeout(this.retransmitTimer);
+        }
+    }
+
+    private handleData(seq: number, data: Buffer): void {
+        // Only bytes continuing from what was already received are kept.
+        // Anything past a gap will be sent again along with the missing bytes.
+        const offset = distance(seq, this.rxTotal);
+        if (offset < 0 || offset >= data.length) {
+            return;
+        }
+
+        const newData = data.subarray(offset);
+        this.rxTotal = (this.rxTotal + newData.length) | 0;
+        this.push(Buffer.from(newData));
+    }
+
+    /**
+     * Processes a datagram sent by the peer.
+     * @param datagram The entire datagram, including the header
+     */
+    receive(datagram: Buffer): void {
+        this.resetIdleTimer();
+
+        const flags = datagram.readUInt8(4);
+        if (flags & FLAG_SYN) {
+            // The device repeats this until it hears back
+            this.send(FLAG_SYN, this.txAcked, 0);
+            return;
+        }
+
+        if (flags & FLAG_FIN) {
+            this.push(null);
+            this.destroy();
+            return;
+        }
+
+        this.handleAck(datagram.readUInt32LE(5));
+
+        const data = datagram.subarray(HEADER_SIZE);
+        if (data.length > 0) {
+            this.handleData(datagram.readUInt32LE(9), data);
+
+            // Acknowledge right away so the device doesn't resend
+            this.send(0, this.txAcked, 0);
+        }
+    }
+
+    _read(): void {
+        // Data is pushed as it arrives
+    }
+
+    _write(chunk: Buffer, _encoding: BufferEncoding, callback: (error?: Error | null) => void): void {
+        for (let i = 0; i < chunk.length; i += MAX_DATA_SIZE) {
+            this.txBuffer = Buffer.concat([this.txBuffer, chunk.subarray(i, i + MAX_DATA_SIZE)]);
+
+            // Older unacknowledged bytes ride along with the new ones
+            this.sendData(true);
+        }
+        callback();
+    }
+
+    _destroy(error: Error | null, callback: (error?: Error | null) => void): void {
+        clearTimeout(this.retransmitTimer);
+        clearTimeout(this.idleTimer);
+
+        // Best effort. Devices notice a silent server on their own.
+        this.send(FLAG_FIN, this.txAcked, 0);
+        callback(error);
+    }
+}
+
+/**
+ * Accepts datagram streams from devices on a UDP port.
+ */
+export class DatagramServer {
+    private readonly socket: Socket = createSocket("udp4");
+    private readonly streams = new Map<string, DatagramStream>();
+
+    /**
+     * @param onConnection Called with each new stream
+     */
+    constructor(private readonly onConnection: (stream: DatagramStream) => void) {
+        this.socket.on("message", (datagram: Buffer, remote: RemoteInfo) => this.onMessage(datagram, remote));
+        this.socket.on("error", (err: Error) => {
+            console.error(`Error on datagram socket: ${err.message}`);
+        });
+    }
+
+    private onMessage(datagram: Buffer, remote: RemoteInfo): void {
+        if (datagram.length < HEADER_SIZE) {
+            return;
+        }
+
+        const streamId = datagram.readUInt32LE(0);
+        const key = `${remote.address}:${remote.port}`;
+
+        let stream = this.streams.get(key);
+        if (stream && stream.streamId !== streamId) {
+            // The device reconnected from the same port
+            stream.destroy();
+            stream = undefined;
+        }
+
+        if (!stream) {
+            if (!(datagram.readUInt8(4) & FLAG_SYN)) {
+                // Left over from a stream that was already closed
+                return;
+            }
+
+            const newStream = new DatagramStream(this.socket, remote, streamId);
+            newStream.on("close", () => {
+                if (this.streams.get(key) === newStream) {
+                    this.streams.delete(key);
+                }
+            });
+
+            this.streams.set(key, newStream);
+            this.onConnection(newStream);
+
+            stream = newStream;
+        }
+
+        stream.receive(datagram);
+    }
+
+    /**
+     * Starts accepting streams.
+     * @param port UDP port to listen on
+     * @param host Address to listen on
+     */
+    listen(port: number, host: string): void {
+        this.socket.bind(port, host);
+    }
+}
+
+/**
+ * Opens a stream to a `DatagramServer` the way a device does, so the
+ * transport can be exercised without one.
+ * @param port UDP port of the server
+ * @param host Address of the server
+ * @param timeoutMs How long to keep asking before giving up
+ */
+export function connectDatagramStream(port: number, host: string, timeoutMs: number): Promise<DatagramStream> {
+    return new Promise((resolve, reject) => {
+        const socket = createSocket("udp4");
+        const streamId = Math.floor(Math.random() * 0x100000000);
+        let stream: DatagramStream | undefined;
+
+        const syn = Buffer.alloc(HEADER_SIZE);
+        syn.writeUInt32LE(streamId, 0);
+        syn.writeUInt8(FLAG_SYN, 4);
+
+        // The request or its answer may be lost, so keep asking
+        const sendSyn = () => socket.send(syn, port, host, () => {});
+        const retry = setInterval(sendSyn, RETRANSMIT_INTERVAL_MS);
+        const timeout = setTimeout(() => {
+            clearInterval(retry);
+            socket.close();
+            reject(new Error(`Timed out connecting to ${host}:${port}`));
+        }, timeoutMs);
+
+        socket.on("message", (datagram: Buffer, remote: RemoteInfo) => {
+            if (datagram.length < HEADER_SIZE || datagram.readUInt32LE(0) !== streamId) {
+                return;
+            }
+
+            // The server answers every repeat of the request, so only the
+            // first answer opens the stream
+            const isSyn = (datagram.readUInt8(4) & FLAG_SYN) !== 0;
+            if (stream) {
+                if (!isSyn) {
+                    stream.receive(datagram);
+                }
+            } else if (isSyn) {
+                clearInterval(retry);
+                clearTimeout(timeout);
+
+                stream = new DatagramStream(socket, remote, streamId);
+                stream.on("close", () => socket.close());
+                resolve(stream);
+            }
+        });
+
+        sendSyn();
+    });
+}
@@ -1,21 +1,80 @@
 import { EventEmitter } from "events";
 import { GameBoyClient } from "./client";
+import { ClockSource, ClockSpeed } from "./protocol";
+import { timerWheel } from "./timer-wheel";
+
+/**
+ * How a game uses the link cable. Pushed to each client when it joins.
+ */
+export interface LinkProfile {
+    /**
+     * Which side of each client's link drives the serial clock. Games which
+     * refuse to use an external clock can let the Game Boy drive it.
+     */
+    clockSource: ClockSource;
+
+    /** Clock speed to use when the device drives the clock */
+    clockSpeed: ClockSpeed;
+}
+
+/** Suits original Game Boy games */
+export const DEFAULT_LINK_PROFILE: LinkProfile = {
+    clockSource: ClockSource.Device,
+    clockSpeed: ClockSpeed.Normal
+};
+
+/**
+ * How bytes are passed between clients by `forwardClientBytes()`.
+ */
+export enum ForwardingMode {
+    /**
+     * Exchange with the first Game Boy, then pass what it sent to the second.
+     * The second Game Boy gets the byte the first sent in the same exchange,
+     * at the cost of two round trips per byte.
+     */
+    Sequential,
+
+    /**
+     * Exchange with both Game Boys at once, each getting the byte the other
+     * sent in the previous exchange. Takes one round trip per byte, but only
+     * suits protocols which keep repeating their state, since every byte
+     * arrives one exchange late.
+     */
+    Concurrent
+}
+
+/**
+ * How a game state uses the link cable.
+ */
+export interface StateOptions {
+    /** Defaults to `ForwardingMode.Sequential` */
+    forwardingMode?: ForwardingMode;
+}
+
+interface StateHandler {
+    handler: Function;
+    options: StateOptions;
+}
 
 /**
  * Returns a decorator which registers a `GameSession` member function as the
  * handler for the specified state. Once registered, the handler will
- * automatically be called on each tick while the session is in the state.
+ * automatically be called while the session is in the state. A handler which
+ * returns without changing the state isn't called again until the session is
+ * woken by a client joining, a client receiving bytes or a deadline set with
+ * `wakeAfter()`.
  * @param state State to associate with the decorated function
+ * @param options How the state uses the link cable
  * @returns Decorator to register a `GameSession` member function as the
  *          handler for `state`
  */
-export function stateHandler(state: number) {
+export function stateHandler(state: number, options: StateOptions = {}) {
     return function (target: GameSession, _propertyKey: string, descriptor: PropertyDescriptor) {
         // Each GameSession subclass gets its own static state handler map
         if (!target.constructor.stateHandlers) {
-            target.constructor.stateHandlers = new Map<number, Function>();
+            target.constructor.stateHandlers = new Map<number, StateHandler>();
         }
-        target.constructor.stateHandlers.set(state, descriptor.value);
+        target.constructor.stateHandlers.set(state, { handler: descriptor.value, options });
     };
 }
 
@@ -28,7 +87,7 @@ export abstract class GameSession {
     declare ["constructor"]: typeof GameSession;
 
     // Initialized when the first handler is added by the decorator
-    declare static stateHandlers: Map<number, Function>;
+    declare static stateHandlers: Map<number, StateHandler>;
 
     /** Clients connected to the session */
     protected clients: GameBoyClient[] = [];
@@ -36,11 +95,28 @@ export abstract class GameSession {
     /** The current game state */
     protected state: number = 0;
 
+    /** How `forwardClientBytes()` passes bytes in the current state */
+    private forwardingMode: ForwardingMode = ForwardingMode.Sequential;
+
     private eventEmitter: EventEmitter = new EventEmitter({ captureRejections: true });
     private ended: boolean = false;
     private requiredClientCount: number;
 
-    constructor(public readonly id: string, requiredClientCount: number = 2) {
+    // Parked sessions wait for a wake-up instead of running their handler
+    private parked: boolean = false;
+    private wakePending: boolean = false;
+    private readonly wakeTimer = timerWheel.createTimer(() => this.wake());
+
+    /**
+     * @param id Unique identifier of the session
+     * @param requiredClientCount Number of clients needed to start the game
+     * @param linkProfile How the game uses the link cable
+     */
+    constructor(
+        public readonly id: string,
+        requiredClientCount: number = 2,
+        private readonly linkProfile: LinkProfile = DEFAULT_LINK_PROFILE
+    ) {
         this.requiredClientCount = requiredClientCount;
 
         this.eventEmitter.on("error", (error: Error) => {
@@ -51,12 +127,14 @@ export abstract class GameSession {
     }
 
     private async handleState(state: number): Promise<any> {
-        const handler = this.constructor.stateHandlers.get(state);
-        if (!handler) {
+        const stateHandler = this.constructor.stateHandlers.get(state);
+        if (!stateHandler) {
             // TODO: actual enum value name in error message
             throw new Error(`${this.constructor.name} has no handler for state '${state}'.`);
         }
-        return Promise.resolve(handler.apply(this));
+
+        this.forwardingMode = stateHandler.options.forwardingMode ?? ForwardingMode.Sequential;
+        return Promise.resolve(stateHandler.handler.apply(this));
     }
 
     private end(): void {
@@ -64,6 +142,7 @@ export abstract class GameSession {
             console.info(`Ending session '${this.id}'.`);
 
             this.ended = true;
+            this.wakeTimer.stop();
             this.clients.forEach(c => c.disconnect());
             this.clients = [];
 
@@ -71,6 +150,26 @@ export abstract class GameSession {
         }
     }
 
+    private wake(): void {
+        if (this.parked) {
+            this.parked = false;
+            setImmediate(() => this.run());
+        } else {
+            // Handled once the current handler returns
+            this.wakePending = true;
+        }
+    }
+
+    /**
+     * Wakes the session after a delay, so a handler which is waiting for
+     * time to pass is called again.
+     * @param delayMs Time in milliseconds until the session wakes, replacing
+     *                any earlier deadline
+     */
+    protected wakeAfter(delayMs: number): void {
+        this.wakeTimer.start(delayMs);
+    }
+
     /**
      * Returns whether or not enough clients to start the game have joined.
      */
@@ -80,7 +179,7 @@ export abstract class GameSession {
 
     /**
      * Exchanges a byte between session clients, as if the two devices were
-     * physically connected.
+     * physically connected. Uses the current state's forwarding mode.
      * @param onTransfer Optional callback to intercept the transferred values
      */
     protected forwardClientBytes(onTransfer?: (b1: number, b2: number) => void): Promise<void> {
@@ -90,9 +189,33 @@ export abstract class GameSession {
                 `Expected ${this.requiredClientCount}.`
             );
         }
+
+        if (this.forwardingMode === ForwardingMode.Concurrent) {
+            return this.clients[0].swapBytes(this.clients[1], onTransfer);
+        }
         return this.clients[0].forwardByte(this.clients[1], onTransfer);
     }
 
+    /**
+     * Logs where each client's device spends its time handling link
+     * requests and how closely the server kept to the send delay, then
+     * starts collecting fresh statistics. Useful for telling whether Wi-Fi,
+     * the link or the server is slowing a player down.
+     */
+    protected async logClientLatency(): Promise<void> {
+        await this.forAllClients(async c => {
+            const pacing = c.getPacingStats(true /* reset */);
+            const stages = await c.getLatencyStats(true /* reset */);
+
+            for (const stats of (pacing.count > 0) ? [...stages, pacing] : stages) {
+                console.info(
+                    `Client '${c.id}' ${stats.stage} latency (us): ` +
+                    `n=${stats.count} p50=${stats.p50Us} p95=${stats.p95Us} p99=${stats.p99Us} max=${stats.maxUs}`
+                );
+            }
+        });
+    }
+
     /**
      * Adds a listener for the specified event.
      * @param event Name of event
@@ -116,7 +239,20 @@ export abstract class GameSession {
             this.end();
         });
 
+        client.on("receive", () => this.wake());
+
         this.clients.push(client);
+        this.wake();
+
+        // Queued ahead of any exchanges, since those also wait for the client
+        // to be ready
+        try {
+            await client.setClockSource(this.linkProfile.clockSource);
+            await client.setClockSpeed(this.linkProfile.clockSpeed);
+        } catch (error) {
+            console.error(`Client '${client.id}' is incompatible with session '${this.id}': ${(error as Error).message}`);
+            client.disconnect();
+        }
     }
 
     /**
@@ -141,8 +277,21 @@ export abstract class GameSession {
      * Runs the state machine for the game session.
      */
     run(): void {
-        this.handleState(this.state).then(() => {
-            setImmediate(() => this.run());
+        const state = this.state;
+        this.wakePending = false;
+
+        this.handleState(state).then(() => {
+            if (this.ended) {
+                return;
+            }
+
+            // Park until something happens, rather than calling the handler
+            // again to find out nothing has changed
+            if (this.state === state && !this.wakePending) {
+                this.parked = true;
+            } else {
+                setImmediate(() => this.run());
+            }
         }).catch((error: Error) => {
             // Socket errors will occur naturally when the game ends
             if (!this.ended) {
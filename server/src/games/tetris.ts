@@ -1,4 +1,4 @@
-import { GameSession, stateHandler } from "../game-session";
+import { ForwardingMode, GameSession, stateHandler } from "../game-session";
 import { sleep } from "../util";
 
 enum TetrisGameState {
@@ -94,6 +94,7 @@ export class TetrisGameSession extends GameSession {
         this.client2WinCount = 0;
     }
 
+    // Called again each time a player joins
     @stateHandler(TetrisGameState.WaitingForPlayers)
     handleWaitingForPlayers() {
         if (this.requiredClientsHaveJoined()) {
@@ -106,17 +107,20 @@ export class TetrisGameSession extends GameSession {
         await this.forAllClients(async c => {
             c.setSendDelayMs(30);
 
-            await c.waitForByte(TetrisCtrlByte.Master, TetrisCtrlByte.Slave);
-
-            // Music selection
-            await c.waitForByte(this.musicType, TetrisCtrlByte.ReadyForMusic);
+            // Handshake and music selection, answered by the device where possible
+            await c.respondUntil(
+                TetrisCtrlByte.Master,
+                [[TetrisCtrlByte.Slave, this.musicType]],
+                TetrisCtrlByte.ReadyForMusic
+            );
             return c.exchangeByte(TetrisCtrlByte.ConfirmMusic);
         });
 
         this.state = TetrisGameState.DifficultySelection;
     }
 
-    @stateHandler(TetrisGameState.DifficultySelection)
+    // Both players' choices are repeated until confirmed
+    @stateHandler(TetrisGameState.DifficultySelection, { forwardingMode: ForwardingMode.Concurrent })
     async handleDifficultySelection() {
         this.reset();
 
@@ -150,8 +154,10 @@ export class TetrisGameSession extends GameSession {
 
         // Send global data
         await this.forAllClients(async c => {
-            // This is a lot of data, and timing requirements aren't as strict
-            c.setSendDelayMs(0);
+            // This is a lot of data, but the game still needs a little time
+            // between transfers. Without a delay, framed devices would clock
+            // the whole block out back to back.
+            c.setSendDelayMs(5);
 
             await c.waitForByte(TetrisCtrlByte.Master, TetrisCtrlByte.Slave);
             await c.sendBuffer(garbageLineData);
@@ -172,7 +178,8 @@ export class TetrisGameSession extends GameSession {
         this.state = TetrisGameState.Playing;
     }
 
-    @stateHandler(TetrisGameState.Playing)
+    // Each game sends its status over and over, so a byte of delay is harmless
+    @stateHandler(TetrisGameState.Playing, { forwardingMode: ForwardingMode.Concurrent })
     async handlePlaying() {
         // We can't send the game anything right away or it will freeze
         await sleep(500);
@@ -224,8 +231,8 @@ export class TetrisGameSession extends GameSession {
 
     @stateHandler(TetrisGameState.RoundOver)
     async handleRoundOver() {
-        // Give time to look at results
-        await sleep(10000);
+        // Give time to look at results. The link is idle, so check how it did.
+        await Promise.all([sleep(10000), this.logClientLatency()]);
 
         let expectedByte: number;
         let nextState: TetrisGameState;
@@ -0,0 +1,152 @@
+import { GameBoyClient, JoinRequest } from "./client";
+import { GameSession } from "./game-session";
+import { JOIN_CODE_LENGTH } from "./protocol";
+
+// 26^4 = 456976 possibilities. Public sessions get IDs of the same form, so
+// logs read the same, but can't be joined by them.
+const SESSION_ID_ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+const SESSION_ID_PATTERN = new RegExp(`^[A-Z]{${JOIN_CODE_LENGTH}}$`);
+
+/**
+ * Creates a session for a game.
+ * @param id Unique identifier of the session, which players can join it by
+ */
+export type SessionFactory = (id: string) => GameSession;
+
+/**
+ * Sessions of one game which are waiting for players.
+ */
+interface GameQueue {
+    create: SessionFactory;
+
+    // Sets iterate in insertion order, so the first is the longest waiting
+    joinable: Set<GameSession>;
+}
+
+/**
+ * A session which hasn't ended, and the queue of the game it plays.
+ */
+interface SessionEntry {
+    session: GameSession;
+    queue: GameQueue;
+}
+
+/**
+ * Puts clients into sessions. Clients are matched with strangers playing the
+ * same game unless they bring a join code, in which case they join the
+ * private session with that code, creating it if needed.
+ */
+export class Matchmaker {
+    private readonly games = new Map<string, GameQueue>();
+    private readonly publicSessions = new Map<string, SessionEntry>();
+    private readonly privateSessions = new Map<string, SessionEntry>();
+
+    /**
+     * @param defaultGame Game for clients which don't ask for one, or ask
+     *                    for one which isn't registered
+     */
+    constructor(private readonly defaultGame: string) {}
+
+    /** Number of sessions which haven't ended */
+    get sessionCount(): number {
+        return this.publicSessions.size + this.privateSessions.size;
+    }
+
+    private generateSessionId(): string {
+        let id: string;
+        do {
+            id = "";
+            for (let i = 0; i < JOIN_CODE_LENGTH; ++i) {
+                id += SESSION_ID_ALPHABET[Math.floor(Math.random() * SESSION_ID_ALPHABET.length)];
+            }
+        } while (this.publicSessions.has(id));
+
+        return id;
+    }
+
+    private getQueue(game: string | undefined, clientId: string): GameQueue {
+        const queue = this.games.get(game ?? this.defaultGame);
+        if (queue) {
+            return queue;
+        }
+
+        console.warn(`Client '${clientId}' asked for unknown game '${game}'. Using '${this.defaultGame}'.`);
+        return this.games.get(this.defaultGame)!;
+    }
+
+    private createSession(queue: GameQueue, id: string, isPrivate: boolean): SessionEntry {
+        const sessions = isPrivate ? this.privateSessions : this.publicSessions;
+        const session = queue.create(id);
+        session.on("end", () => {
+            console.info(`Session '${session.id}' ended.`);
+            sessions.delete(session.id);
+            queue.joinable.delete(session);
+        });
+
+        const entry = { session, queue };
+        sessions.set(id, entry);
+        if (!isPrivate) {
+            queue.joinable.add(session);
+        }
+
+        session.run();
+        return entry;
+    }
+
+    /**
+     * Makes a game available to clients.
+     * @param game Name clients ask for the game by
+     * @param create Creates a session of the game
+     */
+    register(game: string, create: SessionFactory): void {
+        this.games.set(game, { create, joinable: new Set() });
+    }
+
+    /**
+     * Adds a client to a session, as requested by the client.
+     * @param client The client to place
+     * @param request What the client asked to join
+     * @returns The session joined, or undefined if the client was turned away
+     */
+    async join(client: GameBoyClient, request: JoinRequest): Promise<GameSession | undefined> {
+        // Sessions only notice players leaving once they have joined
+        if (!client.isConnected()) {
+            return undefined;
+        }
+
+        const queue = this.getQueue(request.game, client.id);
+        let entry: SessionEntry | undefined;
+
+        const code = request.code?.toUpperCase();
+        if (code !== undefined && !SESSION_ID_PATTERN.test(code)) {
+            console.warn(`Client '${client.id}' sent invalid join code '${request.code}'. Finding a public session.`);
+        } else if (code !== undefined) {
+            // The code decides the game once the session exists
+            entry = this.privateSessions.get(code) ?? this.createSession(queue, code, true /* isPrivate */);
+            if (!entry.session.isJoinable()) {
+                console.warn(`Client '${client.id}' tried to join full session '${code}'. Disconnecting.`);
+                client.disconnect();
+                return undefined;
+            }
+        }
+
+        if (!entry) {
+            // Try to join an existing session first, then fall back to a new one
+            const [oldest] = queue.joinable;
+            entry = oldest
+                ? { session: oldest, queue }
+                : this.createSession(queue, this.generateSessionId(), false /* isPrivate */);
+        }
+
+        // The client is added before the first await, so a full session
+        // leaves the queue before anyone else can be matched with it
+        const { session } = entry;
+        const joined = session.addClient(client);
+        if (!session.isJoinable()) {
+            entry.queue.joinable.delete(session);
+        }
+
+        await joined;
+        return session;
+    }
+}
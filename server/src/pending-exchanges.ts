@@ -0,0 +1,125 @@
+// Grows by doubling, so this only matters for the first few exchanges
+const INITIAL_CAPACITY = 4;
+
+/**
+ * Byte exchanges waiting for the Game Boy's reply, oldest first. Devices
+ * without framing answer every byte with exactly one byte, so replies are
+ * matched to exchanges in order. Exchanges are queued before their byte is
+ * sent, so the send delay can be waited out without another promise. Kept in
+ * a ring so that queueing, sending and answering an exchange allocates
+ * nothing beyond the caller's promise.
+ */
+export class PendingExchanges {
+    private txs: Uint8Array = new Uint8Array(INITIAL_CAPACITY);
+    private resolvers: ((rx: number) => void)[] = new Array(INITIAL_CAPACITY);
+    private rejecters: ((error: Error) => void)[] = new Array(INITIAL_CAPACITY);
+    private start: number = 0;
+    private count: number = 0;
+    private sent: number = 0;
+
+    /** Number of exchanges waiting to be sent or for a reply */
+    get length(): number {
+        return this.count;
+    }
+
+    /** Number of exchanges whose byte has been sent */
+    get sentLength(): number {
+        return this.sent;
+    }
+
+    /** Whether any exchange is waiting for its byte to be sent */
+    hasUnsent(): boolean {
+        return this.sent < this.count;
+    }
+
+    private grow(): void {
+        const capacity = this.resolvers.length;
+        const txs = new Uint8Array(capacity * 2);
+        const resolvers = new Array(capacity * 2);
+        const rejecters = new Array(capacity * 2);
+
+        for (let i = 0; i < this.count; ++i) {
+            txs[i] = this.txs[(this.start + i) % capacity];
+            resolvers[i] = this.resolvers[(this.start + i) % capacity];
+            rejecters[i] = this.rejecters[(this.start + i) % capacity];
+        }
+
+        this.txs = txs;
+        this.resolvers = resolvers;
+        this.rejecters = rejecters;
+        this.start = 0;
+    }
+
+    private advance(): void {
+        // Don't hold on to settled promises
+        this.resolvers[this.start] = undefined!;
+        this.rejecters[this.start] = undefined!;
+        this.start = (this.start + 1) % this.resolvers.length;
+        --this.count;
+    }
+
+    /**
+     * Queues an exchange.
+     * @param tx The byte to send (only the least significant byte will be used)
+     * @param resolve Called with the Game Boy's reply
+     * @param reject Called if no reply will come
+     */
+    push(tx: number, resolve: (rx: number) => void, reject: (error: Error) => void): void {
+        if (this.count === this.resolvers.length) {
+            this.grow();
+        }
+
+        const index = (this.start + this.count) % this.resolvers.length;
+        this.txs[index] = tx & 0xFF;
+        this.resolvers[index] = resolve;
+        this.rejecters[index] = reject;
+        ++this.count;
+    }
+
+    /**
+     * Marks the oldest unsent exchange as sent.
+     * @returns The byte to send, or undefined if every exchange has been sent
+     */
+    takeUnsent(): number | undefined {
+        if (this.sent === this.count) {
+            return undefined;
+        }
+
+        const tx = this.txs[(this.start + this.sent) % this.resolvers.length];
+        ++this.sent;
+        return tx;
+    }
+
+    /**
+     * Answers the oldest sent exchange.
+     * @param rx The byte the Game Boy sent
+     * @returns Whether there was an exchange waiting for it
+     */
+    resolveNext(rx: number): boolean {
+        if (this.sent === 0) {
+            return false;
+        }
+
+        const resolve = this.resolvers[this.start];
+        this.advance();
+        --this.sent;
+
+        resolve(rx);
+        return true;
+    }
+
+    /**
+     * Fails every exchange, sent or not.
+     * @param error Passed to each exchange
+     */
+    rejectAll(error: Error): void {
+        this.sent = 0;
+
+        while (this.count > 0) {
+            const reject = this.rejecters[this.start];
+            this.advance();
+
+            reject(error);
+        }
+    }
+}
@@ -0,0 +1,207 @@
+/**
+ * Types of messages exchanged with devices that support framing. Each message
+ * consists of a 1 byte type, a 2 byte little-endian payload length, and the
+ * payload itself.
+ */
+export enum MessageType {
+    /** Device -> server: protocol version and capabilities */
+    Hello = 0x01,
+
+    /**
+     * Server -> device: bytes to send to the Game Boy.
+     * Device -> server: bytes received from the Game Boy.
+     */
+    Exchange = 0x02,
+
+    /** Server -> device: which side drives the link clock */
+    SetClockSource = 0x03,
+
+    /** Server -> device: bytes to send the next times the Game Boy drives the clock */
+    QueueResponses = 0x04,
+
+    /** Device -> server: bytes received while the Game Boy drives the clock */
+    Received = 0x05,
+
+    /**
+     * Server -> device: exchange bytes locally until a condition is met.
+     * Device -> server: what happened.
+     */
+    RunResponder = 0x06,
+
+    /**
+     * Device -> server: the connection is idle.
+     * Server -> device: reply to a heartbeat.
+     */
+    Heartbeat = 0x07,
+
+    /** Server -> device: link clock speed to use when the device drives the clock */
+    SetClockSpeed = 0x08,
+
+    /**
+     * Server -> device: request latency statistics.
+     * Device -> server: latency statistics.
+     */
+    GetLatency = 0x09,
+
+    /**
+     * Server -> device: how often to report telemetry.
+     * Device -> server: telemetry report, sent without being asked.
+     */
+    Telemetry = 0x0A
+}
+
+/**
+ * Features advertised by a device in its hello message.
+ */
+export enum DeviceCapability {
+    TimedExchange = 1 << 0,
+    ExternalClock = 1 << 1,
+    LocalResponder = 1 << 2,
+    ClockSpeed = 1 << 3,
+    LatencyStats = 1 << 4,
+    Telemetry = 1 << 5
+}
+
+/**
+ * Which side of a device's link drives the serial clock.
+ */
+export enum ClockSource {
+    /** The device drives the clock. The Game Boy must use an external clock. */
+    Device = 0,
+
+    /** The Game Boy drives the clock using its internal clock. */
+    GameBoy = 1
+}
+
+/**
+ * Link clock speeds supported by Game Boy models.
+ */
+export enum ClockSpeed {
+    /** 8 KHz. The only speed the original Game Boy supports. */
+    Normal = 0,
+
+    /** 16 KHz. Game Boy Color normal speed in double-speed mode. */
+    Double = 1,
+
+    /** 256 KHz. Game Boy Color high-speed mode. */
+    Fast = 2,
+
+    /** 512 KHz. Game Boy Color high-speed mode in double-speed mode. */
+    FastDouble = 3
+}
+
+/** Stop exchanging once the Game Boy sends the stop value */
+export const EXCHANGE_FLAG_STOP_ON_MATCH = 1 << 0;
+
+/** Stop and report as soon as the Game Boy sends the rule's value */
+export const RESPONDER_RULE_FLAG_STOP = 1 << 0;
+
+/**
+ * Outcomes of running a responder on a device.
+ */
+export enum ResponderResult {
+    Stopped = 0,
+    TimedOut = 1
+}
+
+/** Clear latency statistics after reporting them */
+export const LATENCY_FLAG_RESET = 1 << 0;
+
+/** Stages devices report latency statistics for, in the order they are sent */
+export const LATENCY_STAGES = [
+    "receive",
+    "link-wait",
+    "link",
+    "link-per-byte",
+    "send",
+    "server"
+];
+
+/** Counters devices include in telemetry reports, in the order they are sent */
+export const TELEMETRY_COUNTERS = [
+    "network-connects",
+    "network-drops",
+    "roams",
+    "server-connects"
+];
+
+/** Join codes sent in hello messages are always this many letters */
+export const JOIN_CODE_LENGTH = 4;
+
+export const HEADER_SIZE = 3;
+export const MAX_PAYLOAD_SIZE = 1024;
+
+export interface Message {
+    type: MessageType;
+    payload: Buffer;
+}
+
+/**
+ * Encodes a message for sending to a device.
+ * @param type Type of message
+ * @param payload Message contents
+ * @returns The framed message
+ */
+export function encodeMessage(type: MessageType, payload: Buffer): Buffer {
+    if (payload.length > MAX_PAYLOAD_SIZE) {
+        throw new Error(`Message payload of ${payload.length} bytes exceeds maximum of ${MAX_PAYLOAD_SIZE}.`);
+    }
+
+    const header = Buffer.alloc(HEADER_SIZE);
+    header.writeUInt8(type, 0);
+    header.writeUInt16LE(payload.length, 1);
+    return Buffer.concat([header, payload]);
+}
+
+/**
+ * Reassembles messages from a stream of received data.
+ */
+export class MessageReader {
+    private pending: Buffer = Buffer.alloc(0);
+
+    /**
+     * Returns whether or not there is received data which has not been
+     * returned as part of a message yet.
+     */
+    hasPendingData(): boolean {
+        return this.pending.length > 0;
+    }
+
+    /**
+     * Adds received data to the stream.
+     * @param data The received data
+     */
+    push(data: Buffer): void {
+        this.pending = (this.pending.length > 0) ? Buffer.concat([this.pending, data]) : data;
+    }
+
+    /**
+     * Removes and returns all pending data, whether or not it forms a message.
+     */
+    drain(): Buffer {
+        const data = this.pending;
+        this.pending = Buffer.alloc(0);
+        return data;
+    }
+
+    /**
+     * Returns the next complete message in the stream, if one has been received.
+     */
+    next(): Message | undefined {
+        if (this.pending.length < HEADER_SIZE) {
+            return undefined;
+        }
+
+        const length = this.pending.readUInt16LE(1);
+        if (this.pending.length < HEADER_SIZE + length) {
+            return undefined;
+        }
+
+        const message = {
+            type: this.pending.readUInt8(0),
+            payload: this.pending.subarray(HEADER_SIZE, HEADER_SIZE + length)
+        };
+        this.pending = this.pending.subarray(HEADER_SIZE + length);
+        return message;
+    }
+}
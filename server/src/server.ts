@@ -1,52 +1,52 @@
 import { Socket, Server } from "net";
-import { GameBoyClient } from "./client";
+import { GameBoyClient, LinkSocket } from "./client";
+import { DatagramServer } from "./datagram-stream";
 import { TetrisGameSession } from "./games/tetris";
-
-function generateSessionId(): string {
-    // 26^4 = 456976 possibilities
-    const alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-
-    let id = "";
-    for (let i = 0; i < 4; ++i) {
-        id += alphabet[Math.floor(Math.random() * alphabet.length)];
-    }
-
-    return id;
-}
+import { Matchmaker } from "./matchmaker";
+import { TelemetryStore } from "./telemetry";
 
 const SERVER_PORT = 1989;
 
-// Just Tetris, for now
-const sessions = new Map<string, TetrisGameSession>();
-
-const server = new Server(async (socket: Socket) => {
-    // Reduce latency
-    socket.setNoDelay(true);
-
-    const client = new GameBoyClient(socket);
+// How often devices report their health
+const TELEMETRY_INTERVAL_S = 30;
 
-    // Try to join an existing session first, then fall back to a new one
-    let session = [...sessions.values()].find(s => s.isJoinable());
-    if (!session) {
-        let id: string;
-        do {
-            id = generateSessionId();
-        } while (sessions.has(id));
+// Per device, across connections
+const telemetry = new TelemetryStore();
 
-        const newSession = new TetrisGameSession(id);
-        newSession.on("end", () => {
-            console.info(`Session '${newSession.id}' ended.`);
-            sessions.delete(newSession.id);
-        });
+const matchmaker = new Matchmaker("tetris");
+matchmaker.register("tetris", id => new TetrisGameSession(id));
 
-        sessions.set(id, newSession);
-        newSession.run();
+async function onConnection(socket: LinkSocket): Promise<void> {
+    const client = new GameBoyClient(socket);
 
-        session = newSession;
-    }
+    let deviceId: string | undefined;
+    client.on("telemetry", report => {
+        deviceId = report.deviceId;
+        telemetry.record(report);
+    });
+    client.on("disconnect", () => {
+        const device = deviceId ? telemetry.get(deviceId) : undefined;
+        if (device) {
+            console.info(TelemetryStore.summarize(device));
+        }
+    });
+    client.enableTelemetry(TELEMETRY_INTERVAL_S).catch((err: Error) => {
+        console.warn(`Failed to enable telemetry for client '${client.id}': ${err.message}`);
+    });
+
+    // Devices say which game and session they want in their hello
+    await matchmaker.join(client, await client.getJoinRequest());
+}
 
-    await session.addClient(client);
+const server = new Server((socket: Socket) => {
+    // Reduce latency
+    socket.setNoDelay(true);
+    return onConnection(socket);
 });
 
+// Same protocol, for devices configured to use UDP
+const datagramServer = new DatagramServer(stream => onConnection(stream));
+
 server.listen(SERVER_PORT, "0.0.0.0");
-console.info(`Listening on port ${SERVER_PORT}...`);
+datagramServer.listen(SERVER_PORT, "0.0.0.0");
+console.info(`Listening on port ${SERVER_PORT} (TCP and UDP)...`);
@@ -0,0 +1,267 @@
+import { LatencyStats } from "./client";
+import { LATENCY_STAGES, TELEMETRY_COUNTERS } from "./protocol";
+
+// Telemetry report: device ID (6 bytes), uptime (4 bytes), RSSI (1 byte),
+// free heap, lowest free heap and largest free block (4 bytes each), CPU use
+// (1 byte), then counter, stage and task counts (1 byte each)
+const TELEMETRY_HEADER_SIZE = 27;
+const TELEMETRY_COUNTER_SIZE = 4;
+
+// Per task: name (12 bytes), CPU use (1 byte), unused stack (2 bytes)
+const TELEMETRY_TASK_NAME_SIZE = 12;
+const TELEMETRY_TASK_SIZE = 15;
+
+/** Size of each stage's statistics: count, p50, p95, p99 and max (4 bytes each) */
+export const LATENCY_STAGE_SIZE = 20;
+
+// Thresholds for blaming a device's own surroundings for a player's lag
+const WEAK_RSSI = -70;
+const SLOW_LINK_WAIT_US = 20000;
+const LOW_HEAP_BYTES = 16 * 1024;
+
+/**
+ * CPU and stack use of one of a device's tasks.
+ */
+export interface TaskTelemetry {
+    name: string;
+    cpuPercent: number;
+    stackUnused: number;
+}
+
+/**
+ * Health report sent periodically by a device.
+ */
+export interface TelemetryReport {
+    /** Wi-Fi MAC address, which stays the same across connections */
+    deviceId: string;
+    uptimeS: number;
+    /** Undefined when not connected to Wi-Fi */
+    rssi?: number;
+    heapFree: number;
+    heapMinFree: number;
+    heapLargestBlock: number;
+    cpuBusyPercent: number;
+    /** Counted since the device started */
+    counters: Map<string, number>;
+    /** Latency of each stage since the device started, or since it was last reset */
+    stages: LatencyStats[];
+    /** Busiest tasks since the previous report */
+    tasks: TaskTelemetry[];
+}
+
+/**
+ * Reads one stage of latency statistics.
+ * @param buffer Buffer containing the statistics
+ * @param offset Where the stage starts in the buffer
+ * @param index Position of the stage in the list of stages
+ */
+export function readLatencyStage(buffer: Buffer, offset: number, index: number): LatencyStats {
+    return {
+        stage: LATENCY_STAGES[index] ?? `stage-${index}`,
+        count: buffer.readUInt32LE(offset),
+        p50Us: buffer.readUInt32LE(offset + 4),
+        p95Us: buffer.readUInt32LE(offset + 8),
+        p99Us: buffer.readUInt32LE(offset + 12),
+        maxUs: buffer.readUInt32LE(offset + 16)
+    };
+}
+
+/**
+ * Decodes a telemetry report sent by a device.
+ * @param payload The message payload
+ * @returns The report, or undefined if the payload is malformed
+ */
+export function decodeTelemetry(payload: Buffer): TelemetryReport | undefined {
+    if (payload.length < TELEMETRY_HEADER_SIZE) {
+        return undefined;
+    }
+
+    const counterCount = payload.readUInt8(24);
+    const stageCount = payload.readUInt8(25);
+    const taskCount = payload.readUInt8(26);
+
+    const expectedLength = TELEMETRY_HEADER_SIZE +
+        (counterCount * TELEMETRY_COUNTER_SIZE) +
+        (stageCount * LATENCY_STAGE_SIZE) +
+        (taskCount * TELEMETRY_TASK_SIZE);
+    if (payload.length < expectedLength) {
+        return undefined;
+    }
+
+    const rssi = payload.readInt8(10);
+    const report: TelemetryReport = {
+        deviceId: [...payload.subarray(0, 6)].map(b => b.toString(16).padStart(2, "0")).join(":"),
+        uptimeS: payload.readUInt32LE(6),
+        rssi: (rssi !== 0) ? rssi : undefined,
+        heapFree: payload.readUInt32LE(11),
+        heapMinFree: payload.readUInt32LE(15),
+        heapLargestBlock: payload.readUInt32LE(19),
+        cpuBusyPercent: payload.readUInt8(23),
+        counters: new Map(),
+        stages: [],
+        tasks: []
+    };
+
+    let offset = TELEMETRY_HEADER_SIZE;
+    for (let i = 0; i < counterCount; ++i, offset += TELEMETRY_COUNTER_SIZE) {
+        report.counters.set(TELEMETRY_COUNTERS[i] ?? `counter-${i}`, payload.readUInt32LE(offset));
+    }
+
+    for (let i = 0; i < stageCount; ++i, offset += LATENCY_STAGE_SIZE) {
+        report.stages.push(readLatencyStage(payload, offset, i));
+    }
+
+    for (let i = 0; i < taskCount; ++i, offset += TELEMETRY_TASK_SIZE) {
+        const name = payload.subarray(offset, offset + TELEMETRY_TASK_NAME_SIZE).toString("latin1");
+        report.tasks.push({
+            name: name.split("\0")[0],
+            cpuPercent: payload.readUInt8(offset + TELEMETRY_TASK_NAME_SIZE),
+            stackUnused: payload.readUInt16LE(offset + TELEMETRY_TASK_NAME_SIZE + 1)
+        });
+    }
+
+    return report;
+}
+
+/**
+ * Everything heard from one device, across all of its connections.
+ */
+export interface DeviceTelemetry {
+    deviceId: string;
+    reportCount: number;
+    firstReportTime: number;
+    lastReport: TelemetryReport;
+    /** Number of times the device restarted between reports */
+    restarts: number;
+    rssiMin?: number;
+    rssiMax?: number;
+    rssiSum: number;
+    rssiCount: number;
+    cpuBusyMax: number;
+    heapMinFree: number;
+    /** Counters totalled across restarts */
+    counterTotals: Map<string, number>;
+    /** Worst p99 seen for each stage */
+    worstP99Us: Map<string, number>;
+}
+
+/**
+ * Collects telemetry reports and aggregates them per device, so players
+ * whose lag comes from their own Wi-Fi or device can be told apart from
+ * problems with the server.
+ */
+export class TelemetryStore {
+    private readonly devices = new Map<string, DeviceTelemetry>();
+
+    /**
+     * Adds a report to its device's totals.
+     * @param report A report sent by a device
+     * @returns The device's updated totals
+     */
+    record(report: TelemetryReport): DeviceTelemetry {
+        let device = this.devices.get(report.deviceId);
+        if (!device) {
+            device = {
+                deviceId: report.deviceId,
+                reportCount: 0,
+                firstReportTime: Date.now(),
+                lastReport: report,
+                restarts: 0,
+                rssiSum: 0,
+                rssiCount: 0,
+                cpuBusyMax: 0,
+                heapMinFree: report.heapMinFree,
+                counterTotals: new Map(),
+                worstP99Us: new Map()
+            };
+            this.devices.set(report.deviceId, device);
+        }
+
+        // Counters start over when the device restarts
+        const restarted = report.uptimeS < device.lastReport.uptimeS;
+        const previousCounters = (device.reportCount > 0 && !restarted) ? device.lastReport.counters : new Map();
+        if (restarted) {
+            ++device.restarts;
+        }
+
+        for (const [name, value] of report.counters) {
+            const increase = value - (previousCounters.get(name) ?? 0);
+            device.counterTotals.set(name, (device.counterTotals.get(name) ?? 0) + Math.max(increase, 0));
+        }
+
+        if (report.rssi !== undefined) {
+            device.rssiMin = Math.min(device.rssiMin ?? report.rssi, report.rssi);
+            device.rssiMax = Math.max(device.rssiMax ?? report.rssi, report.rssi);
+            device.rssiSum += report.rssi;
+            ++device.rssiCount;
+        }
+
+        for (const stage of report.stages) {
+            device.worstP99Us.set(stage.stage, Math.max(device.worstP99Us.get(stage.stage) ?? 0, stage.p99Us));
+        }
+
+        device.cpuBusyMax = Math.max(device.cpuBusyMax, report.cpuBusyPercent);
+        device.heapMinFree = Math.min(device.heapMinFree, report.heapMinFree);
+        device.lastReport = report;
+        ++device.reportCount;
+
+        return device;
+    }
+
+    /**
+     * Returns the totals for a device, if it has sent any reports.
+     * @param deviceId The device's Wi-Fi MAC address
+     */
+    get(deviceId: string): DeviceTelemetry | undefined {
+        return this.devices.get(deviceId);
+    }
+
+    /**
+     * Lists likely causes of lag on the device's side of the connection.
+     * @param device Totals for the device
+     * @returns Short descriptions of each problem, empty if none were seen
+     */
+    static findLocalProblems(device: DeviceTelemetry): string[] {
+        const problems: string[] = [];
+
+        if (device.rssiCount > 0 && device.rssiSum / device.rssiCount < WEAK_RSSI) {
+            problems.push("weak Wi-Fi signal");
+        }
+
+        if ((device.counterTotals.get("network-drops") ?? 0) > 0) {
+            problems.push("Wi-Fi connection dropped");
+        }
+
+        if ((device.worstP99Us.get("link-wait") ?? 0) > SLOW_LINK_WAIT_US) {
+            problems.push("slow to start link exchanges");
+        }
+
+        if (device.heapMinFree > 0 && device.heapMinFree < LOW_HEAP_BYTES) {
+            problems.push("low on memory");
+        }
+
+        if (device.restarts > 0) {
+            problems.push("restarted");
+        }
+
+        return problems;
+    }
+
+    /**
+     * Describes a device's totals in one line.
+     * @param device Totals for the device
+     */
+    static summarize(device: DeviceTelemetry): string {
+        const rssi = (device.rssiCount > 0)
+            ? `RSSI ${Math.round(device.rssiSum / device.rssiCount)} dBm (${device.rssiMin} to ${device.rssiMax})`
+            : "RSSI unknown";
+        const counters = [...device.counterTotals].map(([name, value]) => `${name} ${value}`).join(", ");
+        const stages = [...device.worstP99Us].map(([name, value]) => `${name} ${value}`).join(", ");
+        const problems = TelemetryStore.findLocalProblems(device);
+
+        return `Device ${device.deviceId}: ${device.reportCount} reports, ${rssi}, ` +
+            `${counters}, worst p99 (us): ${stages}, peak CPU ${device.cpuBusyMax}%, ` +
+            `lowest free heap ${device.heapMinFree} bytes` +
+            ((problems.length > 0) ? `. Likely local problems: ${problems.join(", ")}.` : ".");
+    }
+}
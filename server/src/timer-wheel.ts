@@ -0,0 +1,274 @@
+// Level 0 has one slot per tick. Each slot of a higher level spans a whole
+// turn of the level below it, so three levels cover about 17 minutes and
+// anything later waits in an overflow list.
+const LEVEL_BITS = [8, 6, 6];
+const TICK_MS = 1;
+
+const LEVEL_SHIFTS = LEVEL_BITS.map((_, i) => LEVEL_BITS.slice(0, i).reduce((sum, bits) => sum + bits, 0));
+const WHEEL_BITS = LEVEL_BITS.reduce((sum, bits) => sum + bits, 0);
+
+// Marks a timer waiting in the overflow list
+const OVERFLOW_LEVEL = LEVEL_BITS.length;
+
+/**
+ * A callback which can be scheduled on a `TimerWheel` any number of times.
+ * Create one per purpose and reuse it, so scheduling allocates nothing.
+ */
+export class WheelTimer {
+    // Managed by the wheel. Timers in the same slot form a linked list.
+    deadlineMs: number = 0;
+    level: number = -1;
+    slot: number = 0;
+    prev?: WheelTimer;
+    next?: WheelTimer;
+
+    constructor(private readonly wheel: TimerWheel, readonly callback: () => void) {}
+
+    /** Whether the timer is waiting to fire */
+    get isScheduled(): boolean {
+        return this.level >= 0;
+    }
+
+    /**
+     * Schedules the timer, replacing any earlier schedule.
+     * @param delayMs Milliseconds from now until the callback runs
+     */
+    start(delayMs: number): void {
+        this.startAt(this.wheel.now() + delayMs);
+    }
+
+    /**
+     * Schedules the timer, replacing any earlier schedule.
+     * @param deadlineMs When the callback should run, in `TimerWheel.now()` time
+     */
+    startAt(deadlineMs: number): void {
+        this.wheel.schedule(this, deadlineMs);
+    }
+
+    /**
+     * Cancels the timer if it is scheduled.
+     */
+    stop(): void {
+        this.wheel.cancel(this);
+    }
+}
+
+/**
+ * Hierarchical timer wheel driven by one Node timer and a high-resolution
+ * clock. Scheduling and cancelling take constant time, and timers fire no
+ * earlier than their deadline and usually within a millisecond or two of it.
+ */
+export class TimerWheel {
+    private readonly epoch: bigint = process.hrtime.bigint();
+    private readonly levels: (WheelTimer | undefined)[][] = LEVEL_BITS.map(bits => new Array(1 << bits));
+    private overflow?: WheelTimer;
+    private currentTick: number = 0;
+    private count: number = 0;
+
+    private driver?: NodeJS.Timeout;
+    private driverDeadlineMs: number = Infinity;
+
+    /**
+     * Returns the time in milliseconds, with sub-millisecond precision.
+     * Only meaningful relative to other values from the same wheel.
+     */
+    now(): number {
+        return Number(process.hrtime.bigint() - this.epoch) / 1e6;
+    }
+
+    /**
+     * Creates a timer which runs a callback each time it fires.
+     * @param callback Function to call
+     */
+    createTimer(callback: () => void): WheelTimer {
+        return new WheelTimer(this, callback);
+    }
+
+    private getListHead(level: number, slot: number): WheelTimer | undefined {
+        return (level === OVERFLOW_LEVEL) ? this.overflow : this.levels[level][slot];
+    }
+
+    private setListHead(level: number, slot: number, timer: WheelTimer | undefined): void {
+        if (level === OVERFLOW_LEVEL) {
+            this.overflow = timer;
+        } else {
+            this.levels[level][slot] = timer;
+        }
+    }
+
+    private insert(timer: WheelTimer): void {
+        const tick = Math.max(Math.floor(timer.deadlineMs / TICK_MS), this.currentTick);
+
+        // The lowest level whose current turn includes the deadline
+        let level = 0;
+        while (level < LEVEL_BITS.length &&
+               (tick >> (LEVEL_SHIFTS[level] + LEVEL_BITS[level])) !==
+               (this.currentTick >> (LEVEL_SHIFTS[level] + LEVEL_BITS[level]))) {
+            ++level;
+        }
+
+        const slot = (level === OVERFLOW_LEVEL) ? 0 : (tick >> LEVEL_SHIFTS[level]) & ((1 << LEVEL_BITS[level]) - 1);
+        const head = this.getListHead(level, slot);
+
+        timer.level = level;
+        timer.slot = slot;
+        timer.prev = undefined;
+        timer.next = head;
+        if (head) {
+            head.prev = timer;
+        }
+        this.setListHead(level, slot, timer);
+    }
+
+    private remove(timer: WheelTimer): void {
+        if (timer.prev) {
+            timer.prev.next = timer.next;
+        } else {
+            this.setListHead(timer.level, timer.slot, timer.next);
+        }
+
+        if (timer.next) {
+            timer.next.prev = timer.prev;
+        }
+
+        timer.level = -1;
+        timer.prev = undefined;
+        timer.next = undefined;
+    }
+
+    // Moves every timer in a slot down to where it belongs now
+    private cascade(level: number, slot: number): void {
+        let timer = this.getListHead(level, slot);
+        this.setListHead(level, slot, undefined);
+
+        while (timer) {
+            const next = timer.next;
+            this.insert(timer);
+            timer = next;
+        }
+    }
+
+    // Fires the timers in the current slot which are due
+    private fireDue(nowMs: number): void {
+        let timer = this.levels[0][this.currentTick & ((1 << LEVEL_BITS[0]) - 1)];
+
+        while (timer) {
+            const next = timer.next;
+            if (timer.deadlineMs <= nowMs) {
+                this.remove(timer);
+                --this.count;
+                timer.callback();
+            }
+            timer = next;
+        }
+    }
+
+    private advance(nowMs: number): void {
+        const targetTick = Math.floor(nowMs / TICK_MS);
+
+        if (this.count === 0) {
+            this.currentTick = Math.max(this.currentTick, targetTick);
+            return;
+        }
+
+        this.fireDue(nowMs);
+        while (this.currentTick < targetTick && this.count > 0) {
+            ++this.currentTick;
+
+            if ((this.currentTick & ((1 << WHEEL_BITS) - 1)) === 0) {
+                this.cascade(OVERFLOW_LEVEL, 0);
+            }
+
+            // Higher levels first, since they can cascade into lower ones
+            for (let level = LEVEL_BITS.length - 1; level > 0; --level) {
+                if ((this.currentTick & ((1 << LEVEL_SHIFTS[level]) - 1)) === 0) {
+                    this.cascade(level, (this.currentTick >> LEVEL_SHIFTS[level]) & ((1 << LEVEL_BITS[level]) - 1));
+                }
+            }
+
+            this.fireDue(nowMs);
+        }
+
+        this.currentTick = Math.max(this.currentTick, targetTick);
+    }
+
+    // Earliest time anything could need doing
+    private getNextDeadline(): number {
+        const slotCount = 1 << LEVEL_BITS[0];
+        const turnEnd = (this.currentTick | (slotCount - 1)) + 1;
+
+        for (let tick = this.currentTick; tick < turnEnd; ++tick) {
+            let earliest = Infinity;
+            for (let timer = this.levels[0][tick & (slotCount - 1)]; timer; timer = timer.next) {
+                earliest = Math.min(earliest, timer.deadlineMs);
+            }
+
+            if (earliest !== Infinity) {
+                return earliest;
+            }
+        }
+
+        // Nothing until the next slot of a higher level is cascaded
+        return turnEnd * TICK_MS;
+    }
+
+    private run(): void {
+        this.driver = undefined;
+        this.driverDeadlineMs = Infinity;
+
+        this.advance(this.now());
+        if (this.count > 0) {
+            this.arm(this.getNextDeadline());
+        }
+    }
+
+    // Makes sure the wheel runs by the deadline
+    private arm(deadlineMs: number): void {
+        if (deadlineMs >= this.driverDeadlineMs) {
+            return;
+        }
+
+        // Node can fire a timer a fraction of a millisecond early. Nothing
+        // fires before its deadline, so run() then just arms again.
+        clearTimeout(this.driver);
+        this.driverDeadlineMs = deadlineMs;
+        this.driver = setTimeout(() => this.run(), Math.max(0, Math.ceil(deadlineMs - this.now())));
+    }
+
+    /**
+     * Schedules a timer, replacing any earlier schedule. Prefer
+     * `WheelTimer.start()`.
+     * @param timer The timer to schedule
+     * @param deadlineMs When the timer should fire, in `now()` time
+     */
+    schedule(timer: WheelTimer, deadlineMs: number): void {
+        this.cancel(timer);
+
+        // Nothing advances the wheel while it's empty, so catch up rather
+        // than walking the whole idle period tick by tick on the next run
+        if (this.count === 0) {
+            this.currentTick = Math.max(this.currentTick, Math.floor(this.now() / TICK_MS));
+        }
+
+        timer.deadlineMs = deadlineMs;
+        this.insert(timer);
+        ++this.count;
+
+        // Only an earlier deadline than any so far changes when to run
+        this.arm(deadlineMs);
+    }
+
+    /**
+     * Cancels a timer if it is scheduled. Prefer `WheelTimer.stop()`.
+     * @param timer The timer to cancel
+     */
+    cancel(timer: WheelTimer): void {
+        if (timer.isScheduled) {
+            this.remove(timer);
+            --this.count;
+        }
+    }
+}
+
+/** Shared by every client, so there is one Node timer however many are connected */
+export const timerWheel = new TimerWheel();
@@ -0,0 +1,150 @@
+// Checks that the UDP transport delivers every byte intact and in order, and
+// that its tail latency beats TCP's when packets are lost. Messages the size
+// of a link exchange are echoed back one at a time over localhost, the way a
+// session talks to a device.
+//
+// Loss and delay are injected on the loopback interface, since TCP's own
+// recovery is what UDP is being compared against:
+//
+//   sudo tc qdisc add dev lo root netem delay 5ms loss 2%
+//   TRANSPORT_TEST_LOSSY=1 npm test
+//   sudo tc qdisc del dev lo root
+//
+// Without TRANSPORT_TEST_LOSSY, only delivery is checked and the latencies
+// are just reported, since on a clean loopback both are well under a
+// millisecond.
+//
+// Usage: npm run build && npm test
+
+import { AddressInfo, createConnection, createServer, Socket } from "net";
+import { Duplex } from "stream";
+import { connectDatagramStream, DatagramServer } from "../src/datagram-stream";
+
+const MESSAGE_SIZE = 16;
+const MESSAGE_COUNT = 1000;
+const CONNECT_TIMEOUT_MS = 5000;
+
+// The datagram server can't report which port it was given, so pick one
+const UDP_PORT = 19891;
+
+interface LatencySummary {
+    p50: number;
+    p99: number;
+    max: number;
+}
+
+function createMessage(index: number): Buffer {
+    const message = Buffer.alloc(MESSAGE_SIZE);
+    for (let i = 0; i < MESSAGE_SIZE; ++i) {
+        message[i] = (index * 31 + i) & 0xFF;
+    }
+    return message;
+}
+
+function echo(stream: Duplex): void {
+    stream.on("data", (data: Buffer) => stream.write(data));
+    stream.on("error", () => {});
+}
+
+function readExactly(stream: Duplex, length: number, pending: Buffer[]): Promise<Buffer> {
+    return new Promise((resolve, reject) => {
+        const tryResolve = () => {
+            const buffered = Buffer.concat(pending);
+            if (buffered.length < length) {
+                return false;
+            }
+
+            pending.length = 0;
+            if (buffered.length > length) {
+                pending.push(buffered.subarray(length));
+            }
+
+            stream.removeListener("data", onData);
+            stream.removeListener("close", onClose);
+            resolve(buffered.subarray(0, length));
+            return true;
+        };
+
+        const onData = (data: Buffer) => {
+            pending.push(data);
+            tryResolve();
+        };
+
+        const onClose = () => {
+            stream.removeListener("data", onData);
+            reject(new Error("Stream closed before the echo arrived"));
+        };
+
+        if (!tryResolve()) {
+            stream.on("data", onData);
+            stream.once("close", onClose);
+        }
+    });
+}
+
+function summarize(latenciesMs: number[]): LatencySummary {
+    const sorted = [...latenciesMs].sort((a, b) => a - b);
+    const at = (fraction: number) => sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * fraction))];
+    return { p50: at(0.5), p99: at(0.99), max: sorted[sorted.length - 1] };
+}
+
+async function measure(name: string, stream: Duplex): Promise<LatencySummary> {
+    const pending: Buffer[] = [];
+    const latenciesMs: number[] = [];
+
+    for (let i = 0; i < MESSAGE_COUNT; ++i) {
+        const message = createMessage(i);
+
+        const start = process.hrtime.bigint();
+        stream.write(message);
+        const reply = await readExactly(stream, MESSAGE_SIZE, pending);
+        latenciesMs.push(Number(process.hrtime.bigint() - start) / 1e6);
+
+        if (!reply.equals(message)) {
+            throw new Error(`${name}: message ${i} came back as ${reply.toString("hex")}`);
+        }
+    }
+
+    stream.destroy();
+
+    const summary = summarize(latenciesMs);
+    console.info(
+        `${name.padEnd(4)} p50 ${summary.p50.toFixed(2)} ms, ` +
+        `p99 ${summary.p99.toFixed(2)} ms, max ${summary.max.toFixed(2)} ms`
+    );
+    return summary;
+}
+
+async function main(): Promise<void> {
+    const tcpServer = createServer((socket: Socket) => {
+        socket.setNoDelay(true);
+        echo(socket);
+    });
+    await new Promise<void>(resolve => tcpServer.listen(0, "127.0.0.1", resolve));
+    const tcpPort = (tcpServer.address() as AddressInfo).port;
+
+    const udpServer = new DatagramServer(stream => echo(stream));
+    udpServer.listen(UDP_PORT, "127.0.0.1");
+
+    console.info(`Echoing ${MESSAGE_COUNT} messages of ${MESSAGE_SIZE} bytes one at a time`);
+
+    const tcpSocket = createConnection(tcpPort, "127.0.0.1");
+    tcpSocket.setNoDelay(true);
+    await new Promise(resolve => tcpSocket.once("connect", resolve));
+    const tcp = await measure("TCP", tcpSocket);
+
+    const udpStream = await connectDatagramStream(UDP_PORT, "127.0.0.1", CONNECT_TIMEOUT_MS);
+    const udp = await measure("UDP", udpStream);
+
+    if (process.env.TRANSPORT_TEST_LOSSY && udp.p99 >= tcp.p99) {
+        throw new Error(`UDP's p99 (${udp.p99.toFixed(2)} ms) is no better than TCP's (${tcp.p99.toFixed(2)} ms)`);
+    }
+}
+
+main().then(
+    () => process.exit(0),
+    (err: Error) => {
+        console.error(err.message);
+        process.exit(1);
+    }
+);